@@ -0,0 +1,70 @@
+#include "AccessPattern.hpp"
+
+namespace rock_replay_cpp
+{
+
+AccessPattern::AccessPattern()
+    : last_(-1)
+    , stride_(0)
+    , run_(0)
+    , next_advice_(0)
+{
+}
+
+bool AccessPattern::access(size_t index)
+{
+  int64_t delta = (int64_t)index - last_;
+  if (last_ >= 0 && delta == 0)
+    return false;
+
+  if (last_ >= 0 && delta == stride_)
+  {
+    run_++;
+  }
+  else
+  {
+    // the window advised for the previous pattern does not apply anymore
+    stride_ = delta;
+    run_ = 1;
+    next_advice_ = index;
+  }
+  last_ = index;
+
+  if (kind() == Random)
+    return false;
+
+  if ((stride_ > 0 && (int64_t)index < next_advice_) || (stride_ < 0 && (int64_t)index > next_advice_))
+    return false;
+
+  next_advice_ = index + stride_ * WINDOW_SAMPLES / 2;
+  return true;
+}
+
+AccessPattern::Kind AccessPattern::kind() const
+{
+  if (run_ < MINIMUM_RUN)
+    return Random;
+  if (stride_ == 1)
+    return Forward;
+  if (stride_ == -1)
+    return Backward;
+  return Strided;
+}
+
+void AccessPattern::window(size_t total, std::vector<size_t> &indices) const
+{
+  indices.clear();
+  if (kind() == Random)
+    return;
+
+  int64_t index = last_;
+  for (int i = 0; i < WINDOW_SAMPLES; i++)
+  {
+    index += stride_;
+    if (index < 0 || index >= (int64_t)total)
+      break;
+    indices.push_back(index);
+  }
+}
+
+} // namespace rock_replay_cpp
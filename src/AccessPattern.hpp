@@ -0,0 +1,62 @@
+#ifndef AccessPattern_hpp
+#define AccessPattern_hpp
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Classifies the sample indices read from a stream as sequential
+ * forward or backward, strided or random, and tells when the next
+ * read-ahead window should be advised to the kernel.
+ */
+class AccessPattern
+{
+public:
+  enum Kind
+  {
+    Random,
+    Forward,
+    Backward,
+    Strided
+  };
+
+  AccessPattern();
+
+  /**
+   * Records a read. Returns true when the samples of window() should be
+   * advised, i.e. when the pattern is not random and the read reached
+   * the middle of the previous window.
+   */
+  bool access(size_t index);
+
+  Kind kind() const;
+
+  int64_t stride() const
+  {
+    return stride_;
+  }
+
+  /** The next WINDOW_SAMPLES samples in the direction of the reads, below total */
+  void window(size_t total, std::vector<size_t> &indices) const;
+
+  // consecutive reads with the same stride before the pattern is trusted
+  static const int MINIMUM_RUN = 3;
+
+  static const int WINDOW_SAMPLES = 128;
+
+private:
+  int64_t last_;
+  int64_t stride_;
+  int run_;
+
+  // index after which the next window is advised, in the direction of the reads
+  int64_t next_advice_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* AccessPattern_hpp */
@@ -0,0 +1,436 @@
+#include <iostream>
+#include <stdexcept>
+#include "ArrowExporter.hpp"
+
+#ifdef HAVE_ARROW
+#include <algorithm>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QThread>
+#include <QtConcurrentMap>
+#include <pocolog_cpp/Format.hpp>
+#include <typelib/typemodel.hh>
+#include <typelib/value_ops.hh>
+#include "ArrowWriter.hpp"
+#endif
+
+namespace rock_replay_cpp
+{
+
+#ifdef HAVE_ARROW
+
+namespace
+{
+
+struct Column
+{
+  // name, kind and value type of the column in the file
+  ArrowColumn arrow;
+
+  // offset of the field in the sample, or of the array / container
+  size_t offset;
+
+  // for lists: the array or container, the offset of the numeric inside
+  // one element and the distance between two elements
+  const Typelib::Type *owner;
+  size_t element_offset;
+  size_t element_size;
+};
+
+struct ExportJob
+{
+  const Typelib::Type *type;
+  std::vector<Column> columns;
+  const ArrowFile *file;
+  LogReader *reader;
+  const StreamIndex *index;
+  BufferPool *pool;
+};
+
+// samples read at once by a batch, bounds the payloads held per thread
+const size_t READ_CHUNK_SIZE = 64;
+
+struct Batch
+{
+  const ExportJob *job;
+  std::vector<size_t> indices;
+  QSharedPointer<ArrowBatch> result;
+  std::string error;
+};
+
+std::string joinName(const std::string &prefix, const std::string &name)
+{
+  return prefix.empty() ? name : prefix + "." + name;
+}
+
+ArrowColumn::Type numericType(const Typelib::Type &type)
+{
+  if (type.getCategory() == Typelib::Type::Enum)
+    return ArrowColumn::Int32;
+
+  const Typelib::Numeric &numeric = static_cast<const Typelib::Numeric &>(type);
+  switch (numeric.getNumericCategory())
+  {
+  case Typelib::Numeric::Float:
+    return numeric.getSize() == 4 ? ArrowColumn::Float : ArrowColumn::Double;
+  case Typelib::Numeric::SInt:
+    switch (numeric.getSize())
+    {
+    case 1: return ArrowColumn::Int8;
+    case 2: return ArrowColumn::Int16;
+    case 4: return ArrowColumn::Int32;
+    default: return ArrowColumn::Int64;
+    }
+  default:
+    switch (numeric.getSize())
+    {
+    case 1: return ArrowColumn::UInt8;
+    case 2: return ArrowColumn::UInt16;
+    case 4: return ArrowColumn::UInt32;
+    default: return ArrowColumn::UInt64;
+    }
+  }
+}
+
+void collectElementColumns(const Typelib::Type &element,
+                           const std::string &name,
+                           size_t element_offset,
+                           const Typelib::Type &owner,
+                           size_t owner_offset,
+                           std::vector<Column> &columns)
+{
+  switch (element.getCategory())
+  {
+  case Typelib::Type::Numeric:
+  case Typelib::Type::Enum:
+  {
+    const Typelib::Indirect &indirect = static_cast<const Typelib::Indirect &>(owner);
+
+    Column column;
+    column.arrow.name = name;
+    column.arrow.kind = ArrowColumn::List;
+    column.arrow.type = numericType(element);
+    column.offset = owner_offset;
+    column.owner = &owner;
+    column.element_offset = element_offset;
+    column.element_size = indirect.getIndirection().getSize();
+    columns.push_back(column);
+    break;
+  }
+  case Typelib::Type::Compound:
+  {
+    const Typelib::Compound::FieldList &fields = static_cast<const Typelib::Compound &>(element).getFields();
+    for (Typelib::Compound::FieldList::const_iterator it = fields.begin(); it != fields.end(); it++)
+      collectElementColumns(it->getType(), joinName(name, it->getName()),
+                            element_offset + it->getOffset(), owner, owner_offset, columns);
+    break;
+  }
+  default:
+    std::cout << "Ignoring field " << name << " of type " << element.getName() << std::endl;
+    break;
+  }
+}
+
+void collectColumns(const Typelib::Type &type,
+                    const std::string &name,
+                    size_t offset,
+                    std::vector<Column> &columns)
+{
+  switch (type.getCategory())
+  {
+  case Typelib::Type::Numeric:
+  case Typelib::Type::Enum:
+  {
+    Column column;
+    column.arrow.name = name.empty() ? "value" : name;
+    column.arrow.kind = ArrowColumn::Scalar;
+    column.arrow.type = numericType(type);
+    column.offset = offset;
+    column.owner = NULL;
+    column.element_offset = 0;
+    column.element_size = 0;
+    columns.push_back(column);
+    break;
+  }
+  case Typelib::Type::Compound:
+  {
+    const Typelib::Compound::FieldList &fields = static_cast<const Typelib::Compound &>(type).getFields();
+    for (Typelib::Compound::FieldList::const_iterator it = fields.begin(); it != fields.end(); it++)
+      collectColumns(it->getType(), joinName(name, it->getName()), offset + it->getOffset(), columns);
+    break;
+  }
+  case Typelib::Type::Container:
+    if (static_cast<const Typelib::Container &>(type).kind() == "/std/string")
+    {
+      Column column;
+      column.arrow.name = name;
+      column.arrow.kind = ArrowColumn::String;
+      column.arrow.type = ArrowColumn::UInt8;
+      column.offset = offset;
+      column.owner = &type;
+      column.element_offset = 0;
+      column.element_size = 1;
+      columns.push_back(column);
+      break;
+    }
+    // fall through
+  case Typelib::Type::Array:
+    collectElementColumns(static_cast<const Typelib::Indirect &>(type).getIndirection(),
+                          name, 0, type, offset, columns);
+    break;
+  default:
+    std::cout << "Ignoring field " << name << " of type " << type.getName() << std::endl;
+    break;
+  }
+}
+
+ArrowColumn timestampColumn(const std::string &name)
+{
+  ArrowColumn column;
+  column.name = name;
+  column.kind = ArrowColumn::Timestamp;
+  column.type = ArrowColumn::Int64;
+  return column;
+}
+
+std::vector<ArrowColumn> fileColumns(const std::vector<Column> &columns)
+{
+  std::vector<ArrowColumn> result;
+  result.push_back(timestampColumn("realtime"));
+  result.push_back(timestampColumn("logical"));
+  for (std::vector<Column>::const_iterator it = columns.begin(); it != columns.end(); it++)
+    result.push_back(it->arrow);
+  return result;
+}
+
+void appendColumn(const Column &column, const uint8_t *memory, ArrowBatch &batch, size_t index)
+{
+  const uint8_t *field = memory + column.offset;
+
+  switch (column.arrow.kind)
+  {
+  case ArrowColumn::Scalar:
+    batch.appendValues(index, field, 1, 0);
+    break;
+  case ArrowColumn::String:
+    batch.appendString(index, *reinterpret_cast<const std::string *>(field));
+    break;
+  case ArrowColumn::List:
+  {
+    const uint8_t *elements = field;
+    size_t count;
+
+    if (column.owner->getCategory() == Typelib::Type::Array)
+    {
+      count = static_cast<const Typelib::Array *>(column.owner)->getDimension();
+    }
+    else
+    {
+      // the elements of a /std/vector are contiguous, from the first one on
+      const Typelib::Container *container = static_cast<const Typelib::Container *>(column.owner);
+      count = container->getElementCount(field);
+      elements = count ? static_cast<const uint8_t *>(
+                             container->getElement(const_cast<uint8_t *>(field), 0).getData())
+                       : NULL;
+    }
+
+    batch.appendList(index, count ? elements + column.element_offset : NULL, count, column.element_size);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void buildBatch(Batch &batch)
+{
+  const ExportJob &job = *batch.job;
+  try
+  {
+    QSharedPointer<ArrowBatch> result(new ArrowBatch(*job.file));
+
+    std::vector<uint8_t> memory(job.type->getSize());
+    Typelib::Value value(memory.data(), *job.type);
+    Typelib::init(value);
+
+    QScopedPointer<IOBackend> backend(IOBackend::create());
+    SparseIndex::Cursor cursor;
+    std::vector<pocolog_cpp::SampleHeaderData> headers;
+    std::vector<std::vector<uint8_t> > payloads;
+
+    try
+    {
+      for (size_t first = 0; first < batch.indices.size(); first += READ_CHUNK_SIZE)
+      {
+        std::vector<size_t> chunk(batch.indices.begin() + first,
+                                  batch.indices.begin() + std::min(first + READ_CHUNK_SIZE, batch.indices.size()));
+        job.reader->readSamples(*job.index, cursor, chunk, headers, payloads, *backend, job.pool);
+
+        for (size_t i = 0; i < chunk.size(); i++)
+        {
+          const pocolog_cpp::SampleHeaderData &header = headers[i];
+          Typelib::load(value, payloads[i]);
+          job.pool->recycle(payloads[i]);
+
+          int64_t realtime = (int64_t)header.realtime_tv_sec * 1000000 + header.realtime_tv_usec;
+          int64_t logical = (int64_t)header.timestamp_tv_sec * 1000000 + header.timestamp_tv_usec;
+          result->appendTimestamp(0, realtime);
+          result->appendTimestamp(1, logical);
+
+          for (size_t j = 0; j < job.columns.size(); j++)
+            appendColumn(job.columns[j], memory.data(), *result, j + 2);
+        }
+      }
+    }
+    catch (...)
+    {
+      Typelib::destroy(value);
+      throw;
+    }
+    Typelib::destroy(value);
+
+    result->finish(batch.indices.size());
+    batch.result = result;
+  }
+  catch (std::exception &e)
+  {
+    batch.error = e.what();
+  }
+}
+
+} // namespace
+
+#endif
+
+ArrowExporter::ArrowExporter(LogReader *reader, size_t batch_size)
+    : reader_(reader)
+    , batch_size_(batch_size)
+{
+}
+
+bool ArrowExporter::available()
+{
+#ifdef HAVE_ARROW
+  return true;
+#else
+  return false;
+#endif
+}
+
+void ArrowExporter::exportStream(
+    const std::string &filename,
+    const std::string &stream_name,
+    int start_index,
+    int final_index,
+    export_stream_fcn_t fcn,
+    void *data,
+    bool cache)
+{
+#ifdef HAVE_ARROW
+  ExportJob job;
+  job.type = reader_->streamType(stream_name);
+  if (!job.type)
+    throw std::runtime_error("Stream not found: " + stream_name);
+  collectColumns(*job.type, "", 0, job.columns);
+  job.reader = reader_;
+  QSharedPointer<const StreamIndex> held_index = reader_->streamIndex(stream_name);
+  job.index = held_index.data();
+
+  BufferPool pool("arrow export " + stream_name);
+  job.pool = &pool;
+  SparseIndex::Cursor cursor;
+
+  // closed by its destructor when the export fails
+  ArrowFile file(filename, fileColumns(job.columns));
+  job.file = &file;
+
+  // the input pages already cached are left to the playback
+  PageResidency residency;
+  WriteBehind write_behind;
+  if (!cache)
+  {
+    reader_->snapshotPages(*job.index, cursor, start_index, final_index, residency);
+    write_behind.open(filename);
+  }
+
+  // build one batch per thread at a time so memory stays bounded
+  const size_t wave_size = std::max(1, QThread::idealThreadCount());
+
+  int sampleNr = start_index;
+  bool canceled = false;
+  while (sampleNr < final_index && !canceled)
+  {
+    std::vector<Batch> batches;
+    while (batches.size() < wave_size && sampleNr < final_index)
+    {
+      Batch batch;
+      batch.job = &job;
+      for (size_t i = 0; i < batch_size_ && sampleNr < final_index; i++, sampleNr++)
+        batch.indices.push_back(sampleNr);
+      batches.push_back(batch);
+    }
+
+    QtConcurrent::blockingMap(batches, buildBatch);
+
+    for (std::vector<Batch>::iterator it = batches.begin(); it != batches.end(); it++)
+    {
+      if (!it->error.empty())
+        throw std::runtime_error(it->error);
+      file.write(*it->result);
+
+      if (!cache)
+        reader_->dropPages(*job.index, cursor, it->indices, residency);
+    }
+
+    if (!cache)
+    {
+      int64_t written = file.position();
+      if (written >= 0)
+        write_behind.flush(written);
+    }
+
+    if (fcn != NULL && !fcn(sampleNr - 1, data))
+      canceled = true;
+  }
+
+  file.close();
+  write_behind.close();
+#else
+  throw std::runtime_error("rock-replay-cpp was built without Apache Arrow support");
+#endif
+}
+
+void ArrowExporter::writeTable(
+    const std::string &filename,
+    const std::vector<int64_t> &times,
+    const std::vector<std::string> &names,
+    const std::vector<std::vector<double> > &columns)
+{
+#ifdef HAVE_ARROW
+  std::vector<ArrowColumn> file_columns(1, timestampColumn("time"));
+  for (size_t c = 0; c < columns.size(); c++)
+  {
+    ArrowColumn column;
+    column.name = names[c];
+    column.kind = ArrowColumn::Scalar;
+    column.type = ArrowColumn::Double;
+    file_columns.push_back(column);
+  }
+
+  ArrowFile file(filename, file_columns);
+  ArrowBatch batch(file);
+  batch.appendTimestamps(0, times);
+
+  // NaN marks the grid points without data, they become nulls
+  for (size_t c = 0; c < columns.size(); c++)
+    batch.appendDoubles(c + 1, columns[c]);
+
+  batch.finish(times.size());
+  file.write(batch);
+  file.close();
+#else
+  throw std::runtime_error("rock-replay-cpp was built without Apache Arrow support");
+#endif
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,55 @@
+#ifndef ArrowExporter_hpp
+#define ArrowExporter_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "LogReader.hpp"
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Writes a stream interval as an Arrow IPC (Feather v2) file.
+ *
+ * The columns are derived from the Typelib description of the stream:
+ * numeric and enum fields become scalar columns, strings become utf8
+ * columns, and vectors or arrays of numerics (e.g. the Sonar bins)
+ * become list columns. Vectors of compounds are split in one list
+ * column per numeric field (e.g. bearings.rad). The realtime and logical
+ * timestamps of every sample are written as the first two columns.
+ *
+ * Record batches are decoded and built in parallel, then written in
+ * order. Without cache the samples read are dropped from the page cache
+ * after each wave of batches.
+ */
+class ArrowExporter
+{
+public:
+  ArrowExporter(LogReader *reader, size_t batch_size = 1024);
+
+  /** False when built without Apache Arrow */
+  static bool available();
+
+  void exportStream(const std::string &filename,
+                    const std::string &stream_name,
+                    int start_index,
+                    int final_index,
+                    export_stream_fcn_t fcn = NULL,
+                    void *data = NULL,
+                    bool cache = true);
+
+  /** Writes columns of doubles sampled at times, NaN values as nulls */
+  static void writeTable(const std::string &filename,
+                         const std::vector<int64_t> &times,
+                         const std::vector<std::string> &names,
+                         const std::vector<std::vector<double> > &columns);
+
+private:
+  LogReader *reader_;
+  size_t batch_size_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* ArrowExporter_hpp */
@@ -0,0 +1,246 @@
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/writer.h>
+#include "ArrowWriter.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+void check(const arrow::Status &status)
+{
+  if (!status.ok())
+    throw std::runtime_error("Arrow export failed: " + status.ToString());
+}
+
+std::shared_ptr<arrow::DataType> valueType(ArrowColumn::Type type)
+{
+  switch (type)
+  {
+  case ArrowColumn::Int8: return arrow::int8();
+  case ArrowColumn::Int16: return arrow::int16();
+  case ArrowColumn::Int32: return arrow::int32();
+  case ArrowColumn::Int64: return arrow::int64();
+  case ArrowColumn::UInt8: return arrow::uint8();
+  case ArrowColumn::UInt16: return arrow::uint16();
+  case ArrowColumn::UInt32: return arrow::uint32();
+  case ArrowColumn::UInt64: return arrow::uint64();
+  case ArrowColumn::Float: return arrow::float32();
+  default: return arrow::float64();
+  }
+}
+
+std::shared_ptr<arrow::DataType> columnType(const ArrowColumn &column)
+{
+  switch (column.kind)
+  {
+  case ArrowColumn::List: return arrow::list(valueType(column.type));
+  case ArrowColumn::String: return arrow::utf8();
+  case ArrowColumn::Timestamp: return arrow::timestamp(arrow::TimeUnit::MICRO);
+  default: return valueType(column.type);
+  }
+}
+
+template <typename ArrowType>
+void appendNumeric(arrow::ArrayBuilder *builder,
+                   const uint8_t *data,
+                   size_t count,
+                   size_t stride)
+{
+  typedef typename ArrowType::c_type c_type;
+  arrow::NumericBuilder<ArrowType> *numeric =
+      static_cast<arrow::NumericBuilder<ArrowType> *>(builder);
+
+  if (stride == sizeof(c_type))
+  {
+    // contiguous elements (e.g. the bins of a ping) go in with one copy
+    check(numeric->AppendValues(reinterpret_cast<const c_type *>(data), count));
+    return;
+  }
+
+  check(numeric->Reserve(count));
+  for (size_t i = 0; i < count; i++)
+  {
+    c_type value;
+    memcpy(&value, data + i * stride, sizeof(value));
+    numeric->UnsafeAppend(value);
+  }
+}
+
+void appendNumerics(ArrowColumn::Type type,
+                    arrow::ArrayBuilder *builder,
+                    const uint8_t *data,
+                    size_t count,
+                    size_t stride)
+{
+  switch (type)
+  {
+  case ArrowColumn::Int8: appendNumeric<arrow::Int8Type>(builder, data, count, stride); break;
+  case ArrowColumn::Int16: appendNumeric<arrow::Int16Type>(builder, data, count, stride); break;
+  case ArrowColumn::Int32: appendNumeric<arrow::Int32Type>(builder, data, count, stride); break;
+  case ArrowColumn::Int64: appendNumeric<arrow::Int64Type>(builder, data, count, stride); break;
+  case ArrowColumn::UInt8: appendNumeric<arrow::UInt8Type>(builder, data, count, stride); break;
+  case ArrowColumn::UInt16: appendNumeric<arrow::UInt16Type>(builder, data, count, stride); break;
+  case ArrowColumn::UInt32: appendNumeric<arrow::UInt32Type>(builder, data, count, stride); break;
+  case ArrowColumn::UInt64: appendNumeric<arrow::UInt64Type>(builder, data, count, stride); break;
+  case ArrowColumn::Float: appendNumeric<arrow::FloatType>(builder, data, count, stride); break;
+  case ArrowColumn::Double: appendNumeric<arrow::DoubleType>(builder, data, count, stride); break;
+  }
+}
+
+} // namespace
+
+struct ArrowFile::Impl
+{
+  std::vector<ArrowColumn> columns;
+  std::shared_ptr<arrow::Schema> schema;
+  std::shared_ptr<arrow::io::FileOutputStream> sink;
+  std::shared_ptr<arrow::ipc::RecordBatchWriter> writer;
+  bool closed;
+};
+
+struct ArrowBatch::Impl
+{
+  const std::vector<ArrowColumn> *columns;
+  std::shared_ptr<arrow::Schema> schema;
+  std::vector<std::unique_ptr<arrow::ArrayBuilder> > builders;
+  std::shared_ptr<arrow::RecordBatch> result;
+};
+
+ArrowBatch::ArrowBatch(const ArrowFile &file)
+    : impl_(new Impl())
+{
+  impl_->columns = &file.impl_->columns;
+  impl_->schema = file.impl_->schema;
+  impl_->builders.resize(impl_->columns->size());
+  try
+  {
+    for (size_t i = 0; i < impl_->builders.size(); i++)
+      check(arrow::MakeBuilder(arrow::default_memory_pool(), impl_->schema->field(i)->type(), &impl_->builders[i]));
+  }
+  catch (...)
+  {
+    delete impl_;
+    throw;
+  }
+}
+
+ArrowBatch::~ArrowBatch()
+{
+  delete impl_;
+}
+
+void ArrowBatch::appendTimestamp(size_t column, int64_t time)
+{
+  check(static_cast<arrow::TimestampBuilder *>(impl_->builders[column].get())->Append(time));
+}
+
+void ArrowBatch::appendValues(size_t column, const uint8_t *data, size_t count, size_t stride)
+{
+  appendNumerics((*impl_->columns)[column].type, impl_->builders[column].get(), data, count, stride);
+}
+
+void ArrowBatch::appendList(size_t column, const uint8_t *data, size_t count, size_t stride)
+{
+  arrow::ListBuilder *list = static_cast<arrow::ListBuilder *>(impl_->builders[column].get());
+  check(list->Append());
+  if (count)
+    appendNumerics((*impl_->columns)[column].type, list->value_builder(), data, count, stride);
+}
+
+void ArrowBatch::appendString(size_t column, const std::string &value)
+{
+  check(static_cast<arrow::StringBuilder *>(impl_->builders[column].get())->Append(value));
+}
+
+void ArrowBatch::appendDoubles(size_t column, const std::vector<double> &values)
+{
+  std::vector<bool> valid(values.size());
+  for (size_t i = 0; i < valid.size(); i++)
+    valid[i] = values[i] == values[i];
+  check(static_cast<arrow::DoubleBuilder *>(impl_->builders[column].get())->AppendValues(values, valid));
+}
+
+void ArrowBatch::appendTimestamps(size_t column, const std::vector<int64_t> &times)
+{
+  check(static_cast<arrow::TimestampBuilder *>(impl_->builders[column].get())->AppendValues(times));
+}
+
+void ArrowBatch::finish(size_t rows)
+{
+  std::vector<std::shared_ptr<arrow::Array> > arrays(impl_->builders.size());
+  for (size_t i = 0; i < impl_->builders.size(); i++)
+    check(impl_->builders[i]->Finish(&arrays[i]));
+  impl_->result = arrow::RecordBatch::Make(impl_->schema, rows, arrays);
+}
+
+ArrowFile::ArrowFile(const std::string &filename, const std::vector<ArrowColumn> &columns)
+    : impl_(new Impl())
+{
+  impl_->columns = columns;
+  impl_->closed = false;
+
+  try
+  {
+    std::vector<std::shared_ptr<arrow::Field> > fields;
+    for (std::vector<ArrowColumn>::const_iterator it = columns.begin(); it != columns.end(); it++)
+      fields.push_back(arrow::field(it->name, columnType(*it)));
+    impl_->schema = arrow::schema(fields);
+
+    arrow::Result<std::shared_ptr<arrow::io::FileOutputStream> > sink_result =
+        arrow::io::FileOutputStream::Open(filename);
+    check(sink_result.status());
+    impl_->sink = *sink_result;
+
+    arrow::Result<std::shared_ptr<arrow::ipc::RecordBatchWriter> > writer_result =
+        arrow::ipc::MakeFileWriter(impl_->sink, impl_->schema);
+    check(writer_result.status());
+    impl_->writer = *writer_result;
+  }
+  catch (...)
+  {
+    if (impl_->sink)
+      (void)impl_->sink->Close();
+    delete impl_;
+    throw;
+  }
+}
+
+ArrowFile::~ArrowFile()
+{
+  // the partial file of a failed export, the error reported is the one of the export
+  if (!impl_->closed)
+  {
+    (void)impl_->writer->Close();
+    (void)impl_->sink->Close();
+  }
+  delete impl_;
+}
+
+void ArrowFile::write(const ArrowBatch &batch)
+{
+  check(impl_->writer->WriteRecordBatch(*batch.impl_->result));
+}
+
+int64_t ArrowFile::position() const
+{
+  // the file output stream of Arrow does not buffer, what it wrote is in the file
+  arrow::Result<int64_t> written = impl_->sink->Tell();
+  return written.ok() ? *written : -1;
+}
+
+void ArrowFile::close()
+{
+  impl_->closed = true;
+  arrow::Status status = impl_->writer->Close();
+  arrow::Status sink_status = impl_->sink->Close();
+  check(status);
+  check(sink_status);
+}
+
+} // namespace rock_replay_cpp
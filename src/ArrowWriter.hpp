@@ -0,0 +1,123 @@
+#ifndef ArrowWriter_hpp
+#define ArrowWriter_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Column of an Arrow file: a scalar, a list of scalars, a utf8 string or
+ * a timestamp in microseconds.
+ */
+struct ArrowColumn
+{
+  enum Kind
+  {
+    Scalar,
+    List,
+    String,
+    Timestamp
+  };
+
+  enum Type
+  {
+    Int8,
+    Int16,
+    Int32,
+    Int64,
+    UInt8,
+    UInt16,
+    UInt32,
+    UInt64,
+    Float,
+    Double
+  };
+
+  std::string name;
+  Kind kind;
+
+  // of the scalars and of the list elements
+  Type type;
+};
+
+class ArrowFile;
+
+/**
+ * Record batch of an ArrowFile, built row by row. Batches of the same
+ * file may be built by several threads at once.
+ */
+class ArrowBatch
+{
+public:
+  explicit ArrowBatch(const ArrowFile &file);
+
+  ~ArrowBatch();
+
+  void appendTimestamp(size_t column, int64_t time);
+
+  /** Appends count values of the column type, stride bytes apart */
+  void appendValues(size_t column, const uint8_t *data, size_t count, size_t stride);
+
+  /** Appends one list of count values of the column type, stride bytes apart */
+  void appendList(size_t column, const uint8_t *data, size_t count, size_t stride);
+
+  void appendString(size_t column, const std::string &value);
+
+  /** Appends a whole Double column, NaN values as nulls */
+  void appendDoubles(size_t column, const std::vector<double> &values);
+
+  void appendTimestamps(size_t column, const std::vector<int64_t> &times);
+
+  /** Ends the batch, rows is the number of values appended to each column */
+  void finish(size_t rows);
+
+private:
+  ArrowBatch(const ArrowBatch &);
+  ArrowBatch &operator=(const ArrowBatch &);
+
+  friend class ArrowFile;
+
+  struct Impl;
+  Impl *impl_;
+};
+
+/**
+ * Arrow IPC (Feather v2) file written batch after batch.
+ *
+ * This is the only interface to Apache Arrow: Arrow needs C++17 while the
+ * Qt 4 and Typelib headers are not built with it, so the implementation
+ * is built in a library of its own and nothing of Arrow, Qt or Typelib
+ * appears here. Errors are thrown as std::runtime_error.
+ */
+class ArrowFile
+{
+public:
+  ArrowFile(const std::string &filename, const std::vector<ArrowColumn> &columns);
+
+  /** Closes the file if close() was not called, errors are ignored */
+  ~ArrowFile();
+
+  /** Writes a batch built and finished for this file */
+  void write(const ArrowBatch &batch);
+
+  /** Bytes written to the file so far, -1 if unknown */
+  int64_t position() const;
+
+  void close();
+
+private:
+  ArrowFile(const ArrowFile &);
+  ArrowFile &operator=(const ArrowFile &);
+
+  friend class ArrowBatch;
+
+  struct Impl;
+  Impl *impl_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* ArrowWriter_hpp */
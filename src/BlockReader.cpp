@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include "BlockReader.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+// read instead of a whole window after a block larger than the window
+const size_t HEADER_READ_SIZE = 4096;
+
+// block header and sample header, read together for data blocks
+const size_t HEADERS_SIZE = sizeof(pocolog_cpp::BlockHeader) + sizeof(pocolog_cpp::SampleHeaderData);
+
+bool readString(const uint8_t *payload, size_t size, size_t &offset, std::string &str)
+{
+  uint32_t length;
+  if (offset + sizeof(length) > size)
+    return false;
+
+  memcpy(&length, payload + offset, sizeof(length));
+  offset += sizeof(length);
+
+  if (offset + length > size)
+    return false;
+
+  str.assign((const char *)payload + offset, length);
+  offset += length;
+  return true;
+}
+
+} // namespace
+
+BlockReader::BlockReader(int fd, int64_t file_size, int64_t pos)
+    : fd_(fd)
+    , file_size_(file_size)
+    , window_(WINDOW_SIZE)
+    , window_pos_(0)
+    , window_size_(0)
+    , read_size_(WINDOW_SIZE)
+    , pos_(-1)
+    , next_(pos)
+{
+  memset(&header_, 0, sizeof(header_));
+}
+
+bool BlockReader::fill(int64_t pos, size_t size)
+{
+  if (pos >= window_pos_ && pos + (int64_t)size <= window_pos_ + window_size_)
+    return true;
+
+  if (pos + (int64_t)size > file_size_)
+    return false;
+
+  size_t read_size = std::max(size, read_size_);
+  if (window_.size() < read_size)
+    window_.resize(read_size);
+
+  ssize_t count = pread(fd_, window_.data(), read_size, pos);
+  if (count < (ssize_t)size)
+    return false;
+
+  window_pos_ = pos;
+  window_size_ = count;
+  return true;
+}
+
+bool BlockReader::next()
+{
+  size_t available = std::min<int64_t>(HEADERS_SIZE, file_size_ - next_);
+  if (next_ >= file_size_ || available < sizeof(header_) || !fill(next_, available))
+    return false;
+
+  pocolog_cpp::BlockHeader header;
+  memcpy(&header, window_.data() + (next_ - window_pos_), sizeof(header));
+
+  int64_t end = next_ + sizeof(header) + header.data_size;
+  if (header.padding != 0 || end > file_size_)
+    return false;
+
+  header_ = header;
+  pos_ = next_;
+  next_ = end;
+
+  read_size_ = header.data_size >= WINDOW_SIZE ? HEADER_READ_SIZE : WINDOW_SIZE;
+  return true;
+}
+
+bool BlockReader::sampleHeader(pocolog_cpp::SampleHeaderData &sample)
+{
+  if (header_.type != pocolog_cpp::DataBlockType || header_.data_size < sizeof(sample) ||
+      !fill(pos_ + sizeof(header_), sizeof(sample)))
+    return false;
+
+  memcpy(&sample, window_.data() + (pos_ + sizeof(header_) - window_pos_), sizeof(sample));
+  return true;
+}
+
+bool BlockReader::streamDeclaration(std::string &name, std::string &type_name)
+{
+  if (header_.type != pocolog_cpp::StreamBlockType || header_.data_size == 0 ||
+      !fill(pos_ + sizeof(header_), header_.data_size))
+    return false;
+
+  const uint8_t *payload = window_.data() + (pos_ + sizeof(header_) - window_pos_);
+  size_t offset = 1;
+  return payload[0] == pocolog_cpp::DataStreamType &&
+         readString(payload, header_.data_size, offset, name) &&
+         readString(payload, header_.data_size, offset, type_name);
+}
+
+bool BlockReader::streamBlock(std::vector<uint8_t> &payload)
+{
+  if (header_.type != pocolog_cpp::StreamBlockType || header_.data_size == 0 ||
+      !fill(pos_ + sizeof(header_), header_.data_size))
+    return false;
+
+  const uint8_t *data = window_.data() + (pos_ + sizeof(header_) - window_pos_);
+  payload.assign(data, data + header_.data_size);
+  return true;
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,80 @@
+#ifndef BlockReader_hpp
+#define BlockReader_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pocolog_cpp/Format.hpp>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Walks the blocks of a log file through a read window, without
+ * reading the sample payloads. Small blocks are served from one read
+ * of the window, after a large block only the next headers are read.
+ */
+class BlockReader
+{
+public:
+  /** Starts at pos, the first block after the prologue by default */
+  BlockReader(int fd, int64_t file_size, int64_t pos = sizeof(pocolog_cpp::Prologue));
+
+  /** Moves to the next block, false at the end of the file or at a truncated block */
+  bool next();
+
+  const pocolog_cpp::BlockHeader &header() const
+  {
+    return header_;
+  }
+
+  /** Offset of the block header */
+  int64_t position() const
+  {
+    return pos_;
+  }
+
+  /** Offset of the sample payload of a data block */
+  int64_t payloadPosition() const
+  {
+    return pos_ + sizeof(pocolog_cpp::BlockHeader) + sizeof(pocolog_cpp::SampleHeaderData);
+  }
+
+  /** Sample header of a data block */
+  bool sampleHeader(pocolog_cpp::SampleHeaderData &sample);
+
+  /** Name and type of a data stream declaration, false for other blocks */
+  bool streamDeclaration(std::string &name, std::string &type_name);
+
+  /** Whole payload of a stream declaration, false for other blocks */
+  bool streamBlock(std::vector<uint8_t> &payload);
+
+  /** True once the walk stopped exactly at the end of the file */
+  bool complete() const
+  {
+    return next_ == file_size_;
+  }
+
+  // bytes read at once while walking the blocks of a file
+  static const size_t WINDOW_SIZE = 64 * 1024;
+
+private:
+  /** Makes [pos, pos + size) available in the window, false past the end of the file */
+  bool fill(int64_t pos, size_t size);
+
+  int fd_;
+  int64_t file_size_;
+
+  std::vector<uint8_t> window_;
+  int64_t window_pos_;
+  int64_t window_size_;
+  size_t read_size_;
+
+  pocolog_cpp::BlockHeader header_;
+  int64_t pos_;
+  int64_t next_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* BlockReader_hpp */
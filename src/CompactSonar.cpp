@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <typelib/value_ops.hh>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "CompactSonar.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+int cache_bits = 0;
+
+// bits, count, scale and offset in front of the codes
+const size_t BINS_HEADER_SIZE = 1 + sizeof(uint32_t) + 2 * sizeof(float);
+
+/** Reads the header written by serializeBins, returns the size of the codes behind it */
+size_t readBinsHeader(const uint8_t *data, size_t size, int &bits, uint32_t &count, float &scale, float &offset)
+{
+  if (size < BINS_HEADER_SIZE || (data[0] != 8 && data[0] != 16))
+    throw std::runtime_error("Invalid compact sonar bins");
+
+  bits = data[0];
+  memcpy(&count, data + 1, sizeof(count));
+  memcpy(&scale, data + 1 + sizeof(count), sizeof(scale));
+  memcpy(&offset, data + 1 + sizeof(count) + sizeof(scale), sizeof(offset));
+
+  const size_t code_size = (size_t)count * (bits / 8);
+  if (size - BINS_HEADER_SIZE < code_size)
+    throw std::runtime_error("Truncated compact sonar bins");
+  return code_size;
+}
+
+/** bins[i] = offset + code[i] * scale, the codes may be unaligned */
+void dequantizeCodes(const uint8_t *codes, int bits, float scale_value, float offset_value, float *bins, size_t count)
+{
+  size_t i = 0;
+  if (bits == 8)
+  {
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(scale_value);
+    const __m128 offset = _mm_set1_ps(offset_value);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16)
+    {
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + i));
+      __m128i low = _mm_unpacklo_epi8(bytes, zero);
+      __m128i high = _mm_unpackhi_epi8(bytes, zero);
+      _mm_storeu_ps(bins + i, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero)), scale), offset));
+      _mm_storeu_ps(bins + i + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero)), scale), offset));
+      _mm_storeu_ps(bins + i + 8, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero)), scale), offset));
+      _mm_storeu_ps(bins + i + 12, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero)), scale), offset));
+    }
+#endif
+    for (; i < count; i++)
+      bins[i] = offset_value + codes[i] * scale_value;
+  }
+  else
+  {
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(scale_value);
+    const __m128 offset = _mm_set1_ps(offset_value);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i words = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + 2 * i));
+      _mm_storeu_ps(bins + i, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero)), scale), offset));
+      _mm_storeu_ps(bins + i + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero)), scale), offset));
+    }
+#endif
+    for (; i < count; i++)
+    {
+      uint16_t code;
+      memcpy(&code, codes + 2 * i, sizeof(code));
+      bins[i] = offset_value + code * scale_value;
+    }
+  }
+}
+
+} // namespace
+
+CompactSonar::CompactSonar()
+    : bits_(8)
+    , count_(0)
+    , scale_(0)
+    , offset_(0)
+{
+}
+
+void CompactSonar::assign(const base::samples::Sonar &sonar, int bits)
+{
+  if (bits != 8 && bits != 16)
+    throw std::runtime_error("Sonar bins are quantized on 8 or 16 bits");
+
+  header_.time = sonar.time;
+  header_.timestamps = sonar.timestamps;
+  header_.bin_duration = sonar.bin_duration;
+  header_.beam_width = sonar.beam_width;
+  header_.beam_height = sonar.beam_height;
+  header_.bearings = sonar.bearings;
+  header_.speed_of_sound = sonar.speed_of_sound;
+  header_.bin_count = sonar.bin_count;
+  header_.beam_count = sonar.beam_count;
+  header_.bins.clear();
+
+  bits_ = bits;
+  count_ = sonar.bins.size();
+
+  // bins that are not finite are left out of the range, and stored as its minimum
+  float minimum = 0, maximum = 0;
+  bool found = false;
+  for (std::vector<float>::const_iterator it = sonar.bins.begin(); it != sonar.bins.end(); it++)
+  {
+    if (!std::isfinite(*it))
+      continue;
+
+    minimum = found ? std::min(minimum, *it) : *it;
+    maximum = found ? std::max(maximum, *it) : *it;
+    found = true;
+  }
+
+  const float levels = bits == 8 ? 255.0f : 65535.0f;
+  offset_ = minimum;
+  scale_ = (maximum - minimum) / levels;
+  const float inverse = scale_ > 0 ? 1 / scale_ : 0;
+
+  codes_.resize(count_ * (bits / 8));
+  uint8_t *codes8 = codes_.data();
+  uint16_t *codes16 = reinterpret_cast<uint16_t *>(codes_.data());
+  for (size_t i = 0; i < count_; i++)
+  {
+    float code = (sonar.bins[i] - offset_) * inverse + 0.5f;
+    code = std::isnan(code) ? 0 : std::min(levels, std::max(0.0f, code));
+    if (bits == 8)
+      codes8[i] = (uint8_t)code;
+    else
+      codes16[i] = (uint16_t)code;
+  }
+}
+
+void CompactSonar::expand(base::samples::Sonar &sonar) const
+{
+  sonar = header_;
+  sonar.bins.resize(count_);
+  if (count_ > 0)
+    dequantize(sonar.bins.data(), 0, count_);
+}
+
+void CompactSonar::dequantize(float *bins, size_t first, size_t count) const
+{
+  if (first + count > count_)
+    throw std::runtime_error("Sonar bins out of range");
+
+  dequantizeCodes(codes_.data() + first * (bits_ / 8), bits_, scale_, offset_, bins, count);
+}
+
+size_t CompactSonar::expandBins(const uint8_t *data, size_t size, std::vector<float> &bins)
+{
+  int bits;
+  uint32_t count;
+  float scale, offset;
+  const size_t code_size = readBinsHeader(data, size, bits, count, scale, offset);
+
+  bins.resize(count);
+  if (count > 0)
+    dequantizeCodes(data + BINS_HEADER_SIZE, bits, scale, offset, bins.data(), count);
+  return BINS_HEADER_SIZE + code_size;
+}
+
+void CompactSonar::serializeBins(std::vector<uint8_t> &bytes) const
+{
+  size_t start = bytes.size();
+  bytes.resize(start + BINS_HEADER_SIZE + codes_.size());
+  uint8_t *data = bytes.data() + start;
+
+  uint32_t count = count_;
+  data[0] = (uint8_t)bits_;
+  memcpy(data + 1, &count, sizeof(count));
+  memcpy(data + 1 + sizeof(count), &scale_, sizeof(scale_));
+  memcpy(data + 1 + sizeof(count) + sizeof(scale_), &offset_, sizeof(offset_));
+  if (!codes_.empty())
+    memcpy(data + BINS_HEADER_SIZE, codes_.data(), codes_.size());
+}
+
+size_t CompactSonar::deserializeBins(const uint8_t *data, size_t size)
+{
+  int bits;
+  uint32_t count;
+  const size_t code_size = readBinsHeader(data, size, bits, count, scale_, offset_);
+  bits_ = bits;
+  count_ = count;
+
+  codes_.assign(data + BINS_HEADER_SIZE, data + BINS_HEADER_SIZE + code_size);
+  return BINS_HEADER_SIZE + code_size;
+}
+
+size_t CompactSonar::memoryUsage() const
+{
+  return sizeof(*this) + codes_.capacity() + header_.timestamps.capacity() * sizeof(base::Time) +
+         header_.bearings.capacity() * sizeof(base::Angle);
+}
+
+SonarPayloadCodec::SonarPayloadCodec(const Typelib::Type *type, int bits)
+    : type_(type)
+    , bits_(bits)
+{
+  if (bits != 8 && bits != 16)
+    throw std::runtime_error("Sonar bins are quantized on 8 or 16 bits");
+}
+
+void SonarPayloadCodec::encode(const std::vector<uint8_t> &payload, std::vector<uint8_t> &encoded) const
+{
+  base::samples::Sonar sonar;
+  Typelib::Value value(&sonar, *type_);
+  Typelib::load(value, payload);
+
+  CompactSonar compact;
+  compact.assign(sonar, bits_);
+
+  // the ping without its bins is kept marshalled, in front of them
+  sonar.bins.clear();
+  std::vector<uint8_t> header;
+  Typelib::dump(value, header);
+
+  uint32_t header_size = header.size();
+  encoded.resize(sizeof(header_size));
+  memcpy(encoded.data(), &header_size, sizeof(header_size));
+  encoded.insert(encoded.end(), header.begin(), header.end());
+  compact.serializeBins(encoded);
+}
+
+void SonarPayloadCodec::decode(const std::vector<uint8_t> &encoded, std::vector<uint8_t> &payload) const
+{
+  base::samples::Sonar sonar;
+  decodeSample(encoded, &sonar);
+
+  Typelib::Value value(&sonar, *type_);
+  payload.clear();
+  Typelib::dump(value, payload);
+}
+
+const std::type_info *SonarPayloadCodec::sampleType() const
+{
+  return &typeid(base::samples::Sonar);
+}
+
+void SonarPayloadCodec::decodeSample(const std::vector<uint8_t> &encoded, void *sample) const
+{
+  uint32_t header_size;
+  if (encoded.size() < sizeof(header_size))
+    throw std::runtime_error("Invalid compact sonar payload");
+  memcpy(&header_size, encoded.data(), sizeof(header_size));
+  if (encoded.size() - sizeof(header_size) < header_size)
+    throw std::runtime_error("Invalid compact sonar payload");
+
+  // only the ping without its bins is unmarshalled, the bins are
+  // dequantized from the cache straight into the sample
+  base::samples::Sonar &sonar = *static_cast<base::samples::Sonar *>(sample);
+  Typelib::Value value(&sonar, *type_);
+  Typelib::load(value, encoded.data() + sizeof(header_size), header_size);
+
+  const size_t bins_offset = sizeof(header_size) + header_size;
+  CompactSonar::expandBins(encoded.data() + bins_offset, encoded.size() - bins_offset, sonar.bins);
+}
+
+int SonarPayloadCodec::cacheBits()
+{
+  return cache_bits;
+}
+
+void SonarPayloadCodec::setCacheBits(int bits)
+{
+  if (bits != 0 && bits != 8 && bits != 16)
+    throw std::runtime_error("Sonar bins are quantized on 8 or 16 bits");
+  cache_bits = bits;
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,111 @@
+#ifndef CompactSonar_hpp
+#define CompactSonar_hpp
+
+#include <vector>
+#include <stdint.h>
+#include <base/samples/Sonar.hpp>
+#include "SamplePrefetcher.hpp"
+
+namespace Typelib
+{
+class Type;
+}
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Sonar ping with its bins quantized on 8 or 16 bits.
+ *
+ * The intensities are mapped linearly from the range of the ping, so a
+ * bin is offset + code * scale. Devices produce 8 to 16 bit intensities,
+ * which the quantization keeps while taking 4 or 2 times less memory than
+ * the float bins of base::samples::Sonar.
+ */
+class CompactSonar
+{
+public:
+  CompactSonar();
+
+  /** Quantizes the bins of sonar, the other fields are copied as they are */
+  void assign(const base::samples::Sonar &sonar, int bits = 8);
+
+  /** The ping with its bins converted back to float */
+  void expand(base::samples::Sonar &sonar) const;
+
+  /** Converts count bins from first on back to float */
+  void dequantize(float *bins, size_t first, size_t count) const;
+
+  /** The fields of the ping but the bins */
+  const base::samples::Sonar &header() const
+  {
+    return header_;
+  }
+
+  size_t size() const
+  {
+    return count_;
+  }
+
+  int bits() const
+  {
+    return bits_;
+  }
+
+  /** Appends the quantized bins to bytes */
+  void serializeBins(std::vector<uint8_t> &bytes) const;
+
+  /** Reads the bins written by serializeBins, returns the bytes used */
+  size_t deserializeBins(const uint8_t *data, size_t size);
+
+  /** Converts the bins written by serializeBins straight to float, returns the bytes used */
+  static size_t expandBins(const uint8_t *data, size_t size, std::vector<float> &bins);
+
+  size_t memoryUsage() const;
+
+private:
+  base::samples::Sonar header_;
+  int bits_;
+  size_t count_;
+  float scale_;
+  float offset_;
+  std::vector<uint8_t> codes_;
+};
+
+/**
+ * Keeps the sonar payloads cached by a SamplePrefetcher in the form of
+ * a CompactSonar: the ping without its bins, marshalled by Typelib,
+ * followed by the quantized bins.
+ */
+class SonarPayloadCodec : public PayloadCodec
+{
+public:
+  SonarPayloadCodec(const Typelib::Type *type, int bits = 8);
+
+  void encode(const std::vector<uint8_t> &payload, std::vector<uint8_t> &encoded) const;
+
+  void decode(const std::vector<uint8_t> &encoded, std::vector<uint8_t> &payload) const;
+
+  /** Decodes to base::samples::Sonar */
+  const std::type_info *sampleType() const;
+
+  void decodeSample(const std::vector<uint8_t> &encoded, void *sample) const;
+
+  size_t ratio() const
+  {
+    return bits_ == 8 ? 4 : 2;
+  }
+
+  /** Bits of the bins quantized in the caches of sonar streams, 0 when disabled */
+  static int cacheBits();
+
+  static void setCacheBits(int bits);
+
+private:
+  const Typelib::Type *type_;
+  int bits_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* CompactSonar_hpp */
@@ -0,0 +1,235 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <unistd.h>
+#include "IOBackend.hpp"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+#ifdef HAVE_LIBURING
+
+/**
+ * Keeps up to queue_depth reads in flight, so sparse requests reach the
+ * throughput of the device instead of being bound by its latency.
+ */
+class UringBackend : public IOBackend
+{
+public:
+  UringBackend(size_t queue_depth)
+      : queue_depth_(queue_depth)
+  {
+    int ret = io_uring_queue_init(queue_depth, &ring_, 0);
+    if (ret < 0)
+      throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-ret));
+  }
+
+  ~UringBackend()
+  {
+    io_uring_queue_exit(&ring_);
+  }
+
+  void read(std::vector<ReadRequest> &requests)
+  {
+    std::vector<size_t> done(requests.size(), 0);
+
+    // short reads are resubmitted for the remaining bytes
+    std::deque<size_t> queue;
+    for (size_t i = 0; i < requests.size(); i++)
+      queue.push_back(i);
+
+    size_t inflight = 0;
+    while (!queue.empty() || inflight > 0)
+    {
+      while (!queue.empty() && inflight < queue_depth_)
+      {
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+        if (!sqe)
+          break;
+
+        size_t i = queue.front();
+        queue.pop_front();
+
+        const ReadRequest &request = requests[i];
+        io_uring_prep_read(sqe, request.fd, request.buffer + done[i],
+                           request.size - done[i], request.offset + done[i]);
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+        inflight++;
+      }
+
+      int ret = io_uring_submit_and_wait(&ring_, 1);
+      if (ret < 0 && ret != -EINTR)
+        throw std::runtime_error(std::string("io_uring_submit: ") + strerror(-ret));
+
+      io_uring_cqe *cqe = NULL;
+      while (io_uring_peek_cqe(&ring_, &cqe) == 0)
+      {
+        size_t i = (uintptr_t)io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring_, cqe);
+        inflight--;
+
+        if (res == -EINTR || res == -EAGAIN)
+        {
+          queue.push_back(i);
+        }
+        else if (res < 0)
+        {
+          requests[i].result = res;
+        }
+        else
+        {
+          done[i] += res;
+          if (res > 0 && done[i] < requests[i].size)
+            queue.push_back(i);
+          else
+            requests[i].result = done[i];
+        }
+      }
+    }
+  }
+
+  const char *name() const
+  {
+    return "io_uring";
+  }
+
+private:
+  io_uring ring_;
+  size_t queue_depth_;
+};
+
+#endif
+
+} // namespace
+
+IOBackend *IOBackend::create(size_t queue_depth)
+{
+#ifdef HAVE_LIBURING
+  const char *env = getenv("ROCK_REPLAY_IO");
+  if (!env || std::string(env) != "pread")
+  {
+    try
+    {
+      return new UringBackend(queue_depth);
+    }
+    catch (std::runtime_error &)
+    {
+      // kernels without io_uring, or with it disabled, use pread
+    }
+  }
+#endif
+  return new PreadBackend();
+}
+
+void PreadBackend::read(std::vector<ReadRequest> &requests)
+{
+  for (std::vector<ReadRequest>::iterator it = requests.begin(); it != requests.end(); it++)
+  {
+    ssize_t result = 0;
+    while (result < (ssize_t)it->size)
+    {
+      ssize_t count = pread(it->fd, it->buffer + result, it->size - result, it->offset + result);
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count < 0)
+        result = -errno;
+      if (count <= 0)
+        break;
+      result += count;
+    }
+    it->result = result;
+  }
+}
+
+BufferPool::BufferPool(const std::string &name, size_t maximum_buffers)
+    : maximum_buffers_(maximum_buffers)
+{
+  MemoryBudget::instance().add(this, "buffers " + name, MemoryBudget::PrefetchPriority);
+}
+
+BufferPool::~BufferPool()
+{
+  MemoryBudget::instance().remove(this);
+}
+
+void BufferPool::acquire(std::vector<uint8_t> &buffer, size_t size)
+{
+  size_t taken = 0;
+  {
+    QMutexLocker locker(&mutex_);
+
+    // smallest pooled buffer that fits
+    size_t best = buffers_.size();
+    for (size_t i = 0; i < buffers_.size(); i++)
+      if (buffers_[i].capacity() >= size &&
+          (best == buffers_.size() || buffers_[i].capacity() < buffers_[best].capacity()))
+        best = i;
+
+    if (best < buffers_.size())
+    {
+      buffer.swap(buffers_[best]);
+      buffers_[best].swap(buffers_.back());
+      buffers_.pop_back();
+      taken = buffer.capacity();
+    }
+  }
+
+  buffer.resize(size);
+
+  if (taken)
+    MemoryBudget::instance().charge(this, -(int64_t)taken);
+}
+
+void BufferPool::recycle(std::vector<uint8_t> &buffer)
+{
+  const size_t capacity = buffer.capacity();
+  if (!capacity)
+    return;
+
+  // charged outside of the lock, the budget may call release(), and before
+  // the buffer is visible to release(), the charge never runs below the pool
+  MemoryBudget::instance().charge(this, capacity);
+
+  bool kept = false;
+  {
+    QMutexLocker locker(&mutex_);
+    if (buffers_.size() < maximum_buffers_)
+    {
+      buffers_.push_back(std::vector<uint8_t>());
+      buffers_.back().swap(buffer);
+      buffers_.back().clear();
+      kept = true;
+    }
+  }
+
+  if (!kept)
+  {
+    std::vector<uint8_t>().swap(buffer);
+    MemoryBudget::instance().charge(this, -(int64_t)capacity);
+  }
+}
+
+size_t BufferPool::release(size_t bytes)
+{
+  QMutexLocker locker(&mutex_);
+
+  size_t released = 0;
+  while (released < bytes && !buffers_.empty())
+  {
+    released += buffers_.back().capacity();
+    buffers_.pop_back();
+  }
+  return released;
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,91 @@
+#ifndef IOBackend_hpp
+#define IOBackend_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <QMutex>
+#include "MemoryBudget.hpp"
+
+namespace rock_replay_cpp
+{
+
+struct ReadRequest
+{
+  int fd;
+  int64_t offset;
+  size_t size;
+  uint8_t *buffer;
+
+  // bytes read, or -errno when the read failed
+  ssize_t result;
+};
+
+/**
+ * Reads batches of file ranges.
+ *
+ * A backend is used by one thread at a time. create() returns an
+ * io_uring backend when rock-replay-cpp is built with liburing and the
+ * kernel supports it, and a synchronous pread backend otherwise. Setting
+ * ROCK_REPLAY_IO=pread forces the fallback.
+ */
+class IOBackend
+{
+public:
+  virtual ~IOBackend() {}
+
+  /** Performs every request and returns when all of them completed */
+  virtual void read(std::vector<ReadRequest> &requests) = 0;
+
+  virtual const char *name() const = 0;
+
+  static IOBackend *create(size_t queue_depth = DEFAULT_QUEUE_DEPTH);
+
+  static const size_t DEFAULT_QUEUE_DEPTH = 64;
+};
+
+class PreadBackend : public IOBackend
+{
+public:
+  void read(std::vector<ReadRequest> &requests);
+
+  const char *name() const
+  {
+    return "pread";
+  }
+};
+
+/**
+ * Keeps the buffers of completed reads for reuse, so the steady state of
+ * playback and export does not allocate. Idle buffers are accounted by
+ * the MemoryBudget and dropped when it is exceeded.
+ */
+class BufferPool : public MemoryConsumer
+{
+public:
+  BufferPool(const std::string &name, size_t maximum_buffers = 256);
+
+  ~BufferPool();
+
+  /** Replaces buffer by a pooled one of at least size bytes */
+  void acquire(std::vector<uint8_t> &buffer, size_t size);
+
+  /** Takes the storage of buffer back, leaving it empty */
+  void recycle(std::vector<uint8_t> &buffer);
+
+  size_t release(size_t bytes);
+
+private:
+  BufferPool(const BufferPool &);
+  BufferPool &operator=(const BufferPool &);
+
+  size_t maximum_buffers_;
+
+  QMutex mutex_;
+  std::vector<std::vector<uint8_t> > buffers_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* IOBackend_hpp */
@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "IndexCache.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+const char INDEX_CACHE_MAGIC[8] = "RRINDEX";
+const uint32_t INDEX_CACHE_VERSION = 1;
+
+// key size and payload size
+const size_t RECORD_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+
+} // namespace
+
+IndexCache::IndexCache(const std::string &log_filename, int fd)
+    : filename_(log_filename + ".rock-replay-index")
+    , log_size_(-1)
+    , log_mtime_(-1)
+{
+  struct stat info;
+  if (fstat(fd, &info) == 0)
+  {
+    log_size_ = info.st_size;
+    log_mtime_ = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+  }
+}
+
+std::vector<uint8_t> IndexCache::header() const
+{
+  std::vector<uint8_t> bytes(INDEX_CACHE_MAGIC, INDEX_CACHE_MAGIC + sizeof(INDEX_CACHE_MAGIC));
+  writeValue(bytes, INDEX_CACHE_VERSION);
+  writeValue(bytes, log_size_);
+  writeValue(bytes, log_mtime_);
+  return bytes;
+}
+
+bool IndexCache::validHeader(int fd) const
+{
+  const std::vector<uint8_t> expected = header();
+  std::vector<uint8_t> bytes(expected.size());
+  return pread(fd, bytes.data(), bytes.size(), 0) == (ssize_t)bytes.size() && bytes == expected;
+}
+
+bool IndexCache::load(const std::string &key, std::vector<uint8_t> &payload) const
+{
+  if (log_size_ < 0)
+    return false;
+
+  int fd = open(filename_.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  bool found = false;
+  if (fstat(fd, &info) == 0 && validHeader(fd))
+  {
+    int64_t pos = header().size();
+    while (!found && pos + (int64_t)RECORD_HEADER_SIZE <= info.st_size)
+    {
+      uint8_t record[RECORD_HEADER_SIZE];
+      if (pread(fd, record, sizeof(record), pos) != (ssize_t)sizeof(record))
+        break;
+
+      uint32_t key_size;
+      uint64_t payload_size;
+      memcpy(&key_size, record, sizeof(key_size));
+      memcpy(&payload_size, record + sizeof(key_size), sizeof(payload_size));
+
+      // a record cut by an interrupted write ends the cache
+      const int64_t key_pos = pos + RECORD_HEADER_SIZE;
+      if (payload_size > (uint64_t)info.st_size || key_pos + key_size + (int64_t)payload_size > info.st_size)
+        break;
+
+      std::string record_key(key_size, '\0');
+      if (pread(fd, &record_key[0], key_size, key_pos) != (ssize_t)key_size)
+        break;
+
+      if (record_key == key)
+      {
+        payload.resize(payload_size);
+        found = pread(fd, payload.data(), payload_size, key_pos + key_size) == (ssize_t)payload_size;
+      }
+      pos = key_pos + key_size + payload_size;
+    }
+  }
+
+  close(fd);
+  return found;
+}
+
+int IndexCache::create() const
+{
+  std::string temporary = filename_ + ".XXXXXX";
+  int fd = mkstemp(&temporary[0]);
+  if (fd < 0)
+    return -1;
+
+  // the cache is readable like the log, mkstemp only lets the owner read it
+  const std::vector<uint8_t> bytes = header();
+  bool written = fchmod(fd, 0644) == 0 && write(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size();
+  written = close(fd) == 0 && written;
+  if (!written || rename(temporary.c_str(), filename_.c_str()) != 0)
+  {
+    unlink(temporary.c_str());
+    return -1;
+  }
+
+  return open(filename_.c_str(), O_WRONLY | O_APPEND);
+}
+
+void IndexCache::store(const std::string &key, const std::vector<uint8_t> &payload) const
+{
+  if (log_size_ < 0)
+    return;
+
+  int fd = open(filename_.c_str(), O_RDWR | O_APPEND);
+  if (fd >= 0 && !validHeader(fd))
+  {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    fd = create();
+  if (fd < 0)
+    return;
+
+  std::vector<uint8_t> record;
+  record.reserve(RECORD_HEADER_SIZE + key.size() + payload.size());
+  writeValue(record, (uint32_t)key.size());
+  writeValue(record, (uint64_t)payload.size());
+  record.insert(record.end(), key.begin(), key.end());
+  record.insert(record.end(), payload.begin(), payload.end());
+
+  // one write per record, the records of several readers do not interleave;
+  // a record cut by a full disk is ignored by load
+  ssize_t written = write(fd, record.data(), record.size());
+  (void)written;
+  close(fd);
+}
+
+} // namespace rock_replay_cpp
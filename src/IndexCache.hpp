@@ -0,0 +1,91 @@
+#ifndef IndexCache_hpp
+#define IndexCache_hpp
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Indexes and declarations of one log file, kept next to it in
+ * name.log.rock-replay-index so that opening the log again does not walk
+ * its blocks. The cache is tied to the size and modification time of the
+ * log and started again once the log changed.
+ *
+ * Records are appended under a key with one write and never modified, so
+ * several readers may share the cache; a record cut by an interrupted
+ * write is ignored. A log in a directory that cannot be written is simply
+ * not cached.
+ */
+class IndexCache
+{
+public:
+  /** Cache of the log file opened as fd */
+  IndexCache(const std::string &log_filename, int fd);
+
+  /** Payload stored under key, false if there is none */
+  bool load(const std::string &key, std::vector<uint8_t> &payload) const;
+
+  /** Appends a record, the payload is lost if it cannot be written */
+  void store(const std::string &key, const std::vector<uint8_t> &payload) const;
+
+  template <typename T>
+  static void writeValue(std::vector<uint8_t> &bytes, const T &value)
+  {
+    const uint8_t *data = (const uint8_t *)&value;
+    bytes.insert(bytes.end(), data, data + sizeof(T));
+  }
+
+  /** Reads the value at pos and moves after it, false past the end */
+  template <typename T>
+  static bool readValue(const std::vector<uint8_t> &bytes, size_t &pos, T &value)
+  {
+    if (bytes.size() - pos < sizeof(T))
+      return false;
+    memcpy(&value, bytes.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+
+  /** Vectors of plain values are stored as their size and their elements */
+  template <typename T>
+  static void writeVector(std::vector<uint8_t> &bytes, const std::vector<T> &values)
+  {
+    writeValue(bytes, (uint64_t)values.size());
+    const uint8_t *data = (const uint8_t *)values.data();
+    bytes.insert(bytes.end(), data, data + values.size() * sizeof(T));
+  }
+
+  template <typename T>
+  static bool readVector(const std::vector<uint8_t> &bytes, size_t &pos, std::vector<T> &values)
+  {
+    uint64_t count;
+    if (!readValue(bytes, pos, count) || count > (bytes.size() - pos) / sizeof(T))
+      return false;
+    values.resize(count);
+    if (count > 0)
+      memcpy(values.data(), bytes.data() + pos, count * sizeof(T));
+    pos += count * sizeof(T);
+    return true;
+  }
+
+private:
+  /** Start of a cache of this version of the log */
+  std::vector<uint8_t> header() const;
+
+  bool validHeader(int fd) const;
+
+  /** Starts the cache again, returns a descriptor appending to it or -1 */
+  int create() const;
+
+  std::string filename_;
+  int64_t log_size_;
+  int64_t log_mtime_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* IndexCache_hpp */
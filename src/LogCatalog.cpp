@@ -0,0 +1,386 @@
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <QtConcurrentMap>
+#include <pocolog_cpp/Format.hpp>
+#include "BlockReader.hpp"
+#include "LogCatalog.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+const char CATALOG_MAGIC[8] = "RRCATLG";
+const uint32_t CATALOG_VERSION = 1;
+
+bool isLogFile(const std::string &name)
+{
+  return name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0;
+}
+
+template <typename T>
+void writeValue(std::ostream &os, const T &value)
+{
+  os.write((const char *)&value, sizeof(value));
+}
+
+template <typename T>
+void readValue(std::istream &is, T &value)
+{
+  is.read((char *)&value, sizeof(value));
+}
+
+// strings are stored once and referred to by their position, stream and
+// type names repeat across most files of a catalog
+class StringTable
+{
+public:
+  uint32_t id(const std::string &str)
+  {
+    std::map<std::string, uint32_t>::iterator it = ids_.find(str);
+    if (it != ids_.end())
+      return it->second;
+
+    ids_[str] = strings_.size();
+    strings_.push_back(str);
+    return strings_.size() - 1;
+  }
+
+  const std::string &at(uint32_t id) const
+  {
+    if (id >= strings_.size())
+      throw std::runtime_error("Invalid string in catalog");
+    return strings_[id];
+  }
+
+  void write(std::ostream &os) const
+  {
+    writeValue(os, (uint32_t)strings_.size());
+    for (std::vector<std::string>::const_iterator it = strings_.begin(); it != strings_.end(); it++)
+    {
+      writeValue(os, (uint32_t)it->size());
+      os.write(it->data(), it->size());
+    }
+  }
+
+  bool read(std::istream &is)
+  {
+    uint32_t count;
+    readValue(is, count);
+    for (uint32_t i = 0; i < count && is.good(); i++)
+    {
+      uint32_t size;
+      readValue(is, size);
+      std::string str(size, '\0');
+      is.read(&str[0], size);
+      strings_.push_back(str);
+    }
+    return is.good();
+  }
+
+private:
+  std::map<std::string, uint32_t> ids_;
+  std::vector<std::string> strings_;
+};
+
+} // namespace
+
+LogCatalog::LogCatalog(const std::string &catalog_filename)
+    : filename_(catalog_filename)
+{
+}
+
+std::string LogCatalog::defaultFilename(const std::string &root)
+{
+  return root + "/.rock-replay-catalog";
+}
+
+bool LogCatalog::load()
+{
+  std::ifstream is(filename_.c_str(), std::ifstream::binary);
+  if (!is.good())
+    return false;
+
+  char magic[8];
+  uint32_t version;
+  is.read(magic, sizeof(magic));
+  readValue(is, version);
+  if (!is.good() || memcmp(magic, CATALOG_MAGIC, sizeof(magic)) != 0 || version != CATALOG_VERSION)
+    return false;
+
+  StringTable strings;
+  if (!strings.read(is))
+    return false;
+
+  std::map<std::string, File> files;
+  uint32_t file_count;
+  readValue(is, file_count);
+  for (uint32_t i = 0; i < file_count && is.good(); i++)
+  {
+    File file;
+    uint32_t path, stream_count;
+    uint8_t complete;
+    readValue(is, path);
+    readValue(is, file.mtime);
+    readValue(is, file.size);
+    readValue(is, complete);
+    readValue(is, stream_count);
+    file.path = strings.at(path);
+    file.complete = complete;
+
+    for (uint32_t j = 0; j < stream_count && is.good(); j++)
+    {
+      Stream stream;
+      uint32_t name, type_name;
+      readValue(is, name);
+      readValue(is, type_name);
+      readValue(is, stream.samples);
+      readValue(is, stream.first_time);
+      readValue(is, stream.last_time);
+      stream.name = strings.at(name);
+      stream.type_name = strings.at(type_name);
+      file.streams.push_back(stream);
+    }
+    files[file.path] = file;
+  }
+
+  if (!is.good())
+    return false;
+
+  files_.swap(files);
+  return true;
+}
+
+void LogCatalog::save() const
+{
+  StringTable strings;
+  for (std::map<std::string, File>::const_iterator it = files_.begin(); it != files_.end(); it++)
+  {
+    strings.id(it->second.path);
+    for (std::vector<Stream>::const_iterator s = it->second.streams.begin(); s != it->second.streams.end(); s++)
+    {
+      strings.id(s->name);
+      strings.id(s->type_name);
+    }
+  }
+
+  std::string temporary = filename_ + ".tmp";
+  std::ofstream os(temporary.c_str(), std::ofstream::binary | std::ofstream::out);
+  if (!os.good())
+    throw std::runtime_error("Could not write " + temporary);
+
+  os.write(CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+  writeValue(os, CATALOG_VERSION);
+  strings.write(os);
+
+  writeValue(os, (uint32_t)files_.size());
+  for (std::map<std::string, File>::const_iterator it = files_.begin(); it != files_.end(); it++)
+  {
+    const File &file = it->second;
+    writeValue(os, strings.id(file.path));
+    writeValue(os, file.mtime);
+    writeValue(os, file.size);
+    writeValue(os, (uint8_t)file.complete);
+    writeValue(os, (uint32_t)file.streams.size());
+    for (std::vector<Stream>::const_iterator s = file.streams.begin(); s != file.streams.end(); s++)
+    {
+      writeValue(os, strings.id(s->name));
+      writeValue(os, strings.id(s->type_name));
+      writeValue(os, s->samples);
+      writeValue(os, s->first_time);
+      writeValue(os, s->last_time);
+    }
+  }
+
+  os.close();
+  if (!os.good() || rename(temporary.c_str(), filename_.c_str()) != 0)
+    throw std::runtime_error("Could not write " + filename_);
+}
+
+void LogCatalog::listLogs(const std::string &directory, std::vector<std::string> &paths)
+{
+  DIR *dir = opendir(directory.c_str());
+  if (!dir)
+    return;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    // also skips . and ..
+    if (entry->d_name[0] == '.')
+      continue;
+
+    // links to directories are not followed, a link loop would recurse
+    // forever; links to log files are listed
+    std::string path = directory + "/" + entry->d_name;
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+      continue;
+    if (S_ISLNK(st.st_mode) && (stat(path.c_str(), &st) != 0 || S_ISDIR(st.st_mode)))
+      continue;
+
+    if (S_ISDIR(st.st_mode))
+      listLogs(path, paths);
+    else if (S_ISREG(st.st_mode) && isLogFile(path))
+      paths.push_back(path);
+  }
+  closedir(dir);
+}
+
+size_t LogCatalog::update(const std::string &root)
+{
+  char resolved[PATH_MAX];
+  if (!realpath(root.c_str(), resolved))
+    throw std::runtime_error("Could not open directory " + root);
+  const std::string prefix = std::string(resolved) + "/";
+
+  std::vector<std::string> paths;
+  listLogs(resolved, paths);
+
+  std::vector<File> pending;
+  std::map<std::string, File> current;
+  for (std::vector<std::string>::iterator it = paths.begin(); it != paths.end(); it++)
+  {
+    struct stat st;
+    if (stat(it->c_str(), &st) != 0)
+      continue;
+
+    File file;
+    file.path = *it;
+    file.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    file.size = st.st_size;
+    file.complete = false;
+
+    std::map<std::string, File>::const_iterator found = files_.find(*it);
+    if (found != files_.end() && found->second.mtime == file.mtime && found->second.size == file.size)
+      current[*it] = found->second;
+    else
+      pending.push_back(file);
+  }
+
+  QtConcurrent::blockingMap(pending, indexFile);
+
+  for (std::vector<File>::iterator it = pending.begin(); it != pending.end(); it++)
+    current[it->path] = *it;
+
+  // entries of other trees are kept, the ones of removed files are not
+  std::map<std::string, File>::iterator it = files_.begin();
+  while (it != files_.end())
+  {
+    if (it->first.compare(0, prefix.size(), prefix) == 0)
+      files_.erase(it++);
+    else
+      it++;
+  }
+  files_.insert(current.begin(), current.end());
+
+  return pending.size();
+}
+
+void LogCatalog::indexFile(File &file)
+{
+  int fd = open(file.path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  pocolog_cpp::Prologue prologue;
+  if (pread(fd, &prologue, sizeof(prologue), 0) != sizeof(prologue) ||
+      memcmp(prologue.magic, pocolog_cpp::FORMAT_MAGIC, sizeof(prologue.magic)) != 0)
+  {
+    close(fd);
+    return;
+  }
+
+  // position of each declared data stream in file.streams
+  std::map<uint16_t, size_t> streams;
+
+  BlockReader blocks(fd, file.size);
+  while (blocks.next())
+  {
+    const pocolog_cpp::BlockHeader &header = blocks.header();
+
+    Stream stream;
+    pocolog_cpp::SampleHeaderData sample;
+    if (blocks.streamDeclaration(stream.name, stream.type_name))
+    {
+      stream.samples = 0;
+      stream.first_time = stream.last_time = 0;
+      streams[header.stream_idx] = file.streams.size();
+      file.streams.push_back(stream);
+    }
+    else if (header.type == pocolog_cpp::DataBlockType)
+    {
+      std::map<uint16_t, size_t>::iterator it = streams.find(header.stream_idx);
+      if (it != streams.end() && blocks.sampleHeader(sample))
+      {
+        int64_t time = (int64_t)sample.timestamp_tv_sec * 1000000 + sample.timestamp_tv_usec;
+
+        Stream &stream = file.streams[it->second];
+        if (stream.samples == 0 || time < stream.first_time)
+          stream.first_time = time;
+        if (stream.samples == 0 || time > stream.last_time)
+          stream.last_time = time;
+        stream.samples++;
+      }
+    }
+  }
+
+  file.complete = blocks.complete();
+  close(fd);
+}
+
+std::vector<LogCatalog::Match> LogCatalog::query(
+    const std::string &stream_pattern,
+    int64_t from,
+    int64_t to) const
+{
+  std::vector<Match> matches;
+  for (std::map<std::string, File>::const_iterator it = files_.begin(); it != files_.end(); it++)
+  {
+    const std::vector<Stream> &streams = it->second.streams;
+    for (std::vector<Stream>::const_iterator s = streams.begin(); s != streams.end(); s++)
+    {
+      if (s->samples == 0 || s->last_time < from || s->first_time > to)
+        continue;
+      if (fnmatch(stream_pattern.c_str(), s->name.c_str(), 0) != 0)
+        continue;
+
+      Match match;
+      match.file = &it->second;
+      match.stream = &*s;
+      matches.push_back(match);
+    }
+  }
+  return matches;
+}
+
+void LogCatalog::report(std::ostream &os) const
+{
+  size_t streams = 0, incomplete = 0;
+  uint64_t samples = 0;
+  for (std::map<std::string, File>::const_iterator it = files_.begin(); it != files_.end(); it++)
+  {
+    streams += it->second.streams.size();
+    incomplete += !it->second.complete;
+    for (std::vector<Stream>::const_iterator s = it->second.streams.begin(); s != it->second.streams.end(); s++)
+      samples += s->samples;
+  }
+
+  os << "Catalog: " << filename_ << std::endl;
+  os << " Files: " << files_.size() << " (" << incomplete << " truncated or unreadable)" << std::endl;
+  os << " Streams: " << streams << std::endl;
+  os << " Samples: " << samples << std::endl;
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,93 @@
+#ifndef LogCatalog_hpp
+#define LogCatalog_hpp
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Catalog of the streams and time ranges of the log files under a
+ * directory tree, kept in one compact file.
+ *
+ * Files are indexed by walking their block headers, without building a
+ * pocolog_cpp index, several files in parallel. Updating the catalog
+ * only reindexes the files whose modification time or size changed.
+ * Times are logical timestamps in microseconds since the epoch.
+ */
+class LogCatalog
+{
+public:
+  struct Stream
+  {
+    std::string name;
+    std::string type_name;
+    uint64_t samples;
+    int64_t first_time;
+    int64_t last_time;
+  };
+
+  struct File
+  {
+    std::string path;
+    int64_t mtime;
+    int64_t size;
+    // false when the file could not be read up to its end
+    bool complete;
+    std::vector<Stream> streams;
+  };
+
+  struct Match
+  {
+    const File *file;
+    const Stream *stream;
+  };
+
+  LogCatalog(const std::string &catalog_filename);
+
+  /** Catalog file of a directory tree, at its root */
+  static std::string defaultFilename(const std::string &root);
+
+  /** False when there is no catalog yet or it is not readable */
+  bool load();
+
+  void save() const;
+
+  /**
+   * Brings the entries of the .log files under root up to date and
+   * drops the ones of removed files. Returns the number of files that
+   * were (re)indexed.
+   */
+  size_t update(const std::string &root);
+
+  /**
+   * Streams whose name matches the shell pattern and with samples
+   * between from and to, in file order.
+   */
+  std::vector<Match> query(const std::string &stream_pattern,
+                           int64_t from,
+                           int64_t to) const;
+
+  const std::map<std::string, File> &files() const
+  {
+    return files_;
+  }
+
+  void report(std::ostream &os) const;
+
+private:
+  static void listLogs(const std::string &directory, std::vector<std::string> &paths);
+
+  static void indexFile(File &file);
+
+  std::string filename_;
+  std::map<std::string, File> files_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* LogCatalog_hpp */
@@ -1,108 +1,919 @@
 #include <iostream>
 #include <fstream>
-#include <pocolog_cpp/Write.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <typelib/memory_layout.hh>
+#include <typelib/pluginmanager.hh>
+#include "BlockReader.hpp"
+#include "IndexCache.hpp"
 #include "LogReader.hpp"
 
 namespace rock_replay_cpp
 {
 
-void LogReader::exportStream(
-    const std::string &filename,
-    const std::string &stream_name,
-    int start_index,
-    int final_index,
-    export_stream_fcn_t fcn,
-    void *data)
+namespace
+{
+
+// Returns N for a file of a split log named prefix.N.log, -1 otherwise
+long splitNumber(const std::string &path, std::string &prefix)
+{
+  const std::string suffix = ".log";
+  if (path.size() <= suffix.size() ||
+      path.compare(path.size() - suffix.size(), suffix.size(), suffix) != 0)
+    return -1;
+
+  size_t end = path.size() - suffix.size();
+  size_t dot = path.rfind('.', end - 1);
+  if (dot == std::string::npos || dot + 1 == end)
+    return -1;
+
+  for (size_t i = dot + 1; i < end; i++)
+    if (!isdigit(path[i]))
+      return -1;
+
+  prefix = path.substr(0, dot);
+  return atol(path.substr(dot + 1, end - dot - 1).c_str());
+}
+
+bool splitOrder(const std::string &a, const std::string &b)
+{
+  std::string prefix_a, prefix_b;
+  long number_a = splitNumber(a, prefix_a);
+  long number_b = splitNumber(b, prefix_b);
+
+  if (number_a < 0 || number_b < 0 || prefix_a != prefix_b)
+    return a < b;
+  return number_a < number_b;
+}
+
+std::vector<std::string> globFilenames(const std::string &pattern)
+{
+  std::vector<std::string> result;
+
+  glob_t matches;
+  if (glob(pattern.c_str(), 0, NULL, &matches) == 0)
+  {
+    for (size_t i = 0; i < matches.gl_pathc; i++)
+      result.push_back(matches.gl_pathv[i]);
+  }
+  globfree(&matches);
+
+  std::sort(result.begin(), result.end(), splitOrder);
+  return result;
+}
+
+size_t index_density = 0;
+
+const char DECLARATIONS_KEY[] = "declarations";
+
+} // namespace
+
+LogReader::LogReader(const std::string &input_file_path)
+    : filenames_(expandFilenames(input_file_path))
+    , declarations_(filenames_.size())
+    , declared_(filenames_.size(), NotDeclared)
+    , fds_(filenames_.size(), -1)
+    , file_sizes_(filenames_.size(), 0)
+    , mutex_(QMutex::Recursive)
+{
+  // the other files are opened when first read; the budget only knows
+  // the reader once nothing can throw, the destructor is not run otherwise
+  fileDescriptor(0);
+  MemoryBudget::instance().add(this, "index " + filenames_.front(), MemoryBudget::IndexPriority);
+}
+
+LogReader::LogReader(const std::vector<std::string> &input_file_paths)
+    : filenames_(input_file_paths)
+    , declarations_(filenames_.size())
+    , declared_(filenames_.size(), NotDeclared)
+    , fds_(filenames_.size(), -1)
+    , file_sizes_(filenames_.size(), 0)
+    , mutex_(QMutex::Recursive)
 {
+  if (filenames_.empty())
+    throw std::runtime_error("No log file given");
+
+  // the other files are opened when first read; the budget only knows
+  // the reader once nothing can throw, the destructor is not run otherwise
+  fileDescriptor(0);
+  MemoryBudget::instance().add(this, "index " + filenames_.front(), MemoryBudget::IndexPriority);
+}
+
+LogReader::~LogReader()
+{
+  MemoryBudget::instance().remove(this);
+
+  for (std::map<std::string, Typelib::Registry *>::iterator it = registries_.begin(); it != registries_.end(); it++)
+    delete it->second;
+  for (std::vector<int>::iterator it = fds_.begin(); it != fds_.end(); it++)
+    if (*it >= 0)
+      close(*it);
+}
+
+int LogReader::fileDescriptor(size_t segment)
+{
+  QMutexLocker locker(&mutex_);
+  if (fds_[segment] < 0)
+  {
+    int fd = open(filenames_[segment].c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+      if (fd >= 0)
+        close(fd);
+      throw std::runtime_error("Could not open " + filenames_[segment]);
+    }
+    file_sizes_[segment] = info.st_size;
+    fds_[segment] = fd;
+  }
+  return fds_[segment];
+}
+
+int64_t LogReader::fileSize(size_t segment)
+{
+  QMutexLocker locker(&mutex_);
+  fileDescriptor(segment);
+  return file_sizes_[segment];
+}
+
+std::vector<std::string> LogReader::expandFilenames(const std::string &input_file_path)
+{
+  if (input_file_path.find_first_of("*?[") != std::string::npos)
+  {
+    std::vector<std::string> result = globFilenames(input_file_path);
+    if (result.empty())
+      throw std::runtime_error("No log file matches " + input_file_path);
+    return result;
+  }
+
+  std::string prefix;
+  if (splitNumber(input_file_path, prefix) >= 0)
+  {
+    std::vector<std::string> result;
+    std::vector<std::string> candidates = globFilenames(prefix + ".*.log");
+    for (std::vector<std::string>::iterator it = candidates.begin(); it != candidates.end(); it++)
+    {
+      std::string candidate_prefix;
+      if (splitNumber(*it, candidate_prefix) >= 0 && candidate_prefix == prefix)
+        result.push_back(*it);
+    }
+
+    if (!result.empty())
+      return result;
+  }
+
+  return std::vector<std::string>(1, input_file_path);
+}
+
+LogStream LogReader::stream(const std::string &stream_name)
+{
+  const Typelib::Type *type = streamType(stream_name);
+  if (!type)
+    throw std::runtime_error("Stream " + stream_name + " is not a data stream");
+  return LogStream(this, stream_name, streamIndex(stream_name), type);
+}
+
+std::vector<pocolog_cpp::StreamDescription> LogReader::declarations(size_t segment, bool whole_file)
+{
+  {
+    QMutexLocker locker(&mutex_);
+    if (declared_[segment] == FileDeclared || (declared_[segment] == LeadingDeclared && !whole_file))
+      return declarations_[segment];
+  }
+
+  const int fd = fileDescriptor(segment);
+  IndexCache cache(filenames_[segment], fd);
+  std::vector<pocolog_cpp::StreamDescription> result;
+  Declared declared = FileDeclared;
+  if (!loadDeclarations(cache, segment, result))
+  {
+    // the logger declares its streams before their first sample, usually
+    // all at the start of the file, so the walk stops at the first data
+    // block unless a stream declared later is looked for
+    std::vector<uint8_t> entries;
+    uint32_t count = 0;
+    BlockReader blocks(fd, fileSize(segment));
+    std::vector<uint8_t> payload;
+    while (blocks.next())
+    {
+      if (!whole_file && blocks.header().type == pocolog_cpp::DataBlockType)
+      {
+        declared = LeadingDeclared;
+        break;
+      }
+      if (blocks.streamBlock(payload))
+      {
+        const uint16_t stream_idx = blocks.header().stream_idx;
+        result.push_back(pocolog_cpp::StreamDescription(filenames_[segment], payload, stream_idx));
+        IndexCache::writeValue(entries, stream_idx);
+        IndexCache::writeVector(entries, payload);
+        count++;
+      }
+    }
+
+    // only the declarations of the whole file are worth keeping
+    if (declared == FileDeclared)
+    {
+      std::vector<uint8_t> cached;
+      IndexCache::writeValue(cached, count);
+      cached.insert(cached.end(), entries.begin(), entries.end());
+      cache.store(DECLARATIONS_KEY, cached);
+    }
+  }
+
+  QMutexLocker locker(&mutex_);
+  if (declared_[segment] < declared)
+  {
+    declarations_[segment] = result;
+    declared_[segment] = declared;
+  }
+  return declarations_[segment];
+}
+
+bool LogReader::loadDeclarations(const IndexCache &cache,
+                                 size_t segment,
+                                 std::vector<pocolog_cpp::StreamDescription> &descriptions)
+{
+  std::vector<uint8_t> cached;
+  size_t pos = 0;
+  uint32_t count;
+  if (!cache.load(DECLARATIONS_KEY, cached) || !IndexCache::readValue(cached, pos, count))
+    return false;
+
+  std::vector<pocolog_cpp::StreamDescription> result;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint16_t stream_idx;
+    std::vector<uint8_t> payload;
+    if (!IndexCache::readValue(cached, pos, stream_idx) || !IndexCache::readVector(cached, pos, payload))
+      return false;
+    result.push_back(pocolog_cpp::StreamDescription(filenames_[segment], payload, stream_idx));
+  }
+
+  descriptions.swap(result);
+  return pos == cached.size();
+}
+
+bool LogReader::findDeclaration(const std::string &stream_name, pocolog_cpp::StreamDescription &desc)
+{
+  // the leading declarations of every file first, then the whole files
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (size_t i = 0; i < filenames_.size(); i++)
+    {
+      const std::vector<pocolog_cpp::StreamDescription> descriptions = declarations(i, pass == 1);
+      for (std::vector<pocolog_cpp::StreamDescription>::const_iterator it = descriptions.begin(); it != descriptions.end(); it++)
+      {
+        if (it->getType() == pocolog_cpp::DataStreamType && it->getName() == stream_name)
+        {
+          desc = *it;
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+const Typelib::Type *LogReader::streamType(const std::string &stream_name)
+{
+  {
+    QMutexLocker locker(&mutex_);
+    std::map<std::string, const Typelib::Type *>::iterator it = types_.find(stream_name);
+    if (it != types_.end())
+      return it->second;
+  }
+
   pocolog_cpp::StreamDescription desc;
-  loadStreamDescription(stream_name, desc);
+  if (!findDeclaration(stream_name, desc))
+    return NULL;
 
-  std::vector<pocolog_cpp::StreamMetadata> metadata = getMetadata(desc);
+  std::istringstream definition(desc.getTypeDescription());
+  QScopedPointer<Typelib::Registry> registry(Typelib::PluginManager::load("tlb", definition));
+  const Typelib::Type *type = registry->get(desc.getTypeName());
+  if (!type)
+    throw std::runtime_error("Type " + desc.getTypeName() + " of stream " + stream_name + " is not in its declaration");
 
-  std::ofstream os(filename.c_str(), std::ofstream::binary | std::ofstream::out);
-  pocolog_cpp::Output output(os);
+  QMutexLocker locker(&mutex_);
+  std::map<std::string, const Typelib::Type *>::iterator it = types_.find(stream_name);
+  if (it != types_.end())
+    return it->second;
 
-  output.writeStreamDeclaration(
-      0,
-      desc.getType(),
-      desc.getName(),
-      desc.getTypeName(),
-      desc.getTypeDescription(),
-      metadata);
+  registries_[stream_name] = registry.take();
+  types_[stream_name] = type;
+  return type;
+}
+
+size_t LogReader::release(size_t bytes)
+{
+  QMutexLocker locker(&mutex_);
+
+  size_t released = 0;
+  std::map<std::string, QSharedPointer<const StreamIndex> >::iterator it = indexes_.begin();
+  while (it != indexes_.end() && released < bytes)
+  {
+    // an index held by a handle or a loop is kept, the others are deleted
+    const size_t usage = it->second->memoryUsage();
+    QWeakPointer<const StreamIndex> weak(it->second);
+    it->second.clear();
+    it->second = weak.toStrongRef();
+    if (it->second)
+    {
+      it++;
+      continue;
+    }
+
+    released += usage;
+    indexes_.erase(it++);
+  }
+  return released;
+}
+
+StreamIndex *LogReader::buildIndex(const std::string &stream_name, size_t density)
+{
+  // a file of the split may not hold the stream, it then has no sample
+  QScopedPointer<StreamIndex> index(new StreamIndex());
+  std::ostringstream key;
+  key << "index " << density << " " << stream_name;
+  for (size_t i = 0; i < filenames_.size(); i++)
+  {
+    const int fd = fileDescriptor(i);
+    IndexCache cache(filenames_[i], fd);
+    std::vector<uint8_t> bytes;
+    if (cache.load(key.str(), bytes) && index->loadFile(fd, bytes))
+      continue;
+
+    index->addFile(fd, fileSize(i), stream_name, density);
+    bytes.clear();
+    index->saveFile(i, bytes);
+    cache.store(key.str(), bytes);
+  }
+  return index.take();
+}
+
+QSharedPointer<const StreamIndex> LogReader::streamIndex(const std::string &stream_name)
+{
+  {
+    QMutexLocker locker(&mutex_);
+    std::map<std::string, QSharedPointer<const StreamIndex> >::iterator it = indexes_.find(stream_name);
+    if (it != indexes_.end())
+      return it->second;
+  }
+
+  // the files are walked without the lock, the other streams stay available
+  QSharedPointer<const StreamIndex> index(buildIndex(stream_name, index_density));
+
+  // charged before release() can see it, the budget never runs below the indexes
+  const int64_t bytes = index->memoryUsage();
+  MemoryBudget::instance().charge(this, bytes);
+
+  QMutexLocker locker(&mutex_);
+  std::map<std::string, QSharedPointer<const StreamIndex> >::iterator it = indexes_.find(stream_name);
+  if (it == indexes_.end())
+  {
+    indexes_[stream_name] = index;
+    return index;
+  }
+
+  // built by another thread meanwhile, this one is dropped
+  index = it->second;
+  locker.unlock();
+  MemoryBudget::instance().charge(this, -bytes);
+  return index;
+}
+
+size_t LogReader::totalSamples(const std::string &stream_name)
+{
+  return streamIndex(stream_name)->size();
+}
+
+void LogReader::useSparseIndex(const std::string &stream_name, size_t density)
+{
+  if (!streamType(stream_name))
+    throw std::runtime_error("Stream " + stream_name + " is not a data stream");
+
+  QSharedPointer<const StreamIndex> index(buildIndex(stream_name, density));
+  MemoryBudget::instance().charge(this, index->memoryUsage());
+
+  int64_t replaced = 0;
+  {
+    QMutexLocker locker(&mutex_);
+    std::map<std::string, QSharedPointer<const StreamIndex> >::iterator it = indexes_.find(stream_name);
+    if (it != indexes_.end())
+      replaced = it->second->memoryUsage();
+    indexes_[stream_name] = index;
+  }
+
+  // the replaced index lives on with the handles holding it, uncharged
+  MemoryBudget::instance().charge(this, -replaced);
+}
+
+size_t LogReader::indexDensity()
+{
+  return index_density;
+}
+
+void LogReader::setIndexDensity(size_t density)
+{
+  index_density = density;
+}
+
+int64_t LogReader::samplePosition(
+    const std::string &stream_name,
+    size_t sample_index,
+    size_t &segment)
+{
+  int64_t time;
+  SparseIndex::Cursor cursor;
+  return streamIndex(stream_name)->locate(sample_index, segment, time, cursor);
+}
+
+base::Time LogReader::sampleTime(const std::string &stream_name, size_t sample_index)
+{
+  size_t segment;
+  int64_t time;
+  SparseIndex::Cursor cursor;
+  streamIndex(stream_name)->locate(sample_index, segment, time, cursor);
+  return base::Time::fromMicroseconds(time);
+}
 
-  pocolog_cpp::FileStream fileStream;
+size_t LogReader::sampleIndexAt(const std::string &stream_name, const base::Time &time)
+{
+  return streamIndex(stream_name)->indexAt(time.toMicroseconds());
+}
 
-  fileStream.open(
-      desc.getFileName().c_str(),
-      std::ifstream::binary | std::ifstream::in);
+void LogReader::readHeaders(
+    const std::string &stream_name,
+    const std::vector<size_t> &sample_indices,
+    std::vector<pocolog_cpp::SampleHeaderData> &headers,
+    IOBackend &backend)
+{
+  SparseIndex::Cursor cursor;
+  std::vector<ReadRequest> requests;
+  readHeaders(*streamIndex(stream_name), cursor, sample_indices, headers, backend, requests);
+}
 
-  if (!fileStream.good())
-    throw std::runtime_error("Error, could not open logfile for stream " + desc.getName());
+void LogReader::readHeaders(
+    const StreamIndex &index,
+    SparseIndex::Cursor &cursor,
+    const std::vector<size_t> &sample_indices,
+    std::vector<pocolog_cpp::SampleHeaderData> &headers,
+    IOBackend &backend)
+{
+  std::vector<ReadRequest> requests;
+  readHeaders(index, cursor, sample_indices, headers, backend, requests);
+}
 
-  pocolog_cpp::InputDataStream *data_stream = stream(stream_name).input_data_stream();
+void LogReader::readHeaders(
+    const StreamIndex &index,
+    SparseIndex::Cursor &cursor,
+    const std::vector<size_t> &sample_indices,
+    std::vector<pocolog_cpp::SampleHeaderData> &headers,
+    IOBackend &backend,
+    std::vector<ReadRequest> &requests)
+{
+  const size_t header_size = sizeof(pocolog_cpp::SampleHeaderData);
+  const size_t count = sample_indices.size();
 
-  for (int sampleNr = start_index; sampleNr < final_index; sampleNr++)
+  headers.resize(count);
+  requests.resize(count);
+  for (size_t i = 0; i < count; i++)
   {
-    std::streampos samplePos = data_stream->getFileIndex().getSamplePos(sampleNr);
-    std::streampos sampleHeaderPos = samplePos;
-    sampleHeaderPos -= sizeof(pocolog_cpp::SampleHeaderData);
+    size_t segment;
+    int64_t time;
+    int64_t pos = index.locate(sample_indices[i], segment, time, cursor);
 
-    pocolog_cpp::SampleHeaderData header;
+    requests[i].fd = index.fileDescriptor(segment);
+    requests[i].offset = pos - header_size;
+    requests[i].size = header_size;
+    requests[i].buffer = (uint8_t *)&headers[i];
+  }
 
-    fileStream.seekg(sampleHeaderPos);
-    fileStream.read((char *)&header, sizeof(pocolog_cpp::SampleHeaderData));
-    if (!fileStream.good())
+  backend.read(requests);
+
+  for (size_t i = 0; i < count; i++)
+    if (requests[i].result != (ssize_t)header_size)
       throw std::runtime_error("Could not load sample header");
+}
+
+void LogReader::readSamples(
+    const std::string &stream_name,
+    const std::vector<size_t> &sample_indices,
+    std::vector<pocolog_cpp::SampleHeaderData> &headers,
+    std::vector<std::vector<uint8_t> > &payloads,
+    IOBackend &backend,
+    BufferPool *pool)
+{
+  SparseIndex::Cursor cursor;
+  readSamples(*streamIndex(stream_name), cursor, sample_indices, headers, payloads, backend, pool);
+}
+
+void LogReader::readSamples(
+    const StreamIndex &index,
+    SparseIndex::Cursor &cursor,
+    const std::vector<size_t> &sample_indices,
+    std::vector<pocolog_cpp::SampleHeaderData> &headers,
+    std::vector<std::vector<uint8_t> > &payloads,
+    IOBackend &backend,
+    BufferPool *pool)
+{
+  const size_t header_size = sizeof(pocolog_cpp::SampleHeaderData);
+  const size_t count = sample_indices.size();
+
+  std::vector<ReadRequest> requests;
+  readHeaders(index, cursor, sample_indices, headers, backend, requests);
+  payloads.resize(count);
+
+  // the payload sizes are only known once the headers are in
+  for (size_t i = 0; i < count; i++)
+  {
+    if (pool)
+      pool->acquire(payloads[i], headers[i].data_size);
+    else
+      payloads[i].resize(headers[i].data_size);
 
-    std::vector<uint8_t> buffer;
-    buffer.resize(header.data_size);
+    requests[i].offset += header_size;
+    requests[i].size = headers[i].data_size;
+    requests[i].buffer = payloads[i].data();
+  }
 
-    fileStream.seekg(samplePos);
-    fileStream.read((char *)buffer.data(), header.data_size);
+  backend.read(requests);
 
-    if (!fileStream.good())
+  for (size_t i = 0; i < count; i++)
+    if (requests[i].result != (ssize_t)requests[i].size)
       throw std::runtime_error("Could not load sample data");
+}
 
-    base::Time realtime = base::Time::fromSeconds(header.realtime_tv_sec, header.realtime_tv_usec);
-    base::Time logical = base::Time::fromSeconds(header.timestamp_tv_sec, header.timestamp_tv_usec);
+bool LogReader::readFixedSamples(
+    const StreamIndex &index,
+    SparseIndex::Cursor &cursor,
+    const std::vector<size_t> &sample_indices,
+    size_t size,
+    uint8_t *destination,
+    IOBackend &backend)
+{
+  const size_t header_size = sizeof(pocolog_cpp::SampleHeaderData);
+  const size_t count = sample_indices.size();
+
+  std::vector<pocolog_cpp::SampleHeaderData> headers;
+  std::vector<ReadRequest> requests;
+  readHeaders(index, cursor, sample_indices, headers, backend, requests);
 
-    if (data_stream->getSampleData(buffer, sampleNr))
+  for (size_t i = 0; i < count; i++)
+  {
+    if (headers[i].data_size != size || headers[i].compressed)
+      return false;
+
+    requests[i].offset += header_size;
+    requests[i].size = size;
+    requests[i].buffer = destination + i * size;
+  }
+
+  backend.read(requests);
+
+  for (size_t i = 0; i < count; i++)
+    if (requests[i].result != (ssize_t)size)
+      throw std::runtime_error("Could not load sample data");
+  return true;
+}
+
+void LogReader::advise(
+    const std::string &stream_name,
+    const std::vector<size_t> &sample_indices,
+    int advice)
+{
+  SparseIndex::Cursor cursor;
+  advise(*streamIndex(stream_name), cursor, sample_indices, advice);
+}
+
+void LogReader::advise(
+    const StreamIndex &index,
+    SparseIndex::Cursor &cursor,
+    const std::vector<size_t> &sample_indices,
+    int advice)
+{
+  std::vector<FileRange> ranges;
+  sampleRanges(index, cursor, sample_indices, ranges);
+  for (std::vector<FileRange>::iterator it = ranges.begin(); it != ranges.end(); it++)
+    posix_fadvise(it->fd, it->begin, it->end - it->begin, advice);
+}
+
+void LogReader::snapshotPages(
+    const StreamIndex &index,
+    SparseIndex::Cursor &cursor,
+    size_t start_index,
+    size_t final_index,
+    PageResidency &residency)
+{
+  const int64_t header_size = sizeof(pocolog_cpp::SampleHeaderData);
+  const std::vector<size_t> &offsets = index.offsets();
+
+  // from the first sample of the range in each file up to the sample
+  // after its last one, or up to the end of the file
+  for (size_t segment = 0; segment + 1 < offsets.size(); segment++)
+  {
+    size_t first = std::max(start_index, offsets[segment]);
+    size_t last = std::min(final_index, offsets[segment + 1]);
+    if (first >= last)
+      continue;
+
+    size_t found;
+    int64_t time;
+    int64_t begin = index.locate(first, found, time, cursor) - header_size;
+    int64_t end = file_sizes_[segment];
+    if (last < offsets[segment + 1])
+      end = index.locate(last, found, time, cursor) - header_size;
+    residency.add(index.fileDescriptor(segment), begin, end);
+  }
+}
+
+void LogReader::dropPages(
+    const StreamIndex &index,
+    SparseIndex::Cursor &cursor,
+    const std::vector<size_t> &sample_indices,
+    const PageResidency &residency)
+{
+  std::vector<FileRange> ranges;
+  sampleRanges(index, cursor, sample_indices, ranges);
+  for (std::vector<FileRange>::iterator it = ranges.begin(); it != ranges.end(); it++)
+    residency.dropNew(it->fd, it->begin, it->end);
+}
+
+void LogReader::sampleRanges(
+    const StreamIndex &index,
+    SparseIndex::Cursor &cursor,
+    const std::vector<size_t> &sample_indices,
+    std::vector<FileRange> &ranges)
+{
+  const int64_t header_size = sizeof(pocolog_cpp::SampleHeaderData);
+  const size_t total = index.size();
+
+  std::vector<size_t> indices(sample_indices);
+  std::sort(indices.begin(), indices.end());
+
+  // a sample spans from its header up to the next sample of the stream,
+  // or up to the end of its file
+  int fd = -1;
+  int64_t begin = 0, end = 0;
+  for (std::vector<size_t>::const_iterator it = indices.begin(); it != indices.end(); it++)
+  {
+    size_t segment, next_segment;
+    int64_t time;
+    int64_t sample_begin = index.locate(*it, segment, time, cursor) - header_size;
+    int64_t sample_end = -1;
+    if (*it + 1 < total)
     {
-      output.writeSample(
-          0,
-          realtime,
-          logical,
-          (void *)buffer.data(),
-          buffer.size());
+      int64_t next = index.locate(*it + 1, next_segment, time, cursor) - header_size;
+      if (next_segment == segment)
+        sample_end = next;
+    }
+
+    int sample_fd = index.fileDescriptor(segment);
+    if (sample_end < 0)
+      sample_end = file_sizes_[segment];
 
-      if (fcn != NULL)
-        if (!fcn(sampleNr, data))
-          break;
+    if (sample_fd == fd && sample_begin <= end + ADVICE_MERGE_GAP)
+    {
+      end = std::max(end, sample_end);
+      continue;
     }
+
+    if (fd >= 0)
+    {
+      FileRange range = {fd, begin, end};
+      ranges.push_back(range);
+    }
+    fd = sample_fd;
+    begin = sample_begin;
+    end = sample_end;
+  }
+
+  if (fd >= 0)
+  {
+    FileRange range = {fd, begin, end};
+    ranges.push_back(range);
   }
 }
 
-void LogReader::loadStreamDescription(
+void LogStream::note_access(size_t sample_index)
+{
+  if (!access_.access(sample_index))
+    return;
+
+  std::vector<size_t> window;
+  access_.window(total_samples(), window);
+  reader_->advise(*index_, cursor_, window, POSIX_FADV_WILLNEED);
+}
+
+bool LogStream::fixed_layout(size_t size)
+{
+  if (fixed_size_ != size)
+  {
+    fixed_size_ = size;
+    try
+    {
+      fixed_ = type_->getSize() == size && Typelib::layout_of(*type_).isMemcpy();
+    }
+    catch (std::exception &)
+    {
+      // opaques and pointers have no layout
+      fixed_ = false;
+    }
+  }
+  return fixed_;
+}
+
+bool LogStream::read_fixed(void *sample, size_t size, size_t sample_index)
+{
+  if (!fixed_layout(size))
+    return false;
+
+  size_t segment;
+  int64_t time;
+  int64_t pos = index_->locate(sample_index, segment, time, cursor_);
+
+  // header and payload in one read
+  const size_t header_size = sizeof(pocolog_cpp::SampleHeaderData);
+  std::vector<uint8_t> buffer(header_size + size);
+  if (pread(index_->fileDescriptor(segment), buffer.data(), buffer.size(), pos - header_size) != (ssize_t)buffer.size())
+    return false;
+
+  pocolog_cpp::SampleHeaderData header;
+  memcpy(&header, buffer.data(), header_size);
+  if (header.data_size != size || header.compressed)
+    return false;
+
+  memcpy(sample, buffer.data() + header_size, size);
+  return true;
+}
+
+bool LogStream::read_fixed(
+    void *samples,
+    size_t size,
+    const std::vector<size_t> &sample_indices,
+    IOBackend &backend)
+{
+  return fixed_layout(size) &&
+         reader_->readFixedSamples(*index_, cursor_, sample_indices, size, (uint8_t *)samples, backend);
+}
+
+void LogStream::read_payload(size_t sample_index, std::vector<uint8_t> &buffer)
+{
+  size_t segment;
+  int64_t time;
+  int64_t pos = index_->locate(sample_index, segment, time, cursor_);
+  const int fd = index_->fileDescriptor(segment);
+
+  const size_t header_size = sizeof(pocolog_cpp::SampleHeaderData);
+  pocolog_cpp::SampleHeaderData header;
+  if (pread(fd, &header, header_size, pos - header_size) != (ssize_t)header_size)
+    throw std::runtime_error("Could not load sample header");
+  if (header.compressed)
+    throw std::runtime_error("Compressed samples are not supported");
+
+  buffer.resize(header.data_size);
+  if (pread(fd, buffer.data(), buffer.size(), pos) != (ssize_t)buffer.size())
+    throw std::runtime_error("Could not load sample data");
+}
+
+void LogStream::read_payloads(
+    const std::vector<size_t> &sample_indices,
+    std::vector<pocolog_cpp::SampleHeaderData> &headers,
+    std::vector<std::vector<uint8_t> > &payloads,
+    IOBackend &backend,
+    BufferPool *pool)
+{
+  reader_->readSamples(*index_, cursor_, sample_indices, headers, payloads, backend, pool);
+}
+
+void LogStream::time_range(base::Time &first, base::Time &last)
+{
+  first = last = base::Time();
+
+  size_t total = total_samples();
+  if (total == 0)
+    return;
+
+  size_t segment;
+  int64_t time;
+  index_->locate(0, segment, time, cursor_);
+  first = base::Time::fromMicroseconds(time);
+  index_->locate(total - 1, segment, time, cursor_);
+  last = base::Time::fromMicroseconds(time);
+}
+
+void LogReader::exportStream(
+    const std::string &filename,
     const std::string &stream_name,
-    pocolog_cpp::StreamDescription &desc)
+    int start_index,
+    int final_index,
+    export_stream_fcn_t fcn,
+    void *data,
+    bool cache)
 {
-  const std::vector<pocolog_cpp::StreamDescription> descriptions = log_file_.getStreamDescriptions();
-  for (std::vector<pocolog_cpp::StreamDescription>::const_iterator it = descriptions.begin(); it != descriptions.end(); it++)
+  std::ofstream os(filename.c_str(), std::ofstream::binary | std::ofstream::out);
+  pocolog_cpp::Output output(os);
+  declareStream(output, stream_name);
+
+  QSharedPointer<const StreamIndex> held_index = streamIndex(stream_name);
+  const StreamIndex &index = *held_index;
+  SparseIndex::Cursor cursor;
+  QScopedPointer<IOBackend> backend(IOBackend::create());
+  BufferPool pool("export " + stream_name, EXPORT_BATCH_SIZE);
+
+  // the input pages already cached are left to the playback
+  PageResidency residency;
+  WriteBehind write_behind;
+  if (!cache)
+  {
+    snapshotPages(index, cursor, start_index, final_index, residency);
+    write_behind.open(filename);
+  }
+  bool canceled = false;
+
+  std::vector<size_t> indices;
+  std::vector<pocolog_cpp::SampleHeaderData> headers;
+  std::vector<std::vector<uint8_t> > payloads;
+
+  for (int batch_start = start_index; batch_start < final_index; batch_start += EXPORT_BATCH_SIZE)
   {
-    switch (it->getType())
+    int batch_end = std::min(final_index, batch_start + (int)EXPORT_BATCH_SIZE);
+
+    indices.clear();
+    for (int sampleNr = batch_start; sampleNr < batch_end; sampleNr++)
+      indices.push_back(sampleNr);
+
+    readSamples(index, cursor, indices, headers, payloads, *backend, &pool);
+
+    for (size_t i = 0; i < indices.size(); i++)
     {
-    case pocolog_cpp::DataStreamType:
-      if (it->getName() == stream_name)
+      const pocolog_cpp::SampleHeaderData &header = headers[i];
+      base::Time realtime = base::Time::fromSeconds(header.realtime_tv_sec, header.realtime_tv_usec);
+      base::Time logical = base::Time::fromSeconds(header.timestamp_tv_sec, header.timestamp_tv_usec);
+
+      output.writeSample(
+          0,
+          realtime,
+          logical,
+          (void *)payloads[i].data(),
+          payloads[i].size());
+
+      pool.recycle(payloads[i]);
+
+      if (fcn != NULL && !fcn(indices[i], data))
       {
-        desc = *it;
-        return;
+        canceled = true;
+        break;
       }
-      break;
-    default:
-      std::cout << "Ignoring stream " << it->getName() << std::endl;
-      break;
     }
+
+    if (!cache)
+    {
+      dropPages(index, cursor, indices, residency);
+      os.flush();
+      write_behind.flush(os.tellp());
+    }
+
+    if (canceled)
+      break;
   }
+
+  os.flush();
+  write_behind.close();
+}
+
+void LogReader::declareStream(
+    pocolog_cpp::Output &output,
+    const std::string &stream_name,
+    int stream_index)
+{
+  pocolog_cpp::StreamDescription desc;
+  loadStreamDescription(stream_name, desc);
+
+  std::vector<pocolog_cpp::StreamMetadata> metadata = getMetadata(desc);
+
+  output.writeStreamDeclaration(
+      stream_index,
+      desc.getType(),
+      desc.getName(),
+      desc.getTypeName(),
+      desc.getTypeDescription(),
+      metadata);
+}
+
+void LogReader::loadStreamDescription(
+    const std::string &stream_name,
+    pocolog_cpp::StreamDescription &desc)
+{
+  if (!findDeclaration(stream_name, desc))
+    throw std::runtime_error("Stream " + stream_name + " is not a data stream");
 }
 
 std::vector<pocolog_cpp::StreamMetadata>
@@ -126,17 +937,35 @@ std::vector<pocolog_cpp::StreamDescription>
 LogReader::getDescriptions()
 {
   std::vector<pocolog_cpp::StreamDescription> result;
-  const std::vector<pocolog_cpp::StreamDescription> descriptions = log_file_.getStreamDescriptions();
-  for (std::vector<pocolog_cpp::StreamDescription>::const_iterator it = descriptions.begin(); it != descriptions.end(); it++)
+  std::set<std::string> names;
+  for (size_t i = 0; i < filenames_.size(); i++)
   {
-    switch (it->getType())
+    // each file of a split starts with the declarations of the streams
+    // logged so far: the first and last files are enough to list the run,
+    // the files already walked add what they declare later
+    std::vector<pocolog_cpp::StreamDescription> descriptions;
+    if (i == 0 || i + 1 == filenames_.size())
+      descriptions = declarations(i);
+    else
     {
-    case pocolog_cpp::DataStreamType:
-      result.push_back(*it);
-      break;
-    default:
-      std::cout << "Ignoring stream " << it->getName() << std::endl;
-      break;
+      QMutexLocker locker(&mutex_);
+      descriptions = declarations_[i];
+    }
+
+    for (std::vector<pocolog_cpp::StreamDescription>::const_iterator it = descriptions.begin(); it != descriptions.end(); it++)
+    {
+      switch (it->getType())
+      {
+      case pocolog_cpp::DataStreamType:
+        // the other files of a split log declare it again
+        if (names.insert(it->getName()).second)
+          result.push_back(*it);
+        break;
+      default:
+        if (i == 0)
+          std::cout << "Ignoring stream " << it->getName() << std::endl;
+        break;
+      }
     }
   }
   return result;
@@ -1,17 +1,56 @@
 #ifndef LogReader_hpp
 #define LogReader_hpp
 
+#include <algorithm>
 #include <cstring>
+#include <map>
 #include <string>
+#include <type_traits>
+#include <vector>
 #include <QtGui/QWidget>
-#include <pocolog_cpp/LogFile.hpp>
-#include <pocolog_cpp/InputDataStream.hpp>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <pocolog_cpp/Format.hpp>
+#include <pocolog_cpp/StreamDescription.hpp>
+#include <pocolog_cpp/Write.hpp>
+#include <typelib/registry.hh>
+#include <typelib/value_ops.hh>
+#include "SamplePrefetcher.hpp"
+#include "MemoryBudget.hpp"
+#include "IOBackend.hpp"
+#include "AccessPattern.hpp"
+#include "StreamIndex.hpp"
+#include "PageCache.hpp"
 
 namespace rock_replay_cpp
 {
 
 typedef bool (*export_stream_fcn_t)(int, void*);
 
+class IndexCache;
+class LogReader;
+
+/**
+ * Types that may be decoded by copying their marshalled bytes. Whether
+ * the logged type really has the layout of T is checked once per stream
+ * at run time; specialize to false to always go through Typelib.
+ */
+template <typename T>
+struct is_fixed_layout
+{
+  static const bool value = std::is_trivially_copyable<T>::value;
+};
+
+template <typename T, bool fixed = is_fixed_layout<T>::value>
+struct FixedLayout;
+
+/**
+ * Handle on one stream of a LogReader. Samples are read with pread
+ * through the shared StreamIndex, so each thread may read the same log
+ * through its own handles without locking; a handle itself is not meant
+ * to be shared between threads.
+ */
 class LogStream
 {
 public:
@@ -21,12 +60,83 @@ public:
     memset(&sample, 0, sizeof(T));
     if (sample_index < total_samples())
     {
-      data_stream_->getSample<T>(sample, sample_index);
+      note_access(sample_index);
+
+      std::vector<uint8_t> buffer;
+      bool decoded = false;
+      if (prefetcher_ && prefetcher_->fetch(sample_index, buffer, &sample, typeid(T), decoded))
+      {
+        if (decoded)
+          return true;
+
+        if (!FixedLayout<T>::copy(*this, sample, buffer))
+        {
+          Typelib::Value value(&sample, *type_);
+          Typelib::load(value, buffer);
+        }
+        prefetcher_->recycle(buffer);
+      }
+      else if (!FixedLayout<T>::read(*this, sample, sample_index))
+      {
+        std::vector<uint8_t> buffer;
+        read_payload(sample_index, buffer);
+        Typelib::Value value(&sample, *type_);
+        Typelib::load(value, buffer);
+      }
       return true;
     }
     return false;
   }
 
+  /**
+   * Reads count samples from start_index on into samples, with one
+   * batch of requests. Fixed layout samples are read in place in the
+   * vector, the others are decoded through Typelib.
+   */
+  template <typename T>
+  size_t read_samples(std::vector<T> &samples,
+                      size_t start_index,
+                      size_t count,
+                      IOBackend &backend)
+  {
+    size_t total = total_samples();
+    start_index = std::min(start_index, total);
+    count = std::min(count, total - start_index);
+    samples.resize(count);
+    if (count == 0)
+      return 0;
+
+    std::vector<size_t> indices(count);
+    for (size_t i = 0; i < count; i++)
+      indices[i] = start_index + i;
+
+    if (FixedLayout<T>::readBatch(*this, samples, indices, backend))
+      return count;
+
+    std::vector<pocolog_cpp::SampleHeaderData> headers;
+    std::vector<std::vector<uint8_t> > payloads;
+    read_payloads(indices, headers, payloads, backend);
+
+    for (size_t i = 0; i < count; i++)
+    {
+      Typelib::Value value(&samples[i], *type_);
+      Typelib::load(value, payloads[i]);
+    }
+    return count;
+  }
+
+  /** True when the logged type is laid out in memory as its marshalled bytes, on size bytes */
+  bool fixed_layout(size_t size);
+
+  /** Reads a fixed layout sample straight into sample, false if the stream is not one */
+  bool read_fixed(void *sample, size_t size, size_t sample_index);
+
+  /** Reads the marshalled payload of a sample with pread */
+  void read_payload(size_t sample_index, std::vector<uint8_t> &buffer);
+
+  /** Reads fixed layout samples straight into samples, false if the stream is not one */
+  bool read_fixed(void *samples, size_t size, const std::vector<size_t> &sample_indices, IOBackend &backend);
+
   template <typename T>
   bool next(T &sample)
   {
@@ -38,9 +148,9 @@ public:
     current_sample_index_ = 0;
   }
 
-  size_t total_samples()
+  size_t total_samples() const
   {
-    return data_stream_->getSize();
+    return index_ ? index_->size() : 0;
   }
 
   size_t current_sample_index()
@@ -53,74 +163,363 @@ public:
     current_sample_index_ = index;
   }
 
+  void set_prefetcher(SamplePrefetcher *prefetcher)
+  {
+    prefetcher_ = prefetcher;
+  }
+
   LogStream()
-      : data_stream_(NULL)
+      : reader_(NULL), type_(NULL), current_sample_index_(0), prefetcher_(NULL),
+        fixed_size_(0), fixed_(false)
   {
   }
 
-  pocolog_cpp::InputDataStream *input_data_stream() const
+  const std::string &name() const
   {
-    return data_stream_;
+    return name_;
   }
 
+  const Typelib::Type *type() const
+  {
+    return type_;
+  }
+
+  void time_range(base::Time &first, base::Time &last);
+
+  /** Raw headers and payloads of several samples, see LogReader::readSamples */
+  void read_payloads(const std::vector<size_t> &sample_indices,
+                     std::vector<pocolog_cpp::SampleHeaderData> &headers,
+                     std::vector<std::vector<uint8_t> > &payloads,
+                     IOBackend &backend,
+                     BufferPool *pool = NULL);
+
 private:
-  LogStream(pocolog_cpp::InputDataStream *data_stream)
-      : data_stream_(data_stream), current_sample_index_(0)
+  LogStream(LogReader *reader,
+            const std::string &name,
+            const QSharedPointer<const StreamIndex> &index,
+            const Typelib::Type *type)
+      : reader_(reader), name_(name), index_(index), type_(type), current_sample_index_(0), prefetcher_(NULL),
+        fixed_size_(0), fixed_(false)
   {
   }
 
-  pocolog_cpp::InputDataStream *data_stream_;
+  /** Advises the read-ahead window of the access pattern when needed */
+  void note_access(size_t sample_index);
+
+  LogReader *reader_;
+  std::string name_;
+
+  // shared by all the handles on the stream, read without locking; it
+  // stays allocated while a handle holds it, even when the reader drops it
+  QSharedPointer<const StreamIndex> index_;
+  const Typelib::Type *type_;
+
   size_t current_sample_index_;
+  SamplePrefetcher *prefetcher_;
+  AccessPattern access_;
+  SparseIndex::Cursor cursor_;
+
+  // result of the layout check, made for fixed_size_ bytes
+  size_t fixed_size_;
+  bool fixed_;
 
   friend class LogReader;
 }; // namespace classLogStream
 
-class LogReader
+template <typename T, bool fixed>
+struct FixedLayout
 {
-public:
-  LogReader(const std::string &input_file_path)
-      : log_file_(input_file_path)
+  static bool copy(LogStream &, T &, const std::vector<uint8_t> &)
   {
+    return false;
   }
 
-  ~LogReader()
+  static bool read(LogStream &, T &, size_t)
   {
+    return false;
   }
 
-  LogStream stream(const std::string &stream_name)
+  static bool readBatch(LogStream &, std::vector<T> &, const std::vector<size_t> &, IOBackend &)
   {
-    try
-    {
-      return LogStream(dynamic_cast<pocolog_cpp::InputDataStream *>(&log_file_.getStream(stream_name)));
-    }
-    catch (...)
-    {
-      throw;
-    }
-    return LogStream();
+    return false;
+  }
+};
+
+template <typename T>
+struct FixedLayout<T, true>
+{
+  static bool copy(LogStream &stream, T &sample, const std::vector<uint8_t> &buffer)
+  {
+    if (buffer.size() != sizeof(T) || !stream.fixed_layout(sizeof(T)))
+      return false;
+    memcpy(&sample, buffer.data(), sizeof(T));
+    return true;
+  }
+
+  static bool read(LogStream &stream, T &sample, size_t sample_index)
+  {
+    return stream.read_fixed(&sample, sizeof(T), sample_index);
   }
 
-  const pocolog_cpp::LogFile &log_file() const
+  static bool readBatch(LogStream &stream, std::vector<T> &samples,
+                        const std::vector<size_t> &sample_indices, IOBackend &backend)
   {
-    return log_file_;
+    return stream.read_fixed(samples.data(), sizeof(T), sample_indices, backend);
   }
+};
+
+/**
+ * Reads a single log file or a log split by the logger in several files
+ * (name.0.log, name.1.log, ...). Each stream is presented as one
+ * LogStream with a global sample index over all the files.
+ *
+ * Only the first file is opened on construction, the others when first
+ * read. The stream declarations of a file are read from its block headers
+ * up to the first data block the first time they are needed, and from
+ * the whole file when a stream is not declared there. A stream is declared
+ * by the first file holding it, which is not always the first file of a
+ * split log, and its type is loaded from that declaration.
+ *
+ * Each stream is indexed once in a StreamIndex, built in full or sparsely
+ * from one walk over the block headers of each file, and the indexes are
+ * accounted by the MemoryBudget. The index of each file and its whole
+ * declarations are kept in an IndexCache next to it, so that the walks
+ * are only done the first time a log is opened. Sample data is read with pread on shared
+ * descriptors, so LogReader is safe to use from several threads: the lock
+ * is only taken to open a file or to look up or store a stream index,
+ * never while a file is walked.
+ */
+class LogReader : public MemoryConsumer
+{
+public:
+  /**
+   * input_file_path may be a single file, a glob pattern or one file of
+   * a split log, in which case all the files of the split are loaded.
+   */
+  LogReader(const std::string &input_file_path);
+
+  LogReader(const std::vector<std::string> &input_file_paths);
+
+  ~LogReader();
+
+  LogStream stream(const std::string &stream_name);
+
+  const std::vector<std::string> &filenames() const
+  {
+    return filenames_;
+  }
+
+  size_t totalSamples(const std::string &stream_name);
+
+  /**
+   * Indexes stream_name with one checkpoint every density samples, see
+   * SparseIndex. Meant for huge streams: each lookup then walks up to
+   * density samples of block headers. Handles taken before keep the
+   * index they were given.
+   */
+  void useSparseIndex(const std::string &stream_name,
+                      size_t density = SparseIndex::DEFAULT_DENSITY);
+
+  /** Density of the indexes built on first use by all readers, 0 for full indexes */
+  static size_t indexDensity();
+
+  static void setIndexDensity(size_t density);
+
+  /** Type of a data stream, NULL when no file of the log declares it */
+  const Typelib::Type *streamType(const std::string &stream_name);
+
+  /** File offset of the sample payload and the file holding it */
+  int64_t samplePosition(const std::string &stream_name,
+                         size_t sample_index,
+                         size_t &segment);
+
+  base::Time sampleTime(const std::string &stream_name, size_t sample_index);
+
+  /** First sample logged at or after time, totalSamples() if none */
+  size_t sampleIndexAt(const std::string &stream_name, const base::Time &time);
+
+  /**
+   * Descriptor of a file of the log, shared by the readers using pread.
+   * The file is opened on first use, throws if it cannot be.
+   */
+  int fileDescriptor(size_t segment);
+
+  /**
+   * Index of stream_name, built on first use. The reader drops the indexes
+   * nobody holds when over the memory budget, they are built again on the
+   * next use.
+   */
+  QSharedPointer<const StreamIndex> streamIndex(const std::string &stream_name);
+
+  /**
+   * The calls taking a stream name look its index up on each call, for
+   * one-off reads. Loops over a stream take its index once from
+   * streamIndex() and pass it along with a cursor of their own.
+   */
+
+  /** Reads the headers of the given samples with one batch of requests */
+  void readHeaders(const std::string &stream_name,
+                   const std::vector<size_t> &sample_indices,
+                   std::vector<pocolog_cpp::SampleHeaderData> &headers,
+                   IOBackend &backend);
+
+  void readHeaders(const StreamIndex &index,
+                   SparseIndex::Cursor &cursor,
+                   const std::vector<size_t> &sample_indices,
+                   std::vector<pocolog_cpp::SampleHeaderData> &headers,
+                   IOBackend &backend);
+
+  /**
+   * Reads the headers and payloads of the given samples with two batches
+   * of requests through backend, one for the headers and one for the
+   * payloads. Payload buffers come from pool when one is given.
+   */
+  void readSamples(const std::string &stream_name,
+                   const std::vector<size_t> &sample_indices,
+                   std::vector<pocolog_cpp::SampleHeaderData> &headers,
+                   std::vector<std::vector<uint8_t> > &payloads,
+                   IOBackend &backend,
+                   BufferPool *pool = NULL);
+
+  void readSamples(const StreamIndex &index,
+                   SparseIndex::Cursor &cursor,
+                   const std::vector<size_t> &sample_indices,
+                   std::vector<pocolog_cpp::SampleHeaderData> &headers,
+                   std::vector<std::vector<uint8_t> > &payloads,
+                   IOBackend &backend,
+                   BufferPool *pool = NULL);
 
+  /**
+   * Reads the payloads of samples of size bytes each into consecutive
+   * slots of destination. Returns false, with destination undefined,
+   * when a sample has another size or is compressed.
+   */
+  bool readFixedSamples(const StreamIndex &index,
+                        SparseIndex::Cursor &cursor,
+                        const std::vector<size_t> &sample_indices,
+                        size_t size,
+                        uint8_t *destination,
+                        IOBackend &backend);
+
+  /**
+   * Hints the kernel about the file ranges holding the given samples
+   * (POSIX_FADV_WILLNEED or POSIX_FADV_DONTNEED).
+   */
+  void advise(const std::string &stream_name,
+              const std::vector<size_t> &sample_indices,
+              int advice);
+
+  void advise(const StreamIndex &index,
+              SparseIndex::Cursor &cursor,
+              const std::vector<size_t> &sample_indices,
+              int advice);
+
+  /** Records the pages of [start_index, final_index) in the page cache before an export reads them */
+  void snapshotPages(const StreamIndex &index,
+                     SparseIndex::Cursor &cursor,
+                     size_t start_index,
+                     size_t final_index,
+                     PageResidency &residency);
+
+  /** Drops the pages of the given samples that were not cached in residency */
+  void dropPages(const StreamIndex &index,
+                 SparseIndex::Cursor &cursor,
+                 const std::vector<size_t> &sample_indices,
+                 const PageResidency &residency);
+
+  /**
+   * Without cache, the input pages the export brought in and the data
+   * written are dropped from the page cache as the export goes, so a
+   * large export does not evict the pages used by the playback.
+   */
   void exportStream(const std::string &filename,
                      const std::string &stream_name,
                      int start_index,
                      int final_index,
                      export_stream_fcn_t fcn = NULL,
-                     void *data = NULL);
+                     void *data = NULL,
+                     bool cache = true);
 
+  /** Data streams declared by any file of the log, each once */
   std::vector<pocolog_cpp::StreamDescription> getDescriptions();
 
+  /** Writes the declaration of stream_name, with its metadata, to output */
+  void declareStream(pocolog_cpp::Output &output,
+                     const std::string &stream_name,
+                     int stream_index = 0);
+
+  /** Declaration of stream_name in the first file declaring it, throws if none does */
   void loadStreamDescription(const std::string &stream_name,
                              pocolog_cpp::StreamDescription &desc);
 
+  static std::vector<std::string> expandFilenames(const std::string &input_file_path);
+
+  size_t release(size_t bytes);
+
 private:
+  LogReader(const LogReader &);
+  LogReader &operator=(const LogReader &);
+
   std::vector<pocolog_cpp::StreamMetadata> getMetadata(pocolog_cpp::StreamDescription desc);
 
-  pocolog_cpp::LogFile log_file_;
+  void readHeaders(const StreamIndex &index,
+                   SparseIndex::Cursor &cursor,
+                   const std::vector<size_t> &sample_indices,
+                   std::vector<pocolog_cpp::SampleHeaderData> &headers,
+                   IOBackend &backend,
+                   std::vector<ReadRequest> &requests);
+
+  int64_t fileSize(size_t segment);
+
+  /** File ranges of the given samples, close ones merged */
+  void sampleRanges(const StreamIndex &index,
+                    SparseIndex::Cursor &cursor,
+                    const std::vector<size_t> &sample_indices,
+                    std::vector<FileRange> &ranges);
+
+  /** Index of stream_name over all the files, sparse when density is not 0 */
+  StreamIndex *buildIndex(const std::string &stream_name, size_t density);
+
+  /**
+   * Stream declarations of a file, walked on first use up to the first
+   * data block, or up to the end of the file when whole_file is set
+   */
+  std::vector<pocolog_cpp::StreamDescription> declarations(size_t segment, bool whole_file = false);
+
+  /** Declarations of the whole file kept in its IndexCache, false if there are none */
+  bool loadDeclarations(const IndexCache &cache,
+                        size_t segment,
+                        std::vector<pocolog_cpp::StreamDescription> &descriptions);
+
+  /** Finds the data stream declaration of stream_name, false if no file has one */
+  bool findDeclaration(const std::string &stream_name, pocolog_cpp::StreamDescription &desc);
+
+  static const size_t EXPORT_BATCH_SIZE = 256;
+
+  // advised ranges closer than this are merged in one hint
+  static const int64_t ADVICE_MERGE_GAP = 64 * 1024;
+
+  std::vector<std::string> filenames_;
+  // how much of each file the declarations were read from
+  enum Declared
+  {
+    NotDeclared,
+    LeadingDeclared,
+    FileDeclared
+  };
+
+  std::vector<std::vector<pocolog_cpp::StreamDescription> > declarations_;
+  std::vector<Declared> declared_;
+  std::vector<int> fds_;
+  std::vector<int64_t> file_sizes_;
+
+  std::map<std::string, QSharedPointer<const StreamIndex> > indexes_;
+
+  // registries loaded from the declarations, and the stream types in them
+  std::map<std::string, Typelib::Registry *> registries_;
+  std::map<std::string, const Typelib::Type *> types_;
+
+  QMutex mutex_;
 };
 
 } // namespace rock_replay_cpp
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+#include "MemoryBudget.hpp"
+
+namespace rock_replay_cpp
+{
+
+MemoryBudget::MemoryBudget()
+    : limit_(defaultLimit())
+    , total_(0)
+{
+}
+
+MemoryBudget &MemoryBudget::instance()
+{
+  static MemoryBudget budget;
+  return budget;
+}
+
+size_t MemoryBudget::defaultLimit()
+{
+  const char *env = getenv("ROCK_REPLAY_MEMORY_BUDGET");
+  if (env && atol(env) > 0)
+    return (size_t)atol(env) * 1024 * 1024;
+
+  return (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+}
+
+void MemoryBudget::setLimit(size_t bytes)
+{
+  QMutexLocker locker(&mutex_);
+  limit_ = bytes;
+  enforce();
+}
+
+size_t MemoryBudget::limit() const
+{
+  QMutexLocker locker(&mutex_);
+  return limit_;
+}
+
+size_t MemoryBudget::usage() const
+{
+  QMutexLocker locker(&mutex_);
+  return total_;
+}
+
+std::vector<MemoryBudget::Usage> MemoryBudget::usageByComponent() const
+{
+  QMutexLocker locker(&mutex_);
+
+  std::vector<Usage> result;
+  for (std::map<MemoryConsumer *, Usage>::const_iterator it = consumers_.begin(); it != consumers_.end(); it++)
+    result.push_back(it->second);
+  return result;
+}
+
+void MemoryBudget::add(MemoryConsumer *consumer, const std::string &name, int priority)
+{
+  QMutexLocker locker(&mutex_);
+
+  Usage usage;
+  usage.name = name;
+  usage.priority = priority;
+  usage.bytes = 0;
+  consumers_[consumer] = usage;
+}
+
+void MemoryBudget::remove(MemoryConsumer *consumer)
+{
+  QMutexLocker locker(&mutex_);
+
+  std::map<MemoryConsumer *, Usage>::iterator it = consumers_.find(consumer);
+  if (it == consumers_.end())
+    return;
+
+  total_ -= it->second.bytes;
+  consumers_.erase(it);
+}
+
+void MemoryBudget::charge(MemoryConsumer *consumer, int64_t delta)
+{
+  QMutexLocker locker(&mutex_);
+
+  std::map<MemoryConsumer *, Usage>::iterator it = consumers_.find(consumer);
+  if (it == consumers_.end())
+    return;
+
+  it->second.bytes += delta;
+  total_ += delta;
+
+  if (delta > 0)
+    enforce();
+}
+
+void MemoryBudget::enforce()
+{
+  for (int priority = PrefetchPriority; priority <= IndexPriority && total_ > limit_; priority++)
+  {
+    for (std::map<MemoryConsumer *, Usage>::iterator it = consumers_.begin();
+         it != consumers_.end() && total_ > limit_; it++)
+    {
+      if (it->second.priority != priority || it->second.bytes == 0)
+        continue;
+
+      size_t released = it->first->release(total_ - limit_);
+      released = std::min(released, it->second.bytes);
+
+      it->second.bytes -= released;
+      total_ -= released;
+    }
+  }
+}
+
+void MemoryBudget::report(std::ostream &os) const
+{
+  std::vector<Usage> usage = usageByComponent();
+
+  os << "Memory: " << this->usage() / (1024 * 1024) << " of "
+     << limit() / (1024 * 1024) << " MB" << std::endl;
+  for (std::vector<Usage>::const_iterator it = usage.begin(); it != usage.end(); it++)
+    os << "  " << it->name << ": " << it->bytes / 1024 << " kB" << std::endl;
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,93 @@
+#ifndef MemoryBudget_hpp
+#define MemoryBudget_hpp
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <QMutex>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * A buffer, cache or index accounted by the MemoryBudget.
+ */
+class MemoryConsumer
+{
+public:
+  virtual ~MemoryConsumer() {}
+
+  /**
+   * Called by the budget when the limit is exceeded. Frees up to bytes
+   * and returns the amount actually freed. Implementations must not call
+   * back into the budget from here.
+   */
+  virtual size_t release(size_t bytes) = 0;
+};
+
+/**
+ * Process-wide accounting of the memory held by the replay buffers.
+ *
+ * Consumers register with a priority and report every allocation and
+ * deallocation through charge(). When the total goes over the limit the
+ * consumers are asked to release memory, lowest priority first.
+ *
+ * A consumer must not hold its own locks while calling charge(), since
+ * charge() may call release() on it. It charges an allocation before
+ * release() can see it and a deallocation after, so that what it is
+ * charged for never runs below what release() may give back.
+ */
+class MemoryBudget
+{
+public:
+  enum Priority
+  {
+    PrefetchPriority = 0,
+    HistoryPriority = 1,
+    IndexPriority = 2
+  };
+
+  struct Usage
+  {
+    std::string name;
+    int priority;
+    size_t bytes;
+  };
+
+  static MemoryBudget &instance();
+
+  void setLimit(size_t bytes);
+
+  size_t limit() const;
+
+  size_t usage() const;
+
+  std::vector<Usage> usageByComponent() const;
+
+  void add(MemoryConsumer *consumer, const std::string &name, int priority);
+
+  void remove(MemoryConsumer *consumer);
+
+  void charge(MemoryConsumer *consumer, int64_t delta);
+
+  void report(std::ostream &os) const;
+
+  /** Limit from ROCK_REPLAY_MEMORY_BUDGET (in MB), half the RAM otherwise */
+  static size_t defaultLimit();
+
+private:
+  MemoryBudget();
+
+  void enforce();
+
+  mutable QMutex mutex_;
+  std::map<MemoryConsumer *, Usage> consumers_;
+  size_t limit_;
+  size_t total_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* MemoryBudget_hpp */
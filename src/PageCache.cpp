@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "PageCache.hpp"
+
+namespace rock_replay_cpp
+{
+
+void PageResidency::add(int fd, int64_t begin, int64_t end)
+{
+  const int64_t page_size = sysconf(_SC_PAGESIZE);
+
+  Range range;
+  range.fd = fd;
+  range.begin = begin / page_size * page_size;
+  const int64_t size = end - range.begin;
+  if (size <= 0)
+    return;
+  range.pages.assign((size + page_size - 1) / page_size, 0);
+
+  for (int64_t offset = 0; offset < size; offset += MAP_SIZE)
+  {
+    size_t length = size - offset < MAP_SIZE ? size - offset : MAP_SIZE;
+    unsigned char *pages = &range.pages[offset / page_size];
+
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, range.begin + offset);
+    if (map == MAP_FAILED || mincore(map, length, pages) != 0)
+    {
+      // unknown pages are taken as resident, they are then never dropped
+      memset(pages, 1, (length + page_size - 1) / page_size);
+    }
+    if (map != MAP_FAILED)
+      munmap(map, length);
+  }
+
+  ranges_.push_back(range);
+}
+
+void PageResidency::dropNew(int fd, int64_t begin, int64_t end) const
+{
+  const int64_t page_size = sysconf(_SC_PAGESIZE);
+
+  for (std::vector<Range>::const_iterator it = ranges_.begin(); it != ranges_.end(); it++)
+  {
+    if (it->fd != fd)
+      continue;
+
+    const int64_t range_end = it->begin + (int64_t)it->pages.size() * page_size;
+    if (end <= it->begin || begin >= range_end)
+      continue;
+
+    size_t first = (std::max(begin, it->begin) - it->begin) / page_size;
+    size_t last = (std::min(end, range_end) - it->begin + page_size - 1) / page_size;
+
+    // runs of pages that were not resident, one hint each
+    size_t run = first;
+    for (size_t i = first; i <= last; i++)
+    {
+      if (i < last && !(it->pages[i] & 1))
+        continue;
+
+      if (i > run)
+        posix_fadvise(fd, it->begin + run * page_size, (i - run) * page_size, POSIX_FADV_DONTNEED);
+      run = i + 1;
+    }
+  }
+}
+
+WriteBehind::WriteBehind()
+    : fd_(-1)
+    , dropped_(0)
+    , started_(0)
+{
+}
+
+WriteBehind::~WriteBehind()
+{
+  close();
+}
+
+void WriteBehind::open(const std::string &filename)
+{
+  close();
+  fd_ = ::open(filename.c_str(), O_WRONLY);
+  dropped_ = started_ = 0;
+}
+
+void WriteBehind::flush(int64_t written)
+{
+  if (fd_ < 0)
+    return;
+
+  int64_t previous = started_;
+  if (written > started_)
+  {
+    sync_file_range(fd_, started_, written - started_, SYNC_FILE_RANGE_WRITE);
+    started_ = written;
+  }
+  drop(previous);
+}
+
+void WriteBehind::close()
+{
+  if (fd_ < 0)
+    return;
+
+  drop(started_);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+void WriteBehind::drop(int64_t end)
+{
+  // dirty pages are not dropped, the write-back is waited for first
+  if (end <= dropped_)
+    return;
+
+  sync_file_range(fd_, dropped_, end - dropped_,
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(fd_, dropped_, end - dropped_, POSIX_FADV_DONTNEED);
+  dropped_ = end;
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,81 @@
+#ifndef PageCache_hpp
+#define PageCache_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace rock_replay_cpp
+{
+
+struct FileRange
+{
+  int fd;
+  int64_t begin;
+  int64_t end;
+};
+
+/**
+ * Pages of file ranges that were in the page cache when they were added
+ * (mincore). An export snapshots its input before reading it, and then
+ * drops only the pages it brought in: those the playback had cached stay.
+ */
+class PageResidency
+{
+public:
+  /** Records the resident pages of [begin, end) of fd */
+  void add(int fd, int64_t begin, int64_t end);
+
+  /** Drops the pages of [begin, end) of fd that were recorded as not resident */
+  void dropNew(int fd, int64_t begin, int64_t end) const;
+
+private:
+  struct Range
+  {
+    int fd;
+    int64_t begin;
+    std::vector<unsigned char> pages;
+  };
+
+  std::vector<Range> ranges_;
+
+  // bytes mapped at once to query their pages
+  static const int64_t MAP_SIZE = 1024 * 1024 * 1024;
+};
+
+/**
+ * Drops the pages of an export output once written back. Each flush()
+ * starts the write-back of the bytes written since the previous one,
+ * without waiting for it, and drops the range started by the previous
+ * flush, which is written back by then.
+ */
+class WriteBehind
+{
+public:
+  WriteBehind();
+
+  ~WriteBehind();
+
+  /** Opens a descriptor of its own on filename, only to write back and drop its pages */
+  void open(const std::string &filename);
+
+  /** written is the size of the file, everything before it is written to the kernel */
+  void flush(int64_t written);
+
+  /** Waits for the write-back still running, drops it and closes the descriptor */
+  void close();
+
+private:
+  WriteBehind(const WriteBehind &);
+  WriteBehind &operator=(const WriteBehind &);
+
+  void drop(int64_t end);
+
+  int fd_;
+  int64_t dropped_;
+  int64_t started_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* PageCache_hpp */
@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QScopedPointer>
+#include <base/samples/Sonar.hpp>
+#include <pocolog_cpp/Write.hpp>
+#include <typelib/pluginmanager.hh>
+#include <typelib/registry.hh>
+#include <typelib/value_ops.hh>
+#include "PlaybackBenchmark.hpp"
+#include "QLogViewer.hpp"
+
+namespace
+{
+
+// updated by the replacement of operator new below, from any thread
+uint64_t allocation_count = 0;
+uint64_t allocated_bytes = 0;
+
+} // namespace
+
+// the benchmark executable counts every allocation of the process
+void *operator new(size_t size)
+{
+  __sync_fetch_and_add(&allocation_count, 1);
+  __sync_fetch_and_add(&allocated_bytes, size);
+
+  void *memory = malloc(size ? size : 1);
+  if (!memory)
+    throw std::bad_alloc();
+  return memory;
+}
+
+void operator delete(void *memory) throw()
+{
+  free(memory);
+}
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+const char SONAR_TYPE_NAME[] = "/base/samples/Sonar";
+
+template <typename T>
+T percentile(std::vector<T> &values, double fraction)
+{
+  if (values.empty())
+    return 0;
+
+  typename std::vector<T>::iterator nth = values.begin() + (size_t)(fraction * (values.size() - 1));
+  std::nth_element(values.begin(), nth, values.end());
+  return *nth;
+}
+
+void writeString(std::ostream &os, const std::string &value)
+{
+  os << '"';
+  for (std::string::const_iterator it = value.begin(); it != value.end(); it++)
+  {
+    if (*it == '"' || *it == '\\')
+      os << '\\' << *it;
+    else if ((unsigned char)*it < 0x20)
+    {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*it);
+      os << escaped;
+    }
+    else
+      os << *it;
+  }
+  os << '"';
+}
+
+void writeField(std::ostream &os, const char *name, const char *type_name, const void *field, const void *base)
+{
+  os << "    <field name=\"" << name << "\" type=\"" << type_name << "\" offset=\""
+     << (const char *)field - (const char *)base << "\" />\n";
+}
+
+/** Typelib definition of base::samples::Sonar, with the layout of this build */
+std::string sonarTypeDefinition()
+{
+  base::samples::Sonar sonar;
+
+  std::ostringstream os;
+  os << "<?xml version=\"1.0\"?>\n"
+     << "<typelib>\n"
+     << "  <numeric name=\"/int64_t\" category=\"sint\" size=\"8\" />\n"
+     << "  <numeric name=\"/uint32_t\" category=\"uint\" size=\"4\" />\n"
+     << "  <numeric name=\"/double\" category=\"float\" size=\"8\" />\n"
+     << "  <numeric name=\"/float\" category=\"float\" size=\"4\" />\n"
+     << "  <compound name=\"/base/Time\" size=\"" << sizeof(base::Time) << "\">\n"
+     << "    <field name=\"microseconds\" type=\"/int64_t\" offset=\"0\" />\n"
+     << "  </compound>\n"
+     << "  <compound name=\"/base/Angle\" size=\"" << sizeof(base::Angle) << "\">\n"
+     << "    <field name=\"rad\" type=\"/double\" offset=\"0\" />\n"
+     << "  </compound>\n"
+     << "  <container name=\"/std/vector&lt;/base/Time&gt;\" of=\"/base/Time\" size=\""
+     << sizeof(sonar.timestamps) << "\" kind=\"/std/vector\" />\n"
+     << "  <container name=\"/std/vector&lt;/base/Angle&gt;\" of=\"/base/Angle\" size=\""
+     << sizeof(sonar.bearings) << "\" kind=\"/std/vector\" />\n"
+     << "  <container name=\"/std/vector&lt;/float&gt;\" of=\"/float\" size=\""
+     << sizeof(sonar.bins) << "\" kind=\"/std/vector\" />\n"
+     << "  <compound name=\"" << SONAR_TYPE_NAME << "\" size=\"" << sizeof(sonar) << "\">\n";
+
+  writeField(os, "time", "/base/Time", &sonar.time, &sonar);
+  writeField(os, "timestamps", "/std/vector&lt;/base/Time&gt;", &sonar.timestamps, &sonar);
+  writeField(os, "bin_duration", "/base/Time", &sonar.bin_duration, &sonar);
+  writeField(os, "beam_width", "/base/Angle", &sonar.beam_width, &sonar);
+  writeField(os, "beam_height", "/base/Angle", &sonar.beam_height, &sonar);
+  writeField(os, "bearings", "/std/vector&lt;/base/Angle&gt;", &sonar.bearings, &sonar);
+  writeField(os, "speed_of_sound", "/float", &sonar.speed_of_sound, &sonar);
+  writeField(os, "bin_count", "/uint32_t", &sonar.bin_count, &sonar);
+  writeField(os, "beam_count", "/uint32_t", &sonar.beam_count, &sonar);
+  writeField(os, "bins", "/std/vector&lt;/float&gt;", &sonar.bins, &sonar);
+
+  os << "  </compound>\n"
+     << "</typelib>\n";
+  return os.str();
+}
+
+} // namespace
+
+PlaybackBenchmark PlaybackBenchmark::run(
+    const QString &filename,
+    const QString &stream_name,
+    const QString &variant,
+    double target_rate,
+    size_t frames)
+{
+  QScopedPointer<QLogViewer> viewer(QLogViewer::create(filename, stream_name, 10, variant));
+  viewer->show();
+
+  // the markers cover the whole stream, its timer is left stopped
+  const size_t total = viewer->stream_.total_samples();
+  viewer->start_box_->setValue(0);
+  viewer->end_box_->setValue(std::max((size_t)1, total) - 1);
+  viewer->stream_.set_current_sample_index(0);
+  QApplication::processEvents();
+
+  PlaybackBenchmark result;
+  result.viewer = variant.isEmpty() ? "default" : variant.toStdString();
+  result.target_rate = target_rate;
+  result.frames = std::min(frames, total > 0 ? total - 1 : 0);
+  result.late_frames = 0;
+
+  std::vector<int64_t> latencies, wake_ups;
+  latencies.reserve(result.frames);
+  wake_ups.reserve(result.frames);
+
+  // nanoseconds between the scheduled frames, 0 back to back
+  const int64_t period = target_rate > 0 ? (int64_t)(1e9 / target_rate) : 0;
+
+  const uint64_t first_allocation_count = allocation_count;
+  const uint64_t first_allocated_bytes = allocated_bytes;
+
+  QElapsedTimer clock;
+  clock.start();
+  for (size_t frame = 0; frame < result.frames; frame++)
+  {
+    // events are processed while waiting, as in the event loop of the viewer
+    const int64_t scheduled = (int64_t)frame * period;
+    for (int64_t now = clock.nsecsElapsed(); now < scheduled; now = clock.nsecsElapsed())
+    {
+      QApplication::processEvents();
+      usleep(std::min((int64_t)1000, (scheduled - now) / 1000));
+    }
+
+    const int64_t start = clock.nsecsElapsed();
+    viewer->updateSample();
+
+    // the widgets changed by the sample are painted before the frame ends
+    QApplication::processEvents();
+    QApplication::flush();
+    const int64_t end = clock.nsecsElapsed();
+
+    if (period)
+    {
+      wake_ups.push_back((start - scheduled) / 1000);
+      latencies.push_back((end - scheduled) / 1000);
+      if (end > scheduled + period)
+        result.late_frames++;
+    }
+    else
+      latencies.push_back((end - start) / 1000);
+  }
+
+  result.seconds = clock.nsecsElapsed() / 1e9;
+  result.rate = result.seconds > 0 ? result.frames / result.seconds : 0;
+
+  const double frame_count = std::max((size_t)1, result.frames);
+  result.allocations_per_frame = (allocation_count - first_allocation_count) / frame_count;
+  result.allocated_bytes_per_frame = (allocated_bytes - first_allocated_bytes) / frame_count;
+
+  result.latency_p50 = percentile(latencies, 0.5);
+  result.latency_p90 = percentile(latencies, 0.9);
+  result.latency_p99 = percentile(latencies, 0.99);
+  result.latency_max = latencies.empty() ? 0 : *std::max_element(latencies.begin(), latencies.end());
+
+  result.wake_up_p50 = percentile(wake_ups, 0.5);
+  result.wake_up_p99 = percentile(wake_ups, 0.99);
+  result.wake_up_max = wake_ups.empty() ? 0 : *std::max_element(wake_ups.begin(), wake_ups.end());
+
+  return result;
+}
+
+void PlaybackBenchmark::generateSonarLog(
+    const std::string &filename,
+    const std::string &stream_name,
+    size_t pings,
+    size_t beam_count,
+    size_t bin_count)
+{
+  const std::string definition = sonarTypeDefinition();
+
+  // Typelib only loads registries from files
+  const std::string tlb_filename = filename + ".tlb";
+  {
+    std::ofstream tlb(tlb_filename.c_str());
+    tlb << definition;
+  }
+  QScopedPointer<Typelib::Registry> registry(Typelib::PluginManager::load("tlb", tlb_filename));
+  std::remove(tlb_filename.c_str());
+
+  const Typelib::Type *type = registry->get(SONAR_TYPE_NAME);
+  if (!type)
+    throw std::runtime_error("Could not define the sonar type");
+
+  std::ofstream os(filename.c_str(), std::ofstream::binary | std::ofstream::out);
+  pocolog_cpp::Output output(os);
+
+  const std::vector<pocolog_cpp::StreamMetadata> metadata;
+  output.writeStreamDeclaration(0, pocolog_cpp::DataStreamType, stream_name,
+                                SONAR_TYPE_NAME, definition, metadata);
+
+  // a 120 degree fan
+  base::samples::Sonar sonar;
+  sonar.bin_count = bin_count;
+  sonar.beam_count = beam_count;
+  sonar.bin_duration = base::Time::fromMicroseconds(50);
+  sonar.beam_width = base::Angle::fromRad(2 * M_PI / 3 / std::max((size_t)1, beam_count));
+  sonar.beam_height = base::Angle::fromRad(M_PI / 9);
+  sonar.speed_of_sound = 1500;
+  for (size_t beam = 0; beam < beam_count; beam++)
+    sonar.bearings.push_back(base::Angle::fromRad(M_PI / 3 - (beam + 0.5) * sonar.beam_width.getRad()));
+  sonar.bins.resize(beam_count * bin_count);
+
+  std::vector<uint8_t> payload;
+  uint32_t noise = 1;
+  for (size_t ping = 0; ping < pings; ping++)
+  {
+    sonar.time = base::Time::fromMicroseconds(1000000000000LL + (int64_t)ping * 100000);
+
+    // a target drifting in range over speckle
+    const double target = bin_count * (0.2 + 0.6 * (ping % 200) / 200.0);
+    for (size_t beam = 0; beam < beam_count; beam++)
+    {
+      const bool on_target = 8 * beam >= 3 * beam_count && 8 * beam < 5 * beam_count;
+      for (size_t bin = 0; bin < bin_count; bin++)
+      {
+        noise = noise * 1664525 + 1013904223;
+        float level = (noise >> 8) / 16777216.0f * 0.3f;
+        if (on_target && std::fabs(bin - target) < 4)
+          level += 0.6f;
+        sonar.bins[beam * bin_count + bin] = level;
+      }
+    }
+
+    payload.clear();
+    Typelib::dump(Typelib::Value(&sonar, *type), payload);
+    output.writeSample(0, sonar.time, sonar.time, payload.data(), payload.size());
+  }
+
+  if (!os.good())
+    throw std::runtime_error("Could not write " + filename);
+}
+
+void PlaybackBenchmark::writeJson(
+    std::ostream &os,
+    const std::string &log_name,
+    const std::string &stream_name,
+    const std::vector<PlaybackBenchmark> &results)
+{
+  os << "{\n  \"log\": ";
+  writeString(os, log_name);
+  os << ",\n  \"stream\": ";
+  writeString(os, stream_name);
+  os << ",\n  \"runs\": [";
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const PlaybackBenchmark &r = results[i];
+
+    os << (i ? ",\n" : "\n") << "    {\n";
+    os << "      \"viewer\": ";
+    writeString(os, r.viewer);
+    os << ",\n      \"target_fps\": " << r.target_rate
+       << ",\n      \"frames\": " << r.frames
+       << ",\n      \"seconds\": " << r.seconds
+       << ",\n      \"fps\": " << r.rate
+       << ",\n      \"latency_us\": {\"p50\": " << r.latency_p50
+       << ", \"p90\": " << r.latency_p90
+       << ", \"p99\": " << r.latency_p99
+       << ", \"max\": " << r.latency_max << "}"
+       << ",\n      \"wake_up_us\": {\"p50\": " << r.wake_up_p50
+       << ", \"p99\": " << r.wake_up_p99
+       << ", \"max\": " << r.wake_up_max << "}"
+       << ",\n      \"late_frames\": " << r.late_frames
+       << ",\n      \"allocations_per_frame\": " << r.allocations_per_frame
+       << ",\n      \"allocated_bytes_per_frame\": " << r.allocated_bytes_per_frame
+       << "\n    }";
+  }
+  os << "\n  ]\n}" << std::endl;
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,75 @@
+#ifndef PlaybackBenchmark_hpp
+#define PlaybackBenchmark_hpp
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <QString>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * End-to-end frame rate of a QLogViewer playing a stream: each frame
+ * steps the viewer, decodes the sample and paints every widget it
+ * changed, as a timer tick of the viewer does.
+ *
+ * Frames are either played back to back or scheduled at a fixed rate.
+ * Latencies are measured from the start of a frame, or from its
+ * scheduled time at a fixed rate, to the end of its paint; the wake-up
+ * is how late the frame started. Allocations are counted over the whole
+ * process, the prefetching thread included. Times are in microseconds.
+ */
+struct PlaybackBenchmark
+{
+  std::string viewer;
+  double target_rate;
+  size_t frames;
+
+  double seconds;
+  double rate;
+
+  int64_t latency_p50;
+  int64_t latency_p90;
+  int64_t latency_p99;
+  int64_t latency_max;
+
+  int64_t wake_up_p50;
+  int64_t wake_up_p99;
+  int64_t wake_up_max;
+
+  // frames ending after the scheduled time of the next one
+  size_t late_frames;
+
+  double allocations_per_frame;
+  double allocated_bytes_per_frame;
+
+  /**
+   * Plays up to frames samples of stream_name in the viewer variant
+   * (empty for the default viewer of the type), at target_rate frames
+   * per second or as fast as possible when 0. Needs a QApplication.
+   */
+  static PlaybackBenchmark run(const QString &filename,
+                               const QString &stream_name,
+                               const QString &variant,
+                               double target_rate,
+                               size_t frames);
+
+  /** Writes a log of synthetic sonar pings, 10 per second */
+  static void generateSonarLog(const std::string &filename,
+                               const std::string &stream_name,
+                               size_t pings,
+                               size_t beam_count,
+                               size_t bin_count);
+
+  /** log_name is the path of the log, or a description of the generated one */
+  static void writeJson(std::ostream &os,
+                        const std::string &log_name,
+                        const std::string &stream_name,
+                        const std::vector<PlaybackBenchmark> &results);
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* PlaybackBenchmark_hpp */
@@ -2,6 +2,8 @@
 #include <QApplication>
 #include <rock_widget_collection/Timeline.h>
 #include "QLogViewer.hpp"
+#include "ArrowExporter.hpp"
+#include "CompactSonar.hpp"
 
 using namespace pocolog_cpp;
 
@@ -21,20 +23,46 @@ void ExportStreamWorker::exportInterval()
 
   start_time_ = base::Time::now();
 
-  reader_->exportStream(
-      filename_.toStdString(),
-      stream_name_.toStdString(),
-      start_index_,
-      end_index_,
-      exportStreamCallback,
-      this);
+  // the export reads with pread next to the playback, which it must not
+  // block nor evict the pages of; an exception must not leave the thread
+  // without finished() emitted
+  try
+  {
+    if (filename_.endsWith(".arrow") || filename_.endsWith(".feather"))
+    {
+      ArrowExporter exporter(reader_);
+      exporter.exportStream(
+          filename_.toStdString(),
+          stream_name_.toStdString(),
+          start_index_,
+          end_index_,
+          exportStreamCallback,
+          this,
+          false);
+    }
+    else
+    {
+      reader_->exportStream(
+          filename_.toStdString(),
+          stream_name_.toStdString(),
+          start_index_,
+          end_index_,
+          exportStreamCallback,
+          this,
+          false);
+    }
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not export " << filename_.toStdString() << ": " << e.what() << std::endl;
+  }
 
   emit finished();
 }
 
 void ExportStreamWorker::cancel()
 {
-  canceled_ = true;
+  canceled_ = 1;
 }
 
 bool ExportStreamWorker::exportStreamCallback(int sampleNr, void* data)
@@ -55,6 +83,38 @@ void ExportStreamWorker::updateProgress(int sampleNr)
   }
 }
 
+void StatisticsWorker::compute()
+{
+  report_time_ = base::Time::now();
+
+  try
+  {
+    statistics_ = StreamStatistics::compute(reader_, std::vector<std::string>(), progressCallback, this);
+  }
+  catch (std::exception &e)
+  {
+    error_ = e.what();
+  }
+
+  emit finished();
+}
+
+void StatisticsWorker::cancel()
+{
+  canceled_ = 1;
+}
+
+bool StatisticsWorker::progressCallback(int progress, void *data)
+{
+  // the calls are serialized by StreamStatistics::compute
+  StatisticsWorker *thiz = reinterpret_cast<StatisticsWorker *>(data);
+  if ((base::Time::now() - thiz->report_time_).toSeconds() >= 0.1)
+  {
+    emit thiz->valueChanged(progress);
+    thiz->report_time_ = base::Time::now();
+  }
+  return !thiz->canceled_;
+}
 
 bool QStreamSelector::getStreamName(
     LogReader *reader,
@@ -157,7 +217,119 @@ void QStreamSelector::itemDoubleClicked(QTreeWidgetItem *item, int column)
   }
 }
 
-QLogViewer *QLogViewer::create(const QString &filepath, int rate)
+void QStatisticsDialog::showStatistics(LogReader *reader, QWidget *parent)
+{
+  // the headers of every stream are read, the GUI keeps running meanwhile
+  QThread thread;
+  StatisticsWorker worker(reader);
+  worker.moveToThread(&thread);
+
+  QProgressDialog progress_dialog("Computing stream statistics", "Abort", 0, StreamStatistics::PROGRESS_STEPS, parent);
+  progress_dialog.setWindowModality(Qt::WindowModal);
+  progress_dialog.setValue(0);
+
+  connect(&thread, SIGNAL(started()), &worker, SLOT(compute()));
+  connect(&worker, SIGNAL(finished()), &thread, SLOT(quit()), Qt::DirectConnection);
+  connect(&worker, SIGNAL(valueChanged(int)), &progress_dialog, SLOT(setValue(int)));
+  connect(&worker, SIGNAL(finished()), &progress_dialog, SLOT(reset()));
+  thread.start();
+
+  progress_dialog.exec();
+  if (progress_dialog.wasCanceled())
+    worker.cancel();
+  thread.wait();
+
+  if (progress_dialog.wasCanceled())
+    return;
+
+  if (!worker.error().empty())
+  {
+    QMessageBox::warning(parent, "Statistics", QString::fromStdString(worker.error()));
+    return;
+  }
+
+  QStatisticsDialog dialog(worker.statistics(), parent);
+  dialog.setWindowTitle("Stream Statistics");
+  dialog.exec();
+}
+
+QStatisticsDialog::QStatisticsDialog(
+    const std::vector<StreamStatistics> &statistics,
+    QWidget *parent)
+    : QDialog(parent)
+{
+  QTreeWidget *treewidget = new QTreeWidget();
+  treewidget->setMinimumWidth(600);
+  treewidget->setMinimumHeight(400);
+  treewidget->setColumnCount(2);
+  treewidget->setHeaderLabels(QStringList() << "Stream" << "Value");
+
+  for (std::vector<StreamStatistics>::const_iterator it = statistics.begin(); it != statistics.end(); it++)
+  {
+    QTreeWidgetItem *item = new QTreeWidgetItem(QStringList()
+                                                << QString::fromStdString(it->name)
+                                                << QString::fromStdString(it->type_name));
+    treewidget->addTopLevelItem(item);
+
+    addItem(item, "Samples", QString::number(it->samples));
+    addItem(item, "Rate", QString("%1 Hz").arg(it->rate, 0, 'f', 2));
+    addItem(item, "Interval", QString("%1 ms +/- %2 ms (min %3 ms, max %4 ms)")
+                                  .arg(it->interval_mean / 1000, 0, 'f', 3)
+                                  .arg(it->interval_stddev / 1000, 0, 'f', 3)
+                                  .arg(it->interval_min / 1000.0, 0, 'f', 3)
+                                  .arg(it->interval_max / 1000.0, 0, 'f', 3));
+    addItem(item, "Out of order", QString::number(it->out_of_order));
+
+    QTreeWidgetItem *histogram = addItem(item, "Interval histogram", "");
+    for (size_t i = 0; i < it->interval_histogram.size(); i++)
+      if (it->interval_histogram[i])
+        addItem(histogram,
+                i ? QString("%1 - %2 us").arg(1ULL << (i - 1)).arg(1ULL << i) : QString("<= 0 us"),
+                QString::number(it->interval_histogram[i]));
+
+    QTreeWidgetItem *gaps = addItem(item, "Gaps", QString::number(it->gap_count));
+    for (std::vector<StreamStatistics::Gap>::const_iterator gap = it->gaps.begin(); gap != it->gaps.end(); gap++)
+      addItem(gaps,
+              QString("before sample %1").arg(gap->index),
+              QString("%1 ms at %2")
+                  .arg(gap->duration / 1000.0, 0, 'f', 3)
+                  .arg(QString::fromStdString(base::Time::fromMicroseconds(gap->start).toString())));
+
+    addItem(item, "Latency", QString("p50 %1 ms, p90 %2 ms, p99 %3 ms (min %4 ms, max %5 ms)")
+                                 .arg(it->latency_p50 / 1000.0, 0, 'f', 3)
+                                 .arg(it->latency_p90 / 1000.0, 0, 'f', 3)
+                                 .arg(it->latency_p99 / 1000.0, 0, 'f', 3)
+                                 .arg(it->latency_min / 1000.0, 0, 'f', 3)
+                                 .arg(it->latency_max / 1000.0, 0, 'f', 3));
+    addItem(item, "Size", QString("mean %1 B, p50 %2 B, p99 %3 B (min %4 B, max %5 B)")
+                              .arg(it->size_mean, 0, 'f', 0)
+                              .arg(it->size_p50)
+                              .arg(it->size_p99)
+                              .arg(it->size_min)
+                              .arg(it->size_max));
+    addItem(item, "Size growth", QString("%1 B per 1000 samples").arg(it->size_slope * 1000, 0, 'f', 1));
+    addItem(item, "Total", QString("%1 MB").arg(it->total_bytes / (1024.0 * 1024.0), 0, 'f', 1));
+  }
+
+  treewidget->setColumnWidth(0, 250);
+
+  QVBoxLayout *main_layout = new QVBoxLayout();
+  main_layout->addWidget(treewidget);
+  setLayout(main_layout);
+  adjustSize();
+}
+
+QTreeWidgetItem *QStatisticsDialog::addItem(
+    QTreeWidgetItem *parent,
+    const QString &name,
+    const QString &value)
+{
+  QStringList strings;
+  strings << name << value;
+  return new QTreeWidgetItem(parent, strings);
+}
+
+QLogViewer *QLogViewer::create(const QString &filepath, int rate, const QString &variant)
 {
   LogReader *reader = new LogReader(filepath.toStdString());
 
@@ -165,23 +337,55 @@ QLogViewer *QLogViewer::create(const QString &filepath, int rate)
   if (!QStreamSelector::getStreamName(reader, qstream_name, qtype_name))
     return NULL;
 
-  std::string type_name = qtype_name.toStdString();
+  return create(reader, filepath, qstream_name, qtype_name.toStdString(), rate, variant);
+}
+
+QLogViewer *QLogViewer::create(
+    const QString &filepath,
+    const QString &stream_name,
+    int rate,
+    const QString &variant)
+{
+  LogReader *reader = new LogReader(filepath.toStdString());
 
-  if (widgetMap().find(type_name) == widgetMap().end())
+  const Typelib::Type *type = reader->streamType(stream_name.toStdString());
+  if (!type)
   {
-    std::cout << "Log type not defined not defined " << type_name << std::endl;
+    delete reader;
+    throw std::runtime_error("Stream not found: " + stream_name.toStdString());
+  }
+
+  return create(reader, filepath, stream_name, type->getName(), rate, variant);
+}
+
+QLogViewer *QLogViewer::create(
+    LogReader *reader,
+    const QString &filepath,
+    const QString &stream_name,
+    const std::string &type_name,
+    int rate,
+    const QString &variant)
+{
+  std::string key = type_name;
+  if (!variant.isEmpty())
+    key += ":" + variant.toStdString();
+
+  if (widgetMap().find(key) == widgetMap().end())
+  {
+    std::cout << "Log type not defined not defined " << key << std::endl;
     throw std::runtime_error("Not implemented");
   }
 
-  QLogViewer *v = widgetMap()[type_name]();
+  QLogViewer *v = widgetMap()[key]();
   v->filename_ = filepath;
-  v->construct(reader, qstream_name, rate);
+  v->construct(reader, stream_name, rate);
   return v;
 }
 
 QLogViewer::QLogViewer()
     : QWidget(NULL)
     , reader_(NULL)
+    , prefetcher_(NULL)
     , widget_(NULL)
     , current_index_box_(NULL)
     , total_samples_label_(NULL)
@@ -272,6 +476,19 @@ QLogViewer::QLogViewer()
 
   control_grid_layout->addWidget(frame, 1, 3);
 
+  memory_label_ = new QLabel();
+  memory_label_->setFrameStyle(QFrame::Panel | QFrame::Sunken);
+  memory_label_->setMaximumHeight(30);
+
+  label = new QLabel("Memory:");
+  label->setStyleSheet("font-weight: bold");
+  control_grid_layout->addWidget(label, 0, 4);
+  control_grid_layout->addWidget(memory_label_, 1, 4);
+
+  QPushButton *statistics_button = new QPushButton("Statistics");
+  connect(statistics_button, SIGNAL(clicked(bool)), this, SLOT(statisticsButtonClicked(bool)));
+  control_grid_layout->addWidget(statistics_button, 1, 5);
+
   QVBoxLayout *left_layout = new QVBoxLayout();
 
   QHBoxLayout *control_layout = new QHBoxLayout();
@@ -325,6 +542,7 @@ void QLogViewer::closeEvent(QCloseEvent *evt)
 
 QLogViewer::~QLogViewer()
 {
+  delete prefetcher_;
   delete reader_;
   delete widget_;
 }
@@ -337,6 +555,7 @@ QWidget *QLogViewer::createWidget()
 void QLogViewer::timeout()
 {
   updateSample();
+  updateMemoryUsage();
 }
 
 base::Time QLogViewer::update()
@@ -346,12 +565,27 @@ base::Time QLogViewer::update()
 
 void QLogViewer::updateSample()
 {
-  timeline_->setSliderIndex(stream_.current_sample_index());
+  size_t index = stream_.current_sample_index();
+  timeline_->setSliderIndex(index);
+
+  bool advance = false;
+  if (step_ >= 0)
+  {
+    advance = index < stream_.total_samples() &&
+              index < (size_t)timeline_->getEndMarkerIndex();
+    index += step_;
+  }
+  else
+  {
+    // the cursor points past the sample on display, so going back by
+    // |step_| samples lands on (index - 1) + step_
+    advance = (int)index >= timeline_->getStartMarkerIndex() + 1 - step_;
+    index = index - 1 + step_;
+  }
 
-  if (stream_.current_sample_index() < stream_.total_samples() &&
-      stream_.current_sample_index() < (size_t)timeline_->getEndMarkerIndex())
+  if (advance)
   {
-    stream_.set_current_sample_index(stream_.current_sample_index() + step_);
+    stream_.set_current_sample_index(index);
     base::Time t = update();
     if (!t.isNull())
       timestamp_->setText(QString::fromStdString(t.toString()));
@@ -360,7 +594,7 @@ void QLogViewer::updateSample()
 
 void QLogViewer::backButtonClicked(bool checked)
 {
-  if (step_ > 0)
+  if (step_ > -MAXIMUM_STEP)
     step_box_->setValue(--step_);
 }
 
@@ -368,6 +602,10 @@ void QLogViewer::playButtonClicked(bool checked)
 {
   if (stream_.current_sample_index() < (size_t)timeline_->getStartMarkerIndex())
     stream_.set_current_sample_index(timeline_->getStartMarkerIndex());
+
+  if (step_ < 0 && stream_.current_sample_index() > (size_t)timeline_->getEndMarkerIndex())
+    stream_.set_current_sample_index(timeline_->getEndMarkerIndex() + 1);
+
   timer_.start(rate_);
   running_  = true;
 }
@@ -394,10 +632,16 @@ void QLogViewer::copyEndButtonClicked(bool checked)
   end_box_->setValue(timeline_->getSliderIndex());
 }
 
+void QLogViewer::statisticsButtonClicked(bool checked)
+{
+  timer_.stop();
+  QStatisticsDialog::showStatistics(reader_, this);
+}
+
 void QLogViewer::saveIntervalButtonClicked(bool checked)
 {
   timer_.stop();
-  QFileInfo info(filename_);
+  QFileInfo info(QString::fromStdString(reader_->filenames().front()));
 
   QString export_filename = QString("%1%2%3-%4-%5.log")
       .arg(info.absolutePath())
@@ -411,7 +655,9 @@ void QLogViewer::saveIntervalButtonClicked(bool checked)
   export_filename = QFileDialog::getSaveFileName(NULL,
                                                  "Export interval",
                                                  export_filename,
-                                                 "All Files (*);;Log Files (*.log)",
+                                                 ArrowExporter::available()
+                                                     ? "All Files (*);;Log Files (*.log);;Arrow Files (*.arrow *.feather)"
+                                                     : "All Files (*);;Log Files (*.log)",
                                                  &filter,
                                                  options);
 
@@ -499,25 +745,57 @@ void QLogViewer::construct(
   stream_name_ = stream_name;
   stream_ = reader_->stream(stream_name_.toStdString());
 
+  // sonar pings are cached with quantized bins when enabled
+  PayloadCodec *codec = NULL;
+  const Typelib::Type *type = stream_.type();
+  if (SonarPayloadCodec::cacheBits() && type->getName() == "/base/samples/Sonar")
+    codec = new SonarPayloadCodec(type, SonarPayloadCodec::cacheBits());
+
+  prefetcher_ = new SamplePrefetcher(reader_, stream_name_.toStdString(), 64, 256, codec);
+  prefetcher_->start();
+  stream_.set_prefetcher(prefetcher_);
+
   current_index_box_->setMaximum(stream_.total_samples() - 1);
   start_box_->setMaximum(stream_.total_samples() - 2);
   end_box_->setMaximum(stream_.total_samples() - 1);
 
   total_samples_label_->setText(QString("%1").arg(stream_.total_samples()));
 
+  base::Time first_time, last_time;
+  stream_.time_range(first_time, last_time);
+  total_samples_label_->setToolTip(QString("%1 files\n%2\n%3")
+                                       .arg(reader_->filenames().size())
+                                       .arg(QString::fromStdString(first_time.toString()))
+                                       .arg(QString::fromStdString(last_time.toString())));
+
   timeline_->setSteps(stream_.total_samples() - 1);
   timeline_->setStepSize(1);
   timeline_->setSliderIndex(0);
 
-  step_box_->setMinimum(0);
+  step_box_->setMinimum(-MAXIMUM_STEP);
   step_box_->setMaximum(MAXIMUM_STEP);
 
   rate_ = rate;
   widget_ = createWidget();
+  updateMemoryUsage();
 
   connect(&timer_, SIGNAL(timeout()), this, SLOT(timeout()));
 }
 
+void QLogViewer::updateMemoryUsage()
+{
+  MemoryBudget &budget = MemoryBudget::instance();
+  memory_label_->setText(QString("%1 / %2 MB")
+                             .arg(budget.usage() / (1024 * 1024))
+                             .arg(budget.limit() / (1024 * 1024)));
+
+  QStringList lines;
+  std::vector<MemoryBudget::Usage> usage = budget.usageByComponent();
+  for (std::vector<MemoryBudget::Usage>::const_iterator it = usage.begin(); it != usage.end(); it++)
+    lines << QString("%1: %2 kB").arg(QString::fromStdString(it->name)).arg(it->bytes / 1024);
+  memory_label_->setToolTip(lines.join("\n"));
+}
+
 QPushButton* QLogViewer::createControlButton(const QString &icon_path)
 {
   QPixmap pix(icon_path);
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <rock_widget_collection/Timeline.h>
 #include "LogReader.hpp"
+#include "StreamStatistics.hpp"
 
 #define REGISTER_LOGVIEWER(S, T, C)                                            \
 class Register##C : RegisterQLogViewer {                                       \
@@ -18,6 +19,17 @@ public:                                                                        \
 template <> QLogViewer* QLogViewer::createLogViewer<T>() { return new C(); }   \
 Register##C Register##C::register##C = Register##C();
 
+// an alternative view V of type S, chosen with QLogViewer::create(..., V)
+#define REGISTER_LOGVIEWER_VARIANT(S, V, C)                                    \
+class Register##C : RegisterQLogViewer {                                       \
+public:                                                                        \
+  Register##C()                                                                \
+    : RegisterQLogViewer(std::string(S) + ":" + (V), createLogViewer) {}       \
+  static QLogViewer* createLogViewer() { return new C(); }                     \
+  static Register##C register##C;                                              \
+};                                                                             \
+Register##C Register##C::register##C = Register##C();
+
 
 namespace rock_replay_cpp
 {
@@ -45,7 +57,7 @@ public:
 
     start_index_ = start_index;
     end_index_ = end_index;
-    canceled_ = false;
+    canceled_ = 0;
   }
 
   void cancel();
@@ -73,7 +85,56 @@ private:
 
   int start_index_;
   int end_index_;
-  bool canceled_;
+
+  // set from the GUI thread, read from the export thread
+  QAtomicInt canceled_;
+};
+
+/** Computes the statistics of all the streams off the GUI thread */
+class StatisticsWorker : public QObject
+{
+  Q_OBJECT
+public:
+
+  StatisticsWorker(LogReader *reader)
+  {
+    reader_ = reader;
+    canceled_ = 0;
+  }
+
+  void cancel();
+
+  const std::vector<StreamStatistics> &statistics() const
+  {
+    return statistics_;
+  }
+
+  /** Empty unless the computation failed */
+  const std::string &error() const
+  {
+    return error_;
+  }
+
+signals:
+    void finished();
+    void valueChanged(int);
+
+public slots:
+    void compute();
+
+private:
+
+  static bool progressCallback(int progress, void *data);
+
+  LogReader *reader_;
+
+  std::vector<StreamStatistics> statistics_;
+  std::string error_;
+
+  base::Time report_time_;
+
+  // set from the GUI thread, read from the computing threads
+  QAtomicInt canceled_;
 };
 
 class RegisterQLogViewer
@@ -109,6 +170,17 @@ private:
   QString type_name_;
 };
 
+class QStatisticsDialog : public QDialog
+{
+public:
+  static void showStatistics(LogReader *reader, QWidget *parent = 0);
+
+private:
+  QStatisticsDialog(const std::vector<StreamStatistics> &statistics, QWidget *parent = 0);
+
+  QTreeWidgetItem *addItem(QTreeWidgetItem *parent, const QString &name, const QString &value);
+};
+
 class QLogViewer : public QWidget
 {
   Q_OBJECT
@@ -124,7 +196,15 @@ public:
     return v;
   }
 
-  static QLogViewer *create(const QString& filepath, int rate = 100);
+  static QLogViewer *create(const QString& filepath,
+                            int rate = 100,
+                            const QString &variant = QString());
+
+  /** Opens stream_name directly, without the stream selector */
+  static QLogViewer *create(const QString &filepath,
+                            const QString &stream_name,
+                            int rate,
+                            const QString &variant = QString());
 
   void closeEvent(QCloseEvent *evt);
 
@@ -144,6 +224,33 @@ protected:
     return stream_.next<T>(sample);
   }
 
+  /** Reads a sample without moving the cursor */
+  template <typename T>
+  bool readSample(T &sample, size_t sample_index)
+  {
+    return stream_.read_sample<T>(sample, sample_index);
+  }
+
+  size_t currentSampleIndex()
+  {
+    return stream_.current_sample_index();
+  }
+
+  size_t totalSamples()
+  {
+    return stream_.total_samples();
+  }
+
+  LogReader *reader() const
+  {
+    return reader_;
+  }
+
+  const QString &streamName() const
+  {
+    return stream_name_;
+  }
+
 
 protected slots:
 
@@ -163,6 +270,8 @@ protected slots:
 
   void saveIntervalButtonClicked(bool checked = false);
 
+  void statisticsButtonClicked(bool checked = false);
+
   void sliderReleased(int index);
 
   void sliderMoved(int index);
@@ -193,6 +302,8 @@ protected:
 
   void updateSample();
 
+  void updateMemoryUsage();
+
 
 private:
   static
@@ -210,6 +321,13 @@ private:
     widgetMap().insert(std::make_pair(type, fcn));
   }
 
+  static QLogViewer *create(LogReader *reader,
+                            const QString &filepath,
+                            const QString &stream_name,
+                            const std::string &type_name,
+                            int rate,
+                            const QString &variant);
+
   QPushButton *createControlButton(const QString &icon_path);
 
   static const int MAXIMUM_STEP = 15;
@@ -219,12 +337,15 @@ private:
   LogReader *reader_;
   LogStream stream_;
 
+  SamplePrefetcher *prefetcher_;
+
   QWidget *widget_;
 
   QSpinBox *current_index_box_;
 
   QLabel *total_samples_label_;
   QLabel *timestamp_;
+  QLabel *memory_label_;
 
   QSpinBox *start_box_;
   QSpinBox *end_box_;
@@ -241,6 +362,7 @@ private:
   bool running_;
 
   friend class RegisterQLogViewer;
+  friend struct PlaybackBenchmark;
 };
 
 
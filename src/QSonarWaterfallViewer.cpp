@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cstring>
+#include <QPainter>
+#include <QThread>
+#include <QtConcurrentMap>
+#include <typelib/value_ops.hh>
+#include "QSonarWaterfallViewer.hpp"
+#include "SonarRenderer.hpp"
+
+namespace rock_replay_cpp
+{
+
+struct QSonarWaterfallViewer::Row
+{
+  const Typelib::Type *type;
+  std::vector<uint8_t> payload;
+  uchar *line;
+  int width;
+};
+
+QSonarWaterfallWidget::QSonarWaterfallWidget(QWidget *parent)
+    : QWidget(parent)
+    , history_(NULL)
+    , mutex_(NULL)
+    , newest_row_(0)
+{
+}
+
+void QSonarWaterfallWidget::setHistory(const QImage *history, QMutex *mutex, int newest_row)
+{
+  history_ = history;
+  mutex_ = mutex;
+  newest_row_ = newest_row;
+  update();
+}
+
+void QSonarWaterfallWidget::paintEvent(QPaintEvent *event)
+{
+  if (!history_)
+    return;
+
+  QMutexLocker locker(mutex_);
+  if (history_->isNull())
+    return;
+
+  // rows [newest, end) on top, then the rows that wrapped around
+  const int rows = history_->height();
+  const int split = (int64_t)(rows - newest_row_) * height() / rows;
+
+  QPainter painter(this);
+  painter.drawImage(QRect(0, 0, width(), split), *history_,
+                    QRect(0, newest_row_, history_->width(), rows - newest_row_));
+  if (newest_row_ > 0)
+    painter.drawImage(QRect(0, split, width(), height() - split), *history_,
+                      QRect(0, 0, history_->width(), newest_row_));
+}
+
+QSonarWaterfallViewer::QSonarWaterfallViewer()
+    : history_bytes_(0)
+    , newest_(-1)
+{
+  MemoryBudget::instance().add(this, "waterfall history", MemoryBudget::HistoryPriority);
+}
+
+QSonarWaterfallViewer::~QSonarWaterfallViewer()
+{
+  MemoryBudget::instance().remove(this);
+}
+
+size_t QSonarWaterfallViewer::release(size_t bytes)
+{
+  // the update holding the lock may itself be charging, it is not waited for
+  if (!history_mutex_.tryLock())
+    return 0;
+
+  size_t released = history_bytes_;
+  history_ = QImage();
+  history_bytes_ = 0;
+  newest_ = -1;
+
+  history_mutex_.unlock();
+  return released;
+}
+
+QWidget *QSonarWaterfallViewer::createWidget()
+{
+  QSonarWaterfallWidget *w = new QSonarWaterfallWidget(NULL);
+  w->setWindowTitle(streamName());
+  w->resize(800, HISTORY_ROWS);
+  w->show();
+  return w;
+}
+
+void QSonarWaterfallViewer::renderRow(const base::samples::Sonar &sonar, uchar *line, int width)
+{
+  const size_t beam_count = sonar.bearings.size();
+  const size_t bin_count = sonar.bin_count;
+  const size_t cell_count = beam_count * bin_count;
+  if (cell_count == 0 || sonar.bins.size() < cell_count)
+  {
+    memset(line, 0, width);
+    return;
+  }
+
+  // positive bearings are to the left, as in the fan view
+  std::vector<std::pair<double, size_t> > beams(beam_count);
+  for (size_t i = 0; i < beam_count; i++)
+    beams[i] = std::make_pair(-sonar.bearings[i].getRad(), i);
+  std::sort(beams.begin(), beams.end());
+
+  for (int x = 0; x < width; x++)
+  {
+    size_t cell = (size_t)x * cell_count / width;
+    size_t beam = beams[cell / bin_count].second;
+    float level = sonar.bins[beam * bin_count + cell % bin_count] * 254;
+    line[x] = 1 + (uchar)std::min(254.0f, std::max(0.0f, level));
+  }
+}
+
+void QSonarWaterfallViewer::decodeRow(Row &row)
+{
+  try
+  {
+    base::samples::Sonar sonar;
+    Typelib::Value value(&sonar, *row.type);
+    Typelib::load(value, row.payload);
+    renderRow(sonar, row.line, row.width);
+  }
+  catch (std::exception &)
+  {
+    memset(row.line, 0, row.width);
+  }
+}
+
+void QSonarWaterfallViewer::allocate(int width)
+{
+  history_ = QImage(width, HISTORY_ROWS, QImage::Format_Indexed8);
+  history_.setColorTable(QVector<QRgb>::fromStdVector(SonarRenderer::colorTable()));
+  history_.fill(0);
+  newest_ = -1;
+}
+
+int QSonarWaterfallViewer::slot(int64_t sample_index)
+{
+  return HISTORY_ROWS - 1 - (int)(((sample_index % HISTORY_ROWS) + HISTORY_ROWS) % HISTORY_ROWS);
+}
+
+uchar *QSonarWaterfallViewer::line(int64_t sample_index)
+{
+  return history_.bits() + (size_t)slot(sample_index) * history_.bytesPerLine();
+}
+
+void QSonarWaterfallViewer::renderRows(int64_t first, int64_t last)
+{
+  // rows before the start of the log stay blank
+  for (; first <= last && first < 0; first++)
+    memset(line(first), 0, history_.width());
+
+  last = std::min(last, (int64_t)totalSamples() - 1);
+  if (first > last)
+    return;
+
+  if (backend_.isNull())
+    backend_.reset(IOBackend::create());
+
+  const std::string stream_name = streamName().toStdString();
+  const Typelib::Type *type = reader()->streamType(stream_name);
+  const int64_t wave_size = 4 * std::max(1, QThread::idealThreadCount());
+
+  // one lookup of the index for the whole rebuild, the cursor carries the
+  // sparse walk from one wave to the next
+  QSharedPointer<const StreamIndex> held_index = reader()->streamIndex(stream_name);
+  const StreamIndex &index = *held_index;
+  SparseIndex::Cursor cursor;
+
+  std::vector<size_t> indices;
+  std::vector<pocolog_cpp::SampleHeaderData> headers;
+  std::vector<std::vector<uint8_t> > payloads;
+
+  for (int64_t wave_start = first; wave_start <= last; wave_start += wave_size)
+  {
+    int64_t wave_end = std::min(last + 1, wave_start + wave_size);
+
+    indices.clear();
+    for (int64_t sampleNr = wave_start; sampleNr < wave_end; sampleNr++)
+      indices.push_back(sampleNr);
+
+    reader()->readSamples(index, cursor, indices, headers, payloads, *backend_);
+
+    // the row pointers are taken here, bits() must not run concurrently
+    std::vector<Row> rows(indices.size());
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+      rows[i].type = type;
+      rows[i].payload.swap(payloads[i]);
+      rows[i].line = line(indices[i]);
+      rows[i].width = history_.width();
+    }
+
+    QtConcurrent::blockingMap(rows, decodeRow);
+  }
+}
+
+base::Time QSonarWaterfallViewer::update()
+{
+  int64_t index = currentSampleIndex();
+
+  base::samples::Sonar sonar;
+  if (!nextSample<base::samples::Sonar>(sonar))
+    return base::Time();
+
+  QMutexLocker locker(&history_mutex_);
+  if (history_.isNull())
+  {
+    // charged before allocating, and outside of the lock as the budget may call release()
+    const int width = std::max((size_t)1, std::min((size_t)MAXIMUM_WIDTH, sonar.bearings.size() * sonar.bin_count));
+    const size_t bytes = (size_t)(width + 3) / 4 * 4 * HISTORY_ROWS;
+    locker.unlock();
+    MemoryBudget::instance().charge(this, bytes);
+    locker.relock();
+
+    history_bytes_ += bytes;
+    allocate(width);
+  }
+
+  int64_t distance = index - newest_;
+  if (newest_ < 0 || distance >= HISTORY_ROWS || distance <= -HISTORY_ROWS)
+  {
+    renderRows(index - HISTORY_ROWS + 1, index - 1);
+    renderRow(sonar, line(index), history_.width());
+  }
+  else if (distance > 0)
+  {
+    // the pings skipped by the step, then the one on display
+    renderRows(newest_ + 1, index - 1);
+    renderRow(sonar, line(index), history_.width());
+  }
+  else if (distance < 0)
+  {
+    // going back, older rows scroll in at the bottom
+    renderRows(index - HISTORY_ROWS + 1, newest_ - HISTORY_ROWS);
+  }
+  newest_ = index;
+
+  static_cast<QSonarWaterfallWidget *>(widget())->setHistory(&history_, &history_mutex_, slot(index));
+  return sonar.time;
+}
+
+REGISTER_LOGVIEWER_VARIANT("/base/samples/Sonar", "waterfall", QSonarWaterfallViewer)
+
+} // namespace rock_replay_cpp
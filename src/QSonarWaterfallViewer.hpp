@@ -0,0 +1,94 @@
+#ifndef QSONARWATERFALLVIEWER_H
+#define QSONARWATERFALLVIEWER_H
+
+#include <QImage>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QWidget>
+#include <base/samples/Sonar.hpp>
+#include "QLogViewer.hpp"
+#include "LogReader.hpp"
+#include "MemoryBudget.hpp"
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Paints the history of a QSonarWaterfallViewer, newest ping on top.
+ * The history is a ring of rows, drawn in two parts starting at the
+ * newest row. It is read under the mutex of the viewer, which may drop it.
+ */
+class QSonarWaterfallWidget : public QWidget
+{
+public:
+  QSonarWaterfallWidget(QWidget *parent = NULL);
+
+  void setHistory(const QImage *history, QMutex *mutex, int newest_row);
+
+protected:
+  virtual void paintEvent(QPaintEvent *event);
+
+private:
+  const QImage *history_;
+  QMutex *mutex_;
+  int newest_row_;
+};
+
+/**
+ * Waterfall of sonar pings: one row per ping, the beams side by side in
+ * bearing order, range going right.
+ *
+ * Sample s always lives in row HISTORY_ROWS - 1 - s % HISTORY_ROWS of
+ * the ring image, so playing in either direction only renders the rows
+ * of the samples scrolling in. A seek farther than the history rebuilds
+ * it, decoding the pings in parallel.
+ */
+class QSonarWaterfallViewer : public QLogViewer, public MemoryConsumer
+{
+public:
+  QSonarWaterfallViewer();
+
+  ~QSonarWaterfallViewer();
+
+  /**
+   * Drops the history, unless it is being rendered. The next update
+   * renders it again from the log.
+   */
+  size_t release(size_t bytes);
+
+  static const int HISTORY_ROWS = 512;
+  static const int MAXIMUM_WIDTH = 2048;
+
+protected:
+  virtual QWidget *createWidget();
+  virtual base::Time update();
+
+private:
+  struct Row;
+
+  static void renderRow(const base::samples::Sonar &sonar, uchar *line, int width);
+
+  static void decodeRow(Row &row);
+
+  void allocate(int width);
+
+  /** Renders the rows of the samples [first, last] from the log */
+  void renderRows(int64_t first, int64_t last);
+
+  static int slot(int64_t sample_index);
+
+  uchar *line(int64_t sample_index);
+
+  // the history and its newest row, release() may drop them from any thread
+  QMutex history_mutex_;
+  QImage history_;
+  size_t history_bytes_;
+  QScopedPointer<IOBackend> backend_;
+
+  // sample in the newest row, -1 while the history is empty
+  int64_t newest_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif // QSONARWATERFALLVIEWER_H
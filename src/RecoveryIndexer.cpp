@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <QtConcurrentMap>
+#include <pocolog_cpp/Format.hpp>
+#include "RecoveryIndexer.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+bool blockBefore(const RecoveredBlock &block, int64_t pos)
+{
+  return block.pos < pos;
+}
+
+bool readString(const std::vector<uint8_t> &payload, size_t &offset, std::string &str)
+{
+  uint32_t length;
+  if (offset + sizeof(length) > payload.size())
+    return false;
+
+  memcpy(&length, &payload[offset], sizeof(length));
+  offset += sizeof(length);
+
+  if (offset + length > payload.size())
+    return false;
+
+  str.assign((const char *)&payload[offset], length);
+  offset += length;
+  return true;
+}
+
+} // namespace
+
+RecoveryIndexer::RecoveryIndexer(const std::string &filename)
+    : filename_(filename)
+    , fd_(-1)
+    , file_size_(0)
+    , valid_prologue_(false)
+    , undeclared_samples_(0)
+{
+  fd_ = open(filename.c_str(), O_RDONLY);
+  if (fd_ < 0)
+    throw std::runtime_error("Error, could not open logfile " + filename);
+
+  struct stat st;
+  fstat(fd_, &st);
+  file_size_ = st.st_size;
+}
+
+RecoveryIndexer::~RecoveryIndexer()
+{
+  close(fd_);
+}
+
+void RecoveryIndexer::scan(int64_t chunk_size)
+{
+  blocks_.clear();
+  damaged_.clear();
+  streams_.clear();
+
+  pocolog_cpp::Prologue prologue;
+  valid_prologue_ =
+      pread(fd_, &prologue, sizeof(prologue), 0) == sizeof(prologue) &&
+      memcmp(prologue.magic, pocolog_cpp::FORMAT_MAGIC, sizeof(prologue.magic)) == 0;
+
+  std::vector<Chunk> chunks;
+  for (int64_t begin = sizeof(prologue); begin < file_size_; begin += chunk_size)
+  {
+    Chunk chunk;
+    chunk.fd = fd_;
+    chunk.begin = begin;
+    chunk.end = std::min(begin + chunk_size, file_size_);
+    chunk.file_size = file_size_;
+    chunks.push_back(chunk);
+  }
+
+  QtConcurrent::blockingMap(chunks, scanChunk);
+
+  std::vector<RecoveredBlock> candidates;
+  for (std::vector<Chunk>::iterator it = chunks.begin(); it != chunks.end(); it++)
+    candidates.insert(candidates.end(), it->candidates.begin(), it->candidates.end());
+
+  walk(candidates);
+}
+
+void RecoveryIndexer::scanChunk(Chunk &chunk)
+{
+  std::vector<uint8_t> buffer(chunk.end - chunk.begin + CHUNK_OVERLAP);
+  ssize_t count = pread(chunk.fd, buffer.data(), buffer.size(), chunk.begin);
+  if (count <= 1)
+    return;
+
+  const uint8_t *data = buffer.data();
+  int64_t limit = std::min<int64_t>(chunk.end - chunk.begin, count - 1);
+  int64_t i = 0;
+
+  RecoveredBlock block;
+
+#ifdef __SSE2__
+  // a block header starts with a known block type followed by a zero
+  // padding byte; test 16 offsets at once and only validate the hits
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(pocolog_cpp::StreamBlockType);
+  const __m128i range = _mm_set1_epi8(pocolog_cpp::ControlBlockType - pocolog_cpp::StreamBlockType);
+
+  for (; i + 16 <= limit; i += 16)
+  {
+    __m128i type = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(data + i)), one);
+    __m128i padding = _mm_loadu_si128((const __m128i *)(data + i + 1));
+
+    __m128i is_type = _mm_cmpeq_epi8(_mm_min_epu8(type, range), type);
+    __m128i is_padding = _mm_cmpeq_epi8(padding, zero);
+
+    int bits = _mm_movemask_epi8(_mm_and_si128(is_type, is_padding));
+    while (bits)
+    {
+      int64_t offset = i + __builtin_ctz(bits);
+      if (validate(data + offset, count - offset, chunk.begin + offset, chunk.file_size, block))
+        chunk.candidates.push_back(block);
+      bits &= bits - 1;
+    }
+  }
+#endif
+
+  for (; i < limit; i++)
+  {
+    if (data[i] < pocolog_cpp::StreamBlockType || data[i] > pocolog_cpp::ControlBlockType || data[i + 1] != 0)
+      continue;
+
+    if (validate(data + i, count - i, chunk.begin + i, chunk.file_size, block))
+      chunk.candidates.push_back(block);
+  }
+}
+
+bool RecoveryIndexer::validate(
+    const uint8_t *data,
+    int64_t available,
+    int64_t pos,
+    int64_t file_size,
+    RecoveredBlock &block)
+{
+  pocolog_cpp::BlockHeader header;
+  if (available < (int64_t)sizeof(header))
+    return false;
+
+  memcpy(&header, data, sizeof(header));
+
+  if (header.padding != 0 || header.data_size == 0 ||
+      pos + (int64_t)sizeof(header) + header.data_size > file_size)
+    return false;
+
+  const uint8_t *payload = data + sizeof(header);
+  available -= sizeof(header);
+
+  switch (header.type)
+  {
+  case pocolog_cpp::DataBlockType:
+  {
+    pocolog_cpp::SampleHeaderData sample;
+    if (header.data_size < sizeof(sample) || available < (int64_t)sizeof(sample))
+      return false;
+
+    memcpy(&sample, payload, sizeof(sample));
+    if (sample.data_size + sizeof(sample) != header.data_size ||
+        sample.realtime_tv_usec >= 1000000 ||
+        sample.timestamp_tv_usec >= 1000000 ||
+        sample.compressed > 1)
+      return false;
+    break;
+  }
+  case pocolog_cpp::StreamBlockType:
+  {
+    uint32_t name_length;
+    if (header.data_size < 1 + sizeof(name_length) || available < 1 + (int64_t)sizeof(name_length))
+      return false;
+
+    if (payload[0] != pocolog_cpp::DataStreamType && payload[0] != pocolog_cpp::ControlStreamType)
+      return false;
+
+    memcpy(&name_length, payload + 1, sizeof(name_length));
+    if (name_length == 0 || 1 + sizeof(name_length) + name_length > header.data_size)
+      return false;
+    break;
+  }
+  case pocolog_cpp::ControlBlockType:
+    if (header.data_size > 1024)
+      return false;
+    break;
+  default:
+    return false;
+  }
+
+  block.pos = pos;
+  block.data_size = header.data_size;
+  block.stream_idx = header.stream_idx;
+  block.type = header.type;
+  return true;
+}
+
+void RecoveryIndexer::walk(const std::vector<RecoveredBlock> &candidates)
+{
+  int64_t pos = sizeof(pocolog_cpp::Prologue);
+
+  while (pos < file_size_)
+  {
+    std::vector<RecoveredBlock>::const_iterator it =
+        std::lower_bound(candidates.begin(), candidates.end(), pos, blockBefore);
+
+    if (it != candidates.end() && it->pos == pos && accept(*it))
+    {
+      pos += sizeof(pocolog_cpp::BlockHeader) + it->data_size;
+      continue;
+    }
+
+    // resynchronize on the next candidate that is followed by another
+    // candidate (or by the end of the file)
+    for (; it != candidates.end(); it++)
+    {
+      if (it->pos <= pos || !startsChain(candidates, it))
+        continue;
+      if (it->type != pocolog_cpp::DataBlockType || streams_.count(it->stream_idx))
+        break;
+      undeclared_samples_++;
+    }
+
+    DamagedRegion region;
+    region.begin = pos;
+    region.end = (it == candidates.end()) ? file_size_ : it->pos;
+    damaged_.push_back(region);
+
+    pos = region.end;
+  }
+}
+
+bool RecoveryIndexer::accept(const RecoveredBlock &block)
+{
+  switch (block.type)
+  {
+  case pocolog_cpp::StreamBlockType:
+  {
+    std::vector<uint8_t> payload(block.data_size);
+    off_t payload_pos = block.pos + sizeof(pocolog_cpp::BlockHeader);
+    if (pread(fd_, payload.data(), payload.size(), payload_pos) != (ssize_t)payload.size())
+      return false;
+
+    RecoveredStream stream;
+    size_t offset = 1;
+    if (!readString(payload, offset, stream.name))
+      return false;
+    readString(payload, offset, stream.type_name);
+    stream.samples = 0;
+
+    streams_[block.stream_idx] = stream;
+    break;
+  }
+  case pocolog_cpp::DataBlockType:
+  {
+    // samples whose declaration was lost cannot be decoded anymore
+    std::map<uint16_t, RecoveredStream>::iterator it = streams_.find(block.stream_idx);
+    if (it == streams_.end())
+    {
+      undeclared_samples_++;
+      return false;
+    }
+    it->second.samples++;
+    break;
+  }
+  default:
+    break;
+  }
+
+  blocks_.push_back(block);
+  return true;
+}
+
+bool RecoveryIndexer::startsChain(
+    const std::vector<RecoveredBlock> &candidates,
+    std::vector<RecoveredBlock>::const_iterator it) const
+{
+  int64_t next = it->pos + sizeof(pocolog_cpp::BlockHeader) + it->data_size;
+  if (next == file_size_)
+    return true;
+
+  std::vector<RecoveredBlock>::const_iterator found =
+      std::lower_bound(it, candidates.end(), next, blockBefore);
+  return found != candidates.end() && found->pos == next;
+}
+
+size_t RecoveryIndexer::total_samples() const
+{
+  size_t total = 0;
+  for (std::map<uint16_t, RecoveredStream>::const_iterator it = streams_.begin(); it != streams_.end(); it++)
+    total += it->second.samples;
+  return total;
+}
+
+int64_t RecoveryIndexer::lost_bytes() const
+{
+  int64_t total = 0;
+  for (std::vector<DamagedRegion>::const_iterator it = damaged_.begin(); it != damaged_.end(); it++)
+    total += it->end - it->begin;
+  return total;
+}
+
+void RecoveryIndexer::report(std::ostream &os) const
+{
+  os << "Log file: " << filename_ << std::endl;
+  if (!valid_prologue_)
+    os << " Invalid prologue, a new one will be written" << std::endl;
+
+  os << " Intact samples: " << total_samples() << std::endl;
+  for (std::map<uint16_t, RecoveredStream>::const_iterator it = streams_.begin(); it != streams_.end(); it++)
+    os << "  " << it->second.name << " (" << it->second.type_name << "): "
+       << it->second.samples << std::endl;
+
+  os << " Damaged regions: " << damaged_.size() << std::endl;
+  for (std::vector<DamagedRegion>::const_iterator it = damaged_.begin(); it != damaged_.end(); it++)
+    os << "  [" << it->begin << ", " << it->end << ") " << (it->end - it->begin) << " bytes" << std::endl;
+
+  os << " Lost samples of undeclared streams: " << undeclared_samples_ << std::endl;
+  os << " Lost bytes: " << lost_bytes() << " of " << file_size_ << std::endl;
+}
+
+void RecoveryIndexer::writeRepaired(const std::string &filename) const
+{
+  int out = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0)
+    throw std::runtime_error("Error, could not create logfile " + filename);
+
+  if (valid_prologue_)
+  {
+    copyRange(out, 0, sizeof(pocolog_cpp::Prologue));
+  }
+  else
+  {
+    pocolog_cpp::Prologue prologue;
+    memcpy(prologue.magic, pocolog_cpp::FORMAT_MAGIC, sizeof(prologue.magic));
+    prologue.version = pocolog_cpp::FORMAT_VERSION;
+    prologue.flags = 0;
+    if (write(out, &prologue, sizeof(prologue)) != sizeof(prologue))
+    {
+      close(out);
+      throw std::runtime_error("Error, could not write logfile " + filename);
+    }
+  }
+
+  int64_t begin = 0;
+  int64_t end = 0;
+  for (std::vector<RecoveredBlock>::const_iterator it = blocks_.begin(); it != blocks_.end(); it++)
+  {
+    int64_t block_end = it->pos + sizeof(pocolog_cpp::BlockHeader) + it->data_size;
+    if (it->pos != end)
+    {
+      copyRange(out, begin, end);
+      begin = it->pos;
+    }
+    end = block_end;
+  }
+  copyRange(out, begin, end);
+
+  close(out);
+}
+
+void RecoveryIndexer::copyRange(int out, int64_t begin, int64_t end) const
+{
+  loff_t offset = begin;
+  while (offset < end)
+  {
+    ssize_t count = copy_file_range(fd_, &offset, out, NULL, end - offset, 0);
+    if (count > 0)
+      continue;
+
+    if (count < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL)
+      throw std::runtime_error("Error, could not copy log data");
+
+    // no in-kernel copy on this filesystem, fall back to plain reads
+    std::vector<uint8_t> buffer(std::min<int64_t>(end - offset, 8 * 1024 * 1024));
+    while (offset < end)
+    {
+      ssize_t n = pread(fd_, buffer.data(), std::min<int64_t>(buffer.size(), end - offset), offset);
+      if (n <= 0 || write(out, buffer.data(), n) != n)
+        throw std::runtime_error("Error, could not copy log data");
+      offset += n;
+    }
+  }
+}
+
+} // namespace rock_replay_cpp
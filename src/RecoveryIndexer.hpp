@@ -0,0 +1,128 @@
+#ifndef RecoveryIndexer_hpp
+#define RecoveryIndexer_hpp
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace rock_replay_cpp
+{
+
+struct RecoveredBlock
+{
+  int64_t pos;
+  uint32_t data_size;
+  uint16_t stream_idx;
+  uint8_t type;
+};
+
+struct DamagedRegion
+{
+  int64_t begin;
+  int64_t end;
+};
+
+struct RecoveredStream
+{
+  std::string name;
+  std::string type_name;
+  size_t samples;
+};
+
+/**
+ * Builds an index of the intact blocks of a truncated or corrupted log
+ * file without going through pocolog_cpp::LogFile.
+ *
+ * The file is split in chunks which are searched in parallel for block
+ * header signatures. Candidates are validated against the block and
+ * sample header invariants, then chained from the prologue on; whenever
+ * the chain breaks, the region up to the next candidate that starts a
+ * valid chain is reported as damaged and skipped.
+ */
+class RecoveryIndexer
+{
+public:
+  RecoveryIndexer(const std::string &filename);
+
+  ~RecoveryIndexer();
+
+  void scan(int64_t chunk_size = 16 * 1024 * 1024);
+
+  const std::vector<RecoveredBlock> &blocks() const
+  {
+    return blocks_;
+  }
+
+  const std::vector<DamagedRegion> &damaged_regions() const
+  {
+    return damaged_;
+  }
+
+  const std::map<uint16_t, RecoveredStream> &streams() const
+  {
+    return streams_;
+  }
+
+  size_t total_samples() const;
+
+  int64_t lost_bytes() const;
+
+  /** Intact samples left out because the declaration of their stream was lost */
+  size_t undeclared_samples() const
+  {
+    return undeclared_samples_;
+  }
+
+  void report(std::ostream &os) const;
+
+  /**
+   * Writes the prologue and every intact block to a new log file.
+   * Contiguous intact ranges are copied in the kernel when possible.
+   */
+  void writeRepaired(const std::string &filename) const;
+
+private:
+  struct Chunk
+  {
+    int fd;
+    int64_t begin;
+    int64_t end;
+    int64_t file_size;
+    std::vector<RecoveredBlock> candidates;
+  };
+
+  static void scanChunk(Chunk &chunk);
+
+  static bool validate(const uint8_t *data,
+                       int64_t available,
+                       int64_t pos,
+                       int64_t file_size,
+                       RecoveredBlock &block);
+
+  void walk(const std::vector<RecoveredBlock> &candidates);
+
+  bool accept(const RecoveredBlock &block);
+
+  bool startsChain(const std::vector<RecoveredBlock> &candidates,
+                   std::vector<RecoveredBlock>::const_iterator it) const;
+
+  void copyRange(int out, int64_t begin, int64_t end) const;
+
+  static const int64_t CHUNK_OVERLAP = 4096;
+
+  std::string filename_;
+  int fd_;
+  int64_t file_size_;
+  bool valid_prologue_;
+  size_t undeclared_samples_;
+
+  std::vector<RecoveredBlock> blocks_;
+  std::vector<DamagedRegion> damaged_;
+  std::map<uint16_t, RecoveredStream> streams_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* RecoveryIndexer_hpp */
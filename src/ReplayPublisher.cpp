@@ -0,0 +1,323 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <time.h>
+#include <QScopedPointer>
+#include <typelib/memory_layout.hh>
+#include "ReplayPublisher.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+int64_t logicalTime(const pocolog_cpp::SampleHeaderData &header)
+{
+  return (int64_t)header.timestamp_tv_sec * 1000000 + header.timestamp_tv_usec;
+}
+
+int64_t realTime(const pocolog_cpp::SampleHeaderData &header)
+{
+  return (int64_t)header.realtime_tv_sec * 1000000 + header.realtime_tv_usec;
+}
+
+void copyName(char *target, const std::string &name)
+{
+  strncpy(target, name.c_str(), ring::NAME_SIZE - 1);
+  target[ring::NAME_SIZE - 1] = '\0';
+}
+
+} // namespace
+
+ReplayPublisher::ReplayPublisher(
+    LogReader *reader,
+    const std::vector<std::string> &stream_names,
+    const std::string &shm_name,
+    size_t capacity,
+    double speed)
+    : reader_(reader)
+    , shm_name_(shm_name)
+    , speed_(speed)
+    , stopped_(0)
+    , pool_("publisher " + shm_name)
+    , header_(NULL)
+    , data_(NULL)
+    , mapped_size_(0)
+    , capacity_(ring::RECORD_ALIGNMENT)
+{
+  std::vector<std::string> names = stream_names;
+  if (names.empty())
+  {
+    std::vector<pocolog_cpp::StreamDescription> descriptions = reader_->getDescriptions();
+    for (std::vector<pocolog_cpp::StreamDescription>::iterator it = descriptions.begin(); it != descriptions.end(); it++)
+      if (it->getType() == pocolog_cpp::DataStreamType)
+        names.push_back(it->getName());
+  }
+
+  if (names.size() > ring::MAXIMUM_STREAMS)
+    throw std::runtime_error("Too many streams to publish");
+
+  for (std::vector<std::string>::iterator it = names.begin(); it != names.end(); it++)
+  {
+    if (!reader_->streamType(*it))
+      throw std::runtime_error("Stream not found: " + *it);
+
+    StreamState stream;
+    stream.name = *it;
+    stream.index = reader_->streamIndex(*it);
+    stream.total = stream.index->size();
+    stream.next_index = 0;
+    stream.position = 0;
+    stream.published = 0;
+    stream.bytes = 0;
+    stream.skipped = 0;
+    streams_.push_back(stream);
+  }
+
+  // positions are taken modulo the capacity
+  while (capacity_ < capacity)
+    capacity_ *= 2;
+
+  const uint64_t data_offset = (sizeof(ring::Header) + 4095) & ~(uint64_t)4095;
+  mapped_size_ = data_offset + capacity_;
+
+  shm_unlink(shm_name_.c_str());
+  int fd = shm_open(shm_name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0)
+    throw std::runtime_error("Could not create shared memory " + shm_name_ + ": " + strerror(errno));
+
+  if (ftruncate(fd, mapped_size_) < 0)
+  {
+    close(fd);
+    shm_unlink(shm_name_.c_str());
+    throw std::runtime_error("Could not size shared memory " + shm_name_ + ": " + strerror(errno));
+  }
+
+  void *memory = mmap(NULL, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED)
+  {
+    shm_unlink(shm_name_.c_str());
+    throw std::runtime_error("Could not map shared memory " + shm_name_ + ": " + strerror(errno));
+  }
+
+  header_ = (ring::Header *)memory;
+  data_ = (uint8_t *)memory + data_offset;
+
+  header_->version = ring::VERSION;
+  header_->stream_count = streams_.size();
+  header_->capacity = capacity_;
+  header_->data_offset = data_offset;
+
+  for (size_t i = 0; i < streams_.size(); i++)
+  {
+    const Typelib::Type &type = *reader_->streamType(streams_[i].name);
+
+    ring::StreamEntry &entry = header_->streams[i];
+    copyName(entry.name, streams_[i].name);
+    copyName(entry.type_name, type.getName());
+
+    try
+    {
+      if (Typelib::layout_of(type).isMemcpy())
+        entry.flags |= ring::Decoded;
+    }
+    catch (std::exception &)
+    {
+      // opaques and pointers have no flat layout
+    }
+  }
+
+  // consumers check the magic, it goes in last
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header_->magic, ring::MAGIC, sizeof(ring::MAGIC));
+}
+
+ReplayPublisher::~ReplayPublisher()
+{
+  munmap(header_, mapped_size_);
+  shm_unlink(shm_name_.c_str());
+}
+
+bool ReplayPublisher::fill(StreamState &stream, IOBackend &backend)
+{
+  stream.indices.clear();
+  while (stream.indices.size() < READ_AHEAD && stream.next_index < stream.total)
+    stream.indices.push_back(stream.next_index++);
+
+  stream.position = 0;
+  if (stream.indices.empty())
+  {
+    stream.headers.clear();
+    return false;
+  }
+
+  reader_->readSamples(*stream.index, stream.cursor, stream.indices, stream.headers, stream.payloads, backend, &pool_);
+  return true;
+}
+
+void ReplayPublisher::run()
+{
+  QScopedPointer<IOBackend> backend(IOBackend::create());
+
+  try
+  {
+    publishAll(*backend);
+  }
+  catch (std::exception &)
+  {
+    // consumers stop waiting, and no new one attaches to a dead ring
+    __atomic_store_n(&header_->finished, 1, __ATOMIC_RELEASE);
+    shm_unlink(shm_name_.c_str());
+    throw;
+  }
+
+  __atomic_store_n(&header_->finished, 1, __ATOMIC_RELEASE);
+}
+
+void ReplayPublisher::publishAll(IOBackend &backend)
+{
+  for (std::vector<StreamState>::iterator it = streams_.begin(); it != streams_.end(); it++)
+    fill(*it, backend);
+
+  timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int64_t first_logical = -1;
+
+  while (!stopped_)
+  {
+    // the stream with the oldest pending sample goes next
+    int oldest = -1;
+    int64_t oldest_time = 0;
+    for (size_t i = 0; i < streams_.size(); i++)
+    {
+      const StreamState &stream = streams_[i];
+      if (stream.position >= stream.headers.size())
+        continue;
+
+      int64_t time = logicalTime(stream.headers[stream.position]);
+      if (oldest < 0 || time < oldest_time)
+      {
+        oldest = i;
+        oldest_time = time;
+      }
+    }
+
+    if (oldest < 0)
+      break;
+
+    if (speed_ > 0)
+    {
+      if (first_logical < 0)
+        first_logical = oldest_time;
+
+      int64_t due = (oldest_time - first_logical) / speed_;
+      timespec deadline = start;
+      deadline.tv_sec += due / 1000000;
+      deadline.tv_nsec += (due % 1000000) * 1000;
+      if (deadline.tv_nsec >= 1000000000)
+      {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR && !stopped_)
+        ;
+    }
+
+    StreamState &stream = streams_[oldest];
+    publish(oldest, stream.indices[stream.position], stream.headers[stream.position], stream.payloads[stream.position]);
+    pool_.recycle(stream.payloads[stream.position]);
+
+    if (++stream.position == stream.headers.size())
+      fill(stream, backend);
+  }
+}
+
+void ReplayPublisher::publish(
+    uint16_t stream,
+    size_t sample_index,
+    const pocolog_cpp::SampleHeaderData &header,
+    const std::vector<uint8_t> &payload)
+{
+  const uint64_t length = ring::recordLength(payload.size());
+  if (length > capacity_ / 2)
+  {
+    streams_[stream].skipped++;
+    return;
+  }
+
+  // records never wrap, the end of the buffer is padded instead
+  uint64_t room = capacity_ - (header_->head & (capacity_ - 1));
+  if (room < length)
+  {
+    ring::Record *padding = (ring::Record *)reserve(room);
+    memset(padding, 0, sizeof(ring::Record));
+    padding->size = room - sizeof(ring::Record);
+    padding->flags = ring::Padding;
+    ring::store(&header_->head, header_->head + room);
+  }
+
+  ring::Record *record = (ring::Record *)reserve(length);
+  record->size = payload.size();
+  record->stream = stream;
+  record->flags = 0;
+  record->sample_index = sample_index;
+  record->realtime = realTime(header);
+  record->logical = logicalTime(header);
+  memcpy(record + 1, payload.data(), payload.size());
+
+  ring::store(&header_->head, header_->head + length);
+
+  streams_[stream].published++;
+  streams_[stream].bytes += payload.size();
+}
+
+uint8_t *ReplayPublisher::reserve(uint64_t length)
+{
+  const uint64_t head = header_->head;
+  uint64_t tail = header_->tail;
+
+  if (head + length > capacity_ && tail < head + length - capacity_)
+  {
+    // drop whole records until the new one fits
+    const uint64_t limit = head + length - capacity_;
+    while (tail < limit)
+      tail += ring::recordLength(((ring::Record *)(data_ + (tail & (capacity_ - 1))))->size);
+
+    // tail must be visible before the old records are overwritten
+    ring::store(&header_->tail, tail);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < ring::MAXIMUM_CONSUMERS; i++)
+    {
+      ring::ConsumerSlot &slot = header_->consumers[i];
+      if (__atomic_load_n(&slot.active, __ATOMIC_ACQUIRE) && ring::load(&slot.cursor) < tail)
+        slot.overruns++;
+    }
+  }
+
+  return data_ + (head & (capacity_ - 1));
+}
+
+void ReplayPublisher::report(std::ostream &os) const
+{
+  for (std::vector<StreamState>::const_iterator it = streams_.begin(); it != streams_.end(); it++)
+  {
+    os << it->name << ": " << it->published << " of " << it->total << " samples, "
+       << it->bytes / (1024 * 1024) << " MB";
+    if (it->skipped)
+      os << ", " << it->skipped << " larger than half the ring skipped";
+    os << std::endl;
+  }
+
+  for (size_t i = 0; i < ring::MAXIMUM_CONSUMERS; i++)
+  {
+    const ring::ConsumerSlot &slot = header_->consumers[i];
+    if (slot.active || slot.overruns)
+      os << "consumer " << slot.pid << ": " << slot.overruns << " overruns" << std::endl;
+  }
+}
+
+} // namespace rock_replay_cpp
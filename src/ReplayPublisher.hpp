@@ -0,0 +1,105 @@
+#ifndef ReplayPublisher_hpp
+#define ReplayPublisher_hpp
+
+#include <csignal>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "LogReader.hpp"
+#include "ReplayRing.hpp"
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Replays streams of a log into a shared-memory ring (see ReplayRing.hpp)
+ * for other processes to read.
+ *
+ * The samples of all the streams are merged by logical timestamp and
+ * published at the time they were logged, scaled by speed. A speed of 0
+ * publishes as fast as the log can be read.
+ *
+ * Payloads are published in their marshalled form. Streams whose type has
+ * the same layout in memory are flagged Decoded in the stream table, so
+ * consumers can use the payload as the C++ type directly.
+ */
+class ReplayPublisher
+{
+public:
+  ReplayPublisher(LogReader *reader,
+                  const std::vector<std::string> &stream_names,
+                  const std::string &shm_name,
+                  size_t capacity = DEFAULT_CAPACITY,
+                  double speed = 1.0);
+
+  ~ReplayPublisher();
+
+  /**
+   * Publishes until the end of the log or until stop() is called. When
+   * reading the log fails the ring is marked finished and unlinked before
+   * the error is thrown on.
+   */
+  void run();
+
+  /** May be called from a signal handler */
+  void stop()
+  {
+    stopped_ = 1;
+  }
+
+  void report(std::ostream &os) const;
+
+  static const size_t DEFAULT_CAPACITY = 256 * 1024 * 1024;
+
+private:
+  ReplayPublisher(const ReplayPublisher &);
+  ReplayPublisher &operator=(const ReplayPublisher &);
+
+  struct StreamState
+  {
+    std::string name;
+    QSharedPointer<const StreamIndex> index;
+    SparseIndex::Cursor cursor;
+    size_t total;
+    size_t next_index;
+
+    // samples read ahead, consumed from position
+    std::vector<size_t> indices;
+    std::vector<pocolog_cpp::SampleHeaderData> headers;
+    std::vector<std::vector<uint8_t> > payloads;
+    size_t position;
+
+    uint64_t published;
+    uint64_t bytes;
+    uint64_t skipped;
+  };
+
+  bool fill(StreamState &stream, IOBackend &backend);
+
+  void publishAll(IOBackend &backend);
+
+  void publish(uint16_t stream, size_t sample_index,
+               const pocolog_cpp::SampleHeaderData &header,
+               const std::vector<uint8_t> &payload);
+
+  uint8_t *reserve(uint64_t length);
+
+  static const size_t READ_AHEAD = 64;
+
+  LogReader *reader_;
+  std::string shm_name_;
+  double speed_;
+  volatile sig_atomic_t stopped_;
+
+  std::vector<StreamState> streams_;
+  BufferPool pool_;
+
+  ring::Header *header_;
+  uint8_t *data_;
+  size_t mapped_size_;
+  uint64_t capacity_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* ReplayPublisher_hpp */
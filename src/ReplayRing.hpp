@@ -0,0 +1,308 @@
+#ifndef ReplayRing_hpp
+#define ReplayRing_hpp
+
+#include <cstring>
+#include <string>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Layout of the shared-memory ring written by rock-replay-cpp --publish.
+ *
+ * This header only depends on POSIX, so consumer processes can include it
+ * as is and link with -lrt.
+ *
+ * The ring is a single-producer / multi-consumer byte ring. Records are
+ * written contiguously on 64-byte boundaries; a record that would cross
+ * the end of the buffer is preceded by a padding record. head and tail
+ * are monotonic byte counters, the position in the data area is the
+ * counter modulo the capacity.
+ *
+ * The publisher never waits for consumers. Before overwriting old
+ * records it moves tail past them, so a consumer whose cursor fell
+ * behind tail was overrun. Consumers read the records in place and
+ * check tail again once they are done with a record, which tells whether
+ * it was overwritten while in use.
+ */
+namespace ring
+{
+
+static const char MAGIC[8] = "ROCKRNG";
+static const uint32_t VERSION = 1;
+static const size_t MAXIMUM_STREAMS = 64;
+static const size_t MAXIMUM_CONSUMERS = 16;
+static const size_t NAME_SIZE = 128;
+static const size_t RECORD_ALIGNMENT = 64;
+
+enum RecordFlags
+{
+  Padding = 1
+};
+
+enum StreamFlags
+{
+  // the payload is the in-memory layout of the type, not its marshalled form
+  Decoded = 1
+};
+
+struct StreamEntry
+{
+  char name[NAME_SIZE];
+  char type_name[NAME_SIZE];
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct ConsumerSlot
+{
+  uint32_t active;
+  uint32_t pid;
+
+  // written by the consumer: offset of the next record it will read
+  uint64_t cursor;
+
+  // written by the publisher: times it overwrote records this consumer had not read
+  uint64_t overruns;
+
+  uint64_t reserved[5];
+};
+
+struct Header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t stream_count;
+  uint64_t capacity;
+  uint64_t data_offset;
+  uint32_t finished;
+  uint32_t reserved;
+
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+
+  StreamEntry streams[MAXIMUM_STREAMS];
+  ConsumerSlot consumers[MAXIMUM_CONSUMERS];
+};
+
+struct Record
+{
+  // payload bytes following the record header
+  uint32_t size;
+  uint16_t stream;
+  uint16_t flags;
+  uint64_t sample_index;
+
+  // microseconds since the epoch
+  int64_t realtime;
+  int64_t logical;
+};
+
+inline uint64_t recordLength(uint32_t size)
+{
+  return (sizeof(Record) + size + RECORD_ALIGNMENT - 1) & ~(uint64_t)(RECORD_ALIGNMENT - 1);
+}
+
+inline uint64_t load(const uint64_t *value)
+{
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+inline void store(uint64_t *value, uint64_t v)
+{
+  __atomic_store_n(value, v, __ATOMIC_RELEASE);
+}
+
+/**
+ * Consumer side of the ring. Usage:
+ *
+ *   RingConsumer consumer;
+ *   if (consumer.attach("/rock_replay")) {
+ *     const ring::Record *record;
+ *     while ((record = consumer.next())) {
+ *       process(record, consumer.payload(record));
+ *       if (!consumer.done(record))
+ *         ... // overwritten while in use, discard what was computed
+ *     }
+ *   }
+ *
+ * next() returns NULL when the consumer caught up with the publisher.
+ */
+class RingConsumer
+{
+public:
+  RingConsumer()
+      : header_(NULL), data_(NULL), size_(0), slot_(NULL), overruns_(0)
+  {
+  }
+
+  ~RingConsumer()
+  {
+    detach();
+  }
+
+  /** Maps the ring and claims a consumer slot, starting at the newest record */
+  bool attach(const std::string &name)
+  {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Header))
+    {
+      close(fd);
+      return false;
+    }
+
+    void *memory = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+      return false;
+
+    header_ = (Header *)memory;
+    size_ = st.st_size;
+
+    if (memcmp(header_->magic, MAGIC, sizeof(MAGIC)) != 0 || header_->version != VERSION)
+    {
+      detach();
+      return false;
+    }
+
+    data_ = (uint8_t *)memory + header_->data_offset;
+
+    for (size_t i = 0; i < MAXIMUM_CONSUMERS && !slot_; i++)
+    {
+      uint32_t expected = 0;
+      if (__atomic_compare_exchange_n(&header_->consumers[i].active, &expected, 1, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        slot_ = &header_->consumers[i];
+    }
+
+    if (!slot_)
+    {
+      detach();
+      return false;
+    }
+
+    slot_->pid = getpid();
+    slot_->overruns = 0;
+    store(&slot_->cursor, load(&header_->head));
+    return true;
+  }
+
+  void detach()
+  {
+    if (slot_)
+      __atomic_store_n(&slot_->active, 0, __ATOMIC_RELEASE);
+    if (header_)
+      munmap(header_, size_);
+
+    header_ = NULL;
+    data_ = NULL;
+    slot_ = NULL;
+  }
+
+  const Header *header() const
+  {
+    return header_;
+  }
+
+  const StreamEntry &stream(const Record *record) const
+  {
+    return header_->streams[record->stream];
+  }
+
+  /** True once the publisher reached the end of the log */
+  bool finished() const
+  {
+    return __atomic_load_n(&header_->finished, __ATOMIC_ACQUIRE);
+  }
+
+  /** Next record, in place in the ring, or NULL when there is none yet */
+  const Record *next()
+  {
+    for (;;)
+    {
+      uint64_t cursor = slot_->cursor;
+      if (cursor >= load(&header_->head))
+        return NULL;
+
+      uint64_t tail = load(&header_->tail);
+      if (cursor < tail)
+      {
+        overruns_++;
+        store(&slot_->cursor, tail);
+        continue;
+      }
+
+      const Record *record = (const Record *)(data_ + (cursor & (header_->capacity - 1)));
+      if (record->flags & Padding)
+      {
+        uint64_t length = recordLength(record->size);
+        if (!valid(cursor))
+          continue;
+        store(&slot_->cursor, cursor + length);
+        continue;
+      }
+      return record;
+    }
+  }
+
+  const uint8_t *payload(const Record *record) const
+  {
+    return (const uint8_t *)(record + 1);
+  }
+
+  /**
+   * Moves past record. Returns false if the publisher overwrote it while
+   * it was in use, in which case what was read from it is garbage.
+   */
+  bool done(const Record *record)
+  {
+    uint64_t cursor = slot_->cursor;
+    uint64_t length = recordLength(record->size);
+    if (!valid(cursor))
+      return false;
+
+    store(&slot_->cursor, cursor + length);
+    return true;
+  }
+
+  /** Records this consumer lost because it was too slow */
+  uint64_t overruns() const
+  {
+    return overruns_;
+  }
+
+private:
+  // the reads of the record happen before tail is checked again
+  bool valid(uint64_t cursor)
+  {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t tail = load(&header_->tail);
+    if (cursor >= tail)
+      return true;
+
+    overruns_++;
+    store(&slot_->cursor, tail);
+    return false;
+  }
+
+  Header *header_;
+  uint8_t *data_;
+  size_t size_;
+  ConsumerSlot *slot_;
+  uint64_t overruns_;
+};
+
+} // namespace ring
+
+} // namespace rock_replay_cpp
+
+#endif /* ReplayRing_hpp */
@@ -0,0 +1,574 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <QScopedPointer>
+#include <QtConcurrentMap>
+#include <typelib/typemodel.hh>
+#include <typelib/value_ops.hh>
+#include "ArrowExporter.hpp"
+#include "Resampler.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+// samples read per batch
+const size_t CHUNK_SIZE = 1024;
+
+const char DOUBLE_TYPE_NAME[] = "/double";
+const char DOUBLE_TYPE_DEFINITION[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<typelib>\n"
+    "  <numeric name=\"/double\" category=\"float\" size=\"8\" />\n"
+    "</typelib>\n";
+
+typedef double (*read_fcn_t)(const uint8_t *data);
+
+template <typename T>
+double readNumeric(const uint8_t *data)
+{
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+read_fcn_t numericReader(const Typelib::Type &type)
+{
+  if (type.getCategory() == Typelib::Type::Enum)
+    return readNumeric<int32_t>;
+
+  const Typelib::Numeric &numeric = static_cast<const Typelib::Numeric &>(type);
+  switch (numeric.getNumericCategory())
+  {
+  case Typelib::Numeric::Float:
+    return numeric.getSize() == 4 ? readNumeric<float> : readNumeric<double>;
+  case Typelib::Numeric::SInt:
+    switch (numeric.getSize())
+    {
+    case 1: return readNumeric<int8_t>;
+    case 2: return readNumeric<int16_t>;
+    case 4: return readNumeric<int32_t>;
+    default: return readNumeric<int64_t>;
+    }
+  default:
+    switch (numeric.getSize())
+    {
+    case 1: return readNumeric<uint8_t>;
+    case 2: return readNumeric<uint16_t>;
+    case 4: return readNumeric<uint32_t>;
+    default: return readNumeric<uint64_t>;
+    }
+  }
+}
+
+int64_t logicalTime(const pocolog_cpp::SampleHeaderData &header)
+{
+  return (int64_t)header.timestamp_tv_sec * 1000000 + header.timestamp_tv_usec;
+}
+
+// written without branches so that it is vectorized
+void blend(const double *a, const double *b, const double *weight, double *result, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    result[i] = a[i] + weight[i] * (b[i] - a[i]);
+}
+
+} // namespace
+
+struct Resampler::Field
+{
+  // a vector indexed on the way to the numeric
+  struct Step
+  {
+    size_t offset;
+    const Typelib::Container *container;
+    size_t index;
+  };
+
+  std::vector<Step> steps;
+
+  // offset of the numeric after the last step
+  size_t offset;
+  read_fcn_t read;
+
+  /** Resolves path in type, throws if it does not lead to a numeric */
+  Field(const Typelib::Type &type, const std::string &path);
+
+  double value(const uint8_t *memory) const
+  {
+    for (std::vector<Step>::const_iterator it = steps.begin(); it != steps.end(); it++)
+    {
+      memory += it->offset;
+      if (it->index >= it->container->getElementCount(memory))
+        return std::numeric_limits<double>::quiet_NaN();
+
+      // the element is only read, getElement() takes a mutable pointer
+      Typelib::Value element = it->container->getElement(const_cast<uint8_t *>(memory), it->index);
+      memory = static_cast<const uint8_t *>(element.getData());
+    }
+    return read(memory + offset);
+  }
+};
+
+Resampler::Field::Field(const Typelib::Type &root, const std::string &path)
+    : offset(0)
+    , read(NULL)
+{
+  const Typelib::Type *type = &root;
+  size_t pos = 0;
+
+  while (pos < path.size())
+  {
+    if (path[pos] == '.')
+    {
+      pos++;
+      continue;
+    }
+
+    if (path[pos] == '[')
+    {
+      size_t close = path.find(']', pos);
+      if (close == std::string::npos)
+        throw std::runtime_error("Missing ] in " + path);
+      size_t index = atol(path.substr(pos + 1, close - pos - 1).c_str());
+      pos = close + 1;
+
+      if (type->getCategory() == Typelib::Type::Array)
+      {
+        const Typelib::Array *array = static_cast<const Typelib::Array *>(type);
+        if (index >= array->getDimension())
+          throw std::runtime_error("Index out of the bounds of " + path);
+        type = &array->getIndirection();
+        offset += index * type->getSize();
+      }
+      else if (type->getCategory() == Typelib::Type::Container)
+      {
+        const Typelib::Container *container = static_cast<const Typelib::Container *>(type);
+        type = &container->getIndirection();
+
+        Step step;
+        step.offset = offset;
+        step.container = container;
+        step.index = index;
+        steps.push_back(step);
+        offset = 0;
+      }
+      else
+        throw std::runtime_error(path + " indexes " + type->getName() + ", which is not an array");
+      continue;
+    }
+
+    size_t end = path.find_first_of(".[", pos);
+    std::string name = path.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    pos = end == std::string::npos ? path.size() : end;
+
+    if (type->getCategory() != Typelib::Type::Compound)
+      throw std::runtime_error(type->getName() + " has no field " + name);
+
+    const Typelib::Compound::FieldList &fields = static_cast<const Typelib::Compound *>(type)->getFields();
+    Typelib::Compound::FieldList::const_iterator it = fields.begin();
+    while (it != fields.end() && it->getName() != name)
+      it++;
+    if (it == fields.end())
+      throw std::runtime_error(type->getName() + " has no field " + name);
+
+    offset += it->getOffset();
+    type = &it->getType();
+  }
+
+  if (type->getCategory() != Typelib::Type::Numeric && type->getCategory() != Typelib::Type::Enum)
+    throw std::runtime_error(path + " is a " + type->getName() + ", not a numeric field");
+  read = numericReader(*type);
+}
+
+struct Resampler::Source
+{
+  const Resampler *owner;
+  std::string stream_name;
+  std::vector<Field> fields;
+
+  // column of each field
+  std::vector<size_t> columns;
+
+  std::vector<int64_t> times;
+  std::vector<std::vector<double> > values;
+  std::vector<std::vector<double> > results;
+  std::string error;
+};
+
+Resampler::Resampler(LogReader *reader, Interpolation interpolation)
+    : reader_(reader)
+    , interpolation_(interpolation)
+    , period_(0)
+    , start_(0)
+    , end_(0)
+    , maximum_gap_(0)
+{
+}
+
+Resampler::Interpolation Resampler::parseInterpolation(const std::string &name)
+{
+  if (name == "nearest")
+    return Nearest;
+  if (name == "previous")
+    return Previous;
+  if (name == "linear")
+    return Linear;
+  throw std::runtime_error("Unknown interpolation " + name + ", use nearest, previous or linear");
+}
+
+void Resampler::addField(const std::string &stream_name, const std::string &path)
+{
+  const Typelib::Type *type = reader_->streamType(stream_name);
+  if (!type)
+    throw std::runtime_error("Stream " + stream_name + " is not a data stream");
+
+  // resolved here only to report a wrong path early
+  Field field(*type, path);
+
+  stream_names_.push_back(stream_name);
+  paths_.push_back(path);
+}
+
+void Resampler::setGrid(int64_t period, int64_t start, int64_t end)
+{
+  period_ = period;
+  start_ = start;
+  end_ = end;
+}
+
+void Resampler::setMaximumGap(int64_t gap)
+{
+  maximum_gap_ = gap;
+}
+
+void Resampler::run()
+{
+  if (period_ <= 0)
+    throw std::runtime_error("The resampling period must be positive");
+  if (stream_names_.empty())
+    throw std::runtime_error("No field to resample");
+
+  std::vector<Source> sources;
+  names_.clear();
+  for (size_t i = 0; i < stream_names_.size(); i++)
+  {
+    size_t s = 0;
+    while (s < sources.size() && sources[s].stream_name != stream_names_[i])
+      s++;
+
+    if (s == sources.size())
+    {
+      Source source;
+      source.owner = this;
+      source.stream_name = stream_names_[i];
+      sources.push_back(source);
+    }
+
+    const Typelib::Type &type = *reader_->streamType(stream_names_[i]);
+    sources[s].fields.push_back(Field(type, paths_[i]));
+    sources[s].columns.push_back(i);
+    names_.push_back(stream_names_[i] + "." + paths_[i]);
+  }
+
+  // the default grid covers the time range common to all the streams
+  int64_t start = start_, end = end_;
+  for (std::vector<Source>::iterator it = sources.begin(); it != sources.end(); it++)
+  {
+    size_t total = reader_->totalSamples(it->stream_name);
+    if (total == 0)
+      throw std::runtime_error("Stream " + it->stream_name + " has no sample");
+
+    int64_t first = reader_->sampleTime(it->stream_name, 0).toMicroseconds();
+    int64_t last = reader_->sampleTime(it->stream_name, total - 1).toMicroseconds();
+    if (start_ == 0 && (it == sources.begin() || first > start))
+      start = first;
+    if (end_ == 0 && (it == sources.begin() || last < end))
+      end = last;
+  }
+
+  times_.clear();
+  for (int64_t time = start; time <= end; time += period_)
+    times_.push_back(time);
+
+  QtConcurrent::blockingMap(sources, processSource);
+
+  columns_.assign(names_.size(), std::vector<double>());
+  for (std::vector<Source>::iterator it = sources.begin(); it != sources.end(); it++)
+  {
+    if (!it->error.empty())
+      throw std::runtime_error("Could not resample " + it->stream_name + ": " + it->error);
+    for (size_t i = 0; i < it->columns.size(); i++)
+      columns_[it->columns[i]].swap(it->results[i]);
+  }
+}
+
+void Resampler::processSource(Source &source)
+{
+  try
+  {
+    readSource(source);
+
+    std::vector<int64_t> lower;
+    std::vector<double> weight;
+    source.owner->locate(source, lower, weight);
+
+    source.results.resize(source.fields.size());
+    for (size_t i = 0; i < source.fields.size(); i++)
+    {
+      source.owner->interpolate(source.values[i], lower, weight, source.results[i]);
+      std::vector<double>().swap(source.values[i]);
+    }
+  }
+  catch (std::exception &e)
+  {
+    source.error = e.what();
+  }
+}
+
+void Resampler::readSource(Source &source)
+{
+  const Resampler &owner = *source.owner;
+  LogReader *reader = owner.reader_;
+  const std::string &stream_name = source.stream_name;
+  source.values.assign(source.fields.size(), std::vector<double>());
+  if (owner.times_.empty())
+    return;
+
+  // the samples around the grid, one more on each side to interpolate its ends
+  size_t first = reader->sampleIndexAt(stream_name, base::Time::fromMicroseconds(owner.times_.front()));
+  size_t last = reader->sampleIndexAt(stream_name, base::Time::fromMicroseconds(owner.times_.back()));
+  first = first > 0 ? first - 1 : 0;
+  last = std::min(reader->totalSamples(stream_name), last + 1);
+
+  const Typelib::Type &type = *reader->streamType(stream_name);
+
+  // fields behind a vector need the sample unmarshalled
+  bool direct = reader->stream(stream_name).fixed_layout(type.getSize());
+  for (std::vector<Field>::const_iterator it = source.fields.begin(); it != source.fields.end(); it++)
+    direct = direct && it->steps.empty();
+
+  std::vector<uint8_t> memory(type.getSize());
+  Typelib::Value value(memory.data(), type);
+  Typelib::init(value);
+
+  QSharedPointer<const StreamIndex> held_index = reader->streamIndex(stream_name);
+  const StreamIndex &index = *held_index;
+  SparseIndex::Cursor cursor;
+  QScopedPointer<IOBackend> backend(IOBackend::create());
+  BufferPool pool("resample " + stream_name, CHUNK_SIZE);
+  std::vector<size_t> indices;
+  std::vector<pocolog_cpp::SampleHeaderData> headers;
+  std::vector<std::vector<uint8_t> > payloads;
+
+  source.times.reserve(last - first);
+  for (size_t i = 0; i < source.values.size(); i++)
+    source.values[i].reserve(last - first);
+
+  try
+  {
+    for (size_t chunk_start = first; chunk_start < last; chunk_start += CHUNK_SIZE)
+    {
+      indices.clear();
+      for (size_t sampleNr = chunk_start; sampleNr < std::min(last, chunk_start + CHUNK_SIZE); sampleNr++)
+        indices.push_back(sampleNr);
+      reader->readSamples(index, cursor, indices, headers, payloads, *backend, &pool);
+
+      for (size_t i = 0; i < indices.size(); i++)
+      {
+        source.times.push_back(logicalTime(headers[i]));
+
+        const uint8_t *data = payloads[i].data();
+        if (!direct || payloads[i].size() != memory.size() || headers[i].compressed)
+        {
+          Typelib::load(value, payloads[i]);
+          data = memory.data();
+        }
+
+        for (size_t f = 0; f < source.fields.size(); f++)
+          source.values[f].push_back(source.fields[f].value(data));
+        pool.recycle(payloads[i]);
+      }
+    }
+  }
+  catch (...)
+  {
+    Typelib::destroy(value);
+    throw;
+  }
+  Typelib::destroy(value);
+
+  // samples logged out of order are put back in time order
+  if (std::adjacent_find(source.times.begin(), source.times.end(), std::greater<int64_t>()) != source.times.end())
+  {
+    std::vector<std::pair<int64_t, size_t> > order(source.times.size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = std::make_pair(source.times[i], i);
+    std::stable_sort(order.begin(), order.end());
+
+    std::vector<double> sorted(order.size());
+    for (size_t f = 0; f < source.values.size(); f++)
+    {
+      for (size_t i = 0; i < order.size(); i++)
+        sorted[i] = source.values[f][order[i].second];
+      source.values[f].swap(sorted);
+    }
+    for (size_t i = 0; i < order.size(); i++)
+      source.times[i] = order[i].first;
+  }
+}
+
+void Resampler::locate(const Source &source, std::vector<int64_t> &lower, std::vector<double> &weight) const
+{
+  const std::vector<int64_t> &times = source.times;
+  const size_t count = times.size();
+
+  lower.resize(times_.size());
+  weight.resize(times_.size());
+
+  // both sequences are sorted, one merge walk locates every grid point
+  size_t j = 0;
+  for (size_t k = 0; k < times_.size(); k++)
+  {
+    const int64_t time = times_[k];
+    while (j + 1 < count && times[j + 1] <= time)
+      j++;
+
+    lower[k] = -1;
+    weight[k] = 0;
+    if (count == 0 || time < times.front() || time > times.back())
+      continue;
+
+    if (j + 1 == count || times[j] == time)
+    {
+      lower[k] = j;
+      continue;
+    }
+
+    const int64_t interval = times[j + 1] - times[j];
+    if (maximum_gap_ > 0 && interval > maximum_gap_)
+      continue;
+
+    double w = (double)(time - times[j]) / interval;
+    switch (interpolation_)
+    {
+    case Previous:
+      lower[k] = j;
+      break;
+    case Nearest:
+      lower[k] = w < 0.5 ? j : j + 1;
+      break;
+    case Linear:
+      lower[k] = j;
+      weight[k] = w;
+      break;
+    }
+  }
+}
+
+void Resampler::interpolate(
+    const std::vector<double> &values,
+    const std::vector<int64_t> &lower,
+    const std::vector<double> &weight,
+    std::vector<double> &column) const
+{
+  const size_t count = lower.size();
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const int64_t last = (int64_t)values.size() - 1;
+
+  column.resize(count);
+
+  // the samples are gathered in blocks, then blended in one pass per block
+  double a[BLOCK_SIZE], b[BLOCK_SIZE];
+  for (size_t block = 0; block < count; block += BLOCK_SIZE)
+  {
+    const size_t n = std::min(BLOCK_SIZE, count - block);
+    const int64_t *index = &lower[block];
+
+    if (interpolation_ != Linear)
+    {
+      for (size_t i = 0; i < n; i++)
+        column[block + i] = index[i] < 0 ? nan : values[index[i]];
+      continue;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+      a[i] = index[i] < 0 ? nan : values[index[i]];
+      b[i] = index[i] < 0 ? nan : values[std::min(index[i] + 1, last)];
+    }
+    blend(a, b, &weight[block], &column[block], n);
+  }
+}
+
+void Resampler::write(const std::string &filename) const
+{
+  const std::string extension = filename.substr(std::min(filename.size(), filename.rfind('.')));
+  if (extension == ".arrow" || extension == ".feather")
+    ArrowExporter::writeTable(filename, times_, names_, columns_);
+  else if (extension == ".log")
+    writeLog(filename);
+  else
+    writeCsv(filename);
+}
+
+void Resampler::writeCsv(const std::string &filename) const
+{
+  std::ofstream os(filename.c_str());
+  os.precision(std::numeric_limits<double>::digits10 + 2);
+
+  os << "time";
+  for (std::vector<std::string>::const_iterator it = names_.begin(); it != names_.end(); it++)
+    os << "," << *it;
+  os << "\n";
+
+  for (size_t k = 0; k < times_.size(); k++)
+  {
+    os << times_[k];
+    for (size_t c = 0; c < columns_.size(); c++)
+    {
+      os << ",";
+      if (!std::isnan(columns_[c][k]))
+        os << columns_[c][k];
+    }
+    os << "\n";
+  }
+
+  if (!os.good())
+    throw std::runtime_error("Could not write " + filename);
+}
+
+void Resampler::writeLog(const std::string &filename) const
+{
+  std::ofstream os(filename.c_str(), std::ofstream::binary | std::ofstream::out);
+  pocolog_cpp::Output output(os);
+
+  const std::vector<pocolog_cpp::StreamMetadata> metadata;
+  for (size_t c = 0; c < names_.size(); c++)
+    output.writeStreamDeclaration(c, pocolog_cpp::DataStreamType, names_[c],
+                                  DOUBLE_TYPE_NAME, DOUBLE_TYPE_DEFINITION, metadata);
+
+  // in time order, as the logger writes them
+  for (size_t k = 0; k < times_.size(); k++)
+  {
+    base::Time time = base::Time::fromMicroseconds(times_[k]);
+    for (size_t c = 0; c < columns_.size(); c++)
+    {
+      double value = columns_[c][k];
+      if (!std::isnan(value))
+        output.writeSample(c, time, time, &value, sizeof(value));
+    }
+  }
+
+  if (!os.good())
+    throw std::runtime_error("Could not write " + filename);
+}
+
+} // namespace rock_replay_cpp
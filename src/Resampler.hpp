@@ -0,0 +1,109 @@
+#ifndef Resampler_hpp
+#define Resampler_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "LogReader.hpp"
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Resamples numeric fields of several streams on a common time grid.
+ *
+ * Fields are given by a path in the stream type, e.g. "position.x" or
+ * "bins[12]" ([n] indexes arrays and vectors). Every stream is read once
+ * into columns of logical times and values, in parallel. Each grid point
+ * is then located once per stream, and the fields are interpolated in
+ * blocks over the columns. Times are in microseconds.
+ *
+ * Grid points outside a stream, or in an interval between two samples
+ * longer than the maximum gap, are NaN.
+ */
+class Resampler
+{
+public:
+  enum Interpolation
+  {
+    Nearest,
+    Previous,
+    Linear
+  };
+
+  Resampler(LogReader *reader, Interpolation interpolation = Linear);
+
+  void addField(const std::string &stream_name, const std::string &path);
+
+  /** start and end 0 use the time range all the streams cover */
+  void setGrid(int64_t period, int64_t start = 0, int64_t end = 0);
+
+  /** 0 interpolates over any interval */
+  void setMaximumGap(int64_t gap);
+
+  /** Reads the streams and fills the columns */
+  void run();
+
+  const std::vector<int64_t> &times() const
+  {
+    return times_;
+  }
+
+  /** Column names, stream.path */
+  const std::vector<std::string> &names() const
+  {
+    return names_;
+  }
+
+  const std::vector<std::vector<double> > &columns() const
+  {
+    return columns_;
+  }
+
+  /** Writes the columns as CSV, Arrow (.arrow, .feather) or a log (.log) by extension */
+  void write(const std::string &filename) const;
+
+  void writeCsv(const std::string &filename) const;
+
+  /** One stream of doubles per column, NaN values are left out */
+  void writeLog(const std::string &filename) const;
+
+  static Interpolation parseInterpolation(const std::string &name);
+
+  // grid points interpolated at once
+  static const size_t BLOCK_SIZE = 1024;
+
+private:
+  struct Field;
+  struct Source;
+
+  /** Reads a stream and interpolates its fields, run in parallel per stream */
+  static void processSource(Source &source);
+
+  static void readSource(Source &source);
+
+  void locate(const Source &source, std::vector<int64_t> &lower, std::vector<double> &weight) const;
+
+  void interpolate(const std::vector<double> &values,
+                   const std::vector<int64_t> &lower,
+                   const std::vector<double> &weight,
+                   std::vector<double> &column) const;
+
+  LogReader *reader_;
+  Interpolation interpolation_;
+  int64_t period_;
+  int64_t start_;
+  int64_t end_;
+  int64_t maximum_gap_;
+
+  std::vector<std::string> stream_names_;
+  std::vector<std::string> paths_;
+
+  std::vector<int64_t> times_;
+  std::vector<std::string> names_;
+  std::vector<std::vector<double> > columns_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* Resampler_hpp */
@@ -0,0 +1,437 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <QScopedPointer>
+#include <QThread>
+#include <QtConcurrentMap>
+#include "SampleHash.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+const char SIDECAR_MAGIC[8] = "RRHASH";
+const uint32_t SIDECAR_VERSION = 1;
+
+// samples read at once by a batch, bounds the payloads held per thread
+const size_t READ_CHUNK_SIZE = 64;
+
+inline uint64_t rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = rotl(acc, 31);
+  return acc * PRIME64_1;
+}
+
+inline uint64_t mergeRound(uint64_t acc, uint64_t value)
+{
+  acc ^= round64(0, value);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+struct Batch
+{
+  LogReader *reader;
+  const StreamIndex *index;
+  size_t first;
+  size_t count;
+  SampleHash::Digest *digests;
+  std::string error;
+};
+
+void hashBatch(Batch &batch)
+{
+  try
+  {
+    QScopedPointer<IOBackend> backend(IOBackend::create());
+    SparseIndex::Cursor cursor;
+    std::vector<size_t> indices;
+    std::vector<pocolog_cpp::SampleHeaderData> headers;
+    std::vector<std::vector<uint8_t> > payloads;
+
+    for (size_t offset = 0; offset < batch.count; offset += READ_CHUNK_SIZE)
+    {
+      size_t n = std::min(READ_CHUNK_SIZE, batch.count - offset);
+      indices.resize(n);
+      for (size_t i = 0; i < n; i++)
+        indices[i] = batch.first + offset + i;
+
+      batch.reader->readSamples(*batch.index, cursor, indices, headers, payloads, *backend);
+
+      for (size_t i = 0; i < n; i++)
+      {
+        SampleHash::Digest &digest = batch.digests[offset + i];
+        digest.hash = xxh64(payloads[i].data(), payloads[i].size());
+        digest.logical = (int64_t)headers[i].timestamp_tv_sec * 1000000 + headers[i].timestamp_tv_usec;
+      }
+    }
+  }
+  catch (std::exception &e)
+  {
+    batch.error = e.what();
+  }
+}
+
+std::vector<std::string> dataStreamNames(LogReader *reader)
+{
+  std::vector<std::string> names;
+  std::vector<pocolog_cpp::StreamDescription> descriptions = reader->getDescriptions();
+  for (std::vector<pocolog_cpp::StreamDescription>::iterator it = descriptions.begin(); it != descriptions.end(); it++)
+    if (it->getType() == pocolog_cpp::DataStreamType)
+      names.push_back(it->getName());
+  return names;
+}
+
+std::string hexString(uint64_t value)
+{
+  char text[17];
+  snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+  return text;
+}
+
+} // namespace
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  const uint8_t *end = p + size;
+  uint64_t h;
+
+  if (size >= 32)
+  {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+
+    const uint8_t *limit = end - 32;
+    do
+    {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p + 8));
+      v3 = round64(v3, read64(p + 16));
+      v4 = round64(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = mergeRound(h, v1);
+    h = mergeRound(h, v2);
+    h = mergeRound(h, v3);
+    h = mergeRound(h, v4);
+  }
+  else
+  {
+    h = seed + PRIME64_5;
+  }
+
+  h += size;
+
+  for (; p + 8 <= end; p += 8)
+  {
+    h ^= round64(0, read64(p));
+    h = rotl(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+
+  if (p + 4 <= end)
+  {
+    h ^= (uint64_t)read32(p) * PRIME64_1;
+    h = rotl(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+
+  for (; p < end; p++)
+  {
+    h ^= *p * PRIME64_5;
+    h = rotl(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+SampleHash::SampleHash(LogReader *reader, size_t batch_size)
+    : reader_(reader)
+    , batch_size_(batch_size)
+{
+}
+
+std::vector<SampleHash::Digest> SampleHash::hashStream(
+    const std::string &stream_name,
+    size_t start_index,
+    size_t final_index,
+    export_stream_fcn_t fcn,
+    void *data)
+{
+  std::vector<Digest> digests(final_index > start_index ? final_index - start_index : 0);
+  QSharedPointer<const StreamIndex> held_index = reader_->streamIndex(stream_name);
+  const StreamIndex &index = *held_index;
+
+  // one batch per thread at a time, so the progress can be reported
+  const size_t wave_size = std::max(1, QThread::idealThreadCount());
+
+  size_t sampleNr = start_index;
+  while (sampleNr < final_index)
+  {
+    std::vector<Batch> batches;
+    while (batches.size() < wave_size && sampleNr < final_index)
+    {
+      Batch batch;
+      batch.reader = reader_;
+      batch.index = &index;
+      batch.first = sampleNr;
+      batch.count = std::min(batch_size_, final_index - sampleNr);
+      batch.digests = &digests[sampleNr - start_index];
+      batches.push_back(batch);
+      sampleNr += batch.count;
+    }
+
+    QtConcurrent::blockingMap(batches, hashBatch);
+
+    for (std::vector<Batch>::iterator it = batches.begin(); it != batches.end(); it++)
+      if (!it->error.empty())
+        throw std::runtime_error(it->error);
+
+    if (fcn != NULL && !fcn(sampleNr - 1, data))
+      break;
+  }
+
+  return digests;
+}
+
+uint64_t SampleHash::streamDigest(const std::vector<uint64_t> &hashes)
+{
+  return xxh64(hashes.data(), hashes.size() * sizeof(uint64_t));
+}
+
+std::vector<SampleHash::Mismatch> SampleHash::verify(
+    LogReader *exported,
+    const std::string &stream_name,
+    size_t start_index)
+{
+  std::vector<Mismatch> mismatches;
+
+  size_t exported_total = exported->totalSamples(stream_name);
+  size_t source_total = reader_->totalSamples(stream_name);
+  if (start_index + exported_total > source_total)
+  {
+    Mismatch mismatch;
+    mismatch.index = source_total;
+    mismatch.reason = "exported log is longer than the source";
+    mismatches.push_back(mismatch);
+    exported_total = start_index < source_total ? source_total - start_index : 0;
+  }
+
+  std::vector<Digest> source = hashStream(stream_name, start_index, start_index + exported_total);
+  std::vector<Digest> copy = SampleHash(exported, batch_size_).hashStream(stream_name, 0, exported_total);
+
+  for (size_t i = 0; i < exported_total && mismatches.size() < MAXIMUM_MISMATCHES; i++)
+  {
+    Mismatch mismatch;
+    mismatch.index = start_index + i;
+    if (source[i].hash != copy[i].hash)
+      mismatch.reason = "payload differs";
+    else if (source[i].logical != copy[i].logical)
+      mismatch.reason = "timestamp differs";
+    else
+      continue;
+    mismatches.push_back(mismatch);
+  }
+
+  return mismatches;
+}
+
+SampleHash::hash_map_t SampleHash::hashLog(export_stream_fcn_t fcn, void *data)
+{
+  hash_map_t hashes;
+  if (loadSidecar(hashes))
+    return hashes;
+
+  std::vector<std::string> names = dataStreamNames(reader_);
+  for (std::vector<std::string>::iterator it = names.begin(); it != names.end(); it++)
+  {
+    std::vector<Digest> digests = hashStream(*it, 0, reader_->totalSamples(*it), fcn, data);
+
+    std::vector<uint64_t> &column = hashes[*it];
+    column.resize(digests.size());
+    for (size_t i = 0; i < digests.size(); i++)
+      column[i] = digests[i].hash;
+  }
+
+  saveSidecar(hashes);
+  return hashes;
+}
+
+bool SampleHash::verifyLog(std::vector<std::pair<std::string, Mismatch> > &mismatches)
+{
+  std::ifstream is(sidecarFilename().c_str(), std::ifstream::binary);
+  if (!is.good())
+    return false;
+  is.close();
+
+  hash_map_t saved;
+  if (!loadSidecar(saved))
+  {
+    Mismatch mismatch;
+    mismatch.index = 0;
+    mismatch.reason = "file sizes differ from the ones the hashes were computed for";
+    mismatches.push_back(std::make_pair(std::string(), mismatch));
+    return true;
+  }
+
+  std::vector<std::string> names = dataStreamNames(reader_);
+  for (std::vector<std::string>::iterator it = names.begin(); it != names.end(); it++)
+  {
+    hash_map_t::const_iterator column = saved.find(*it);
+    if (column == saved.end())
+    {
+      Mismatch mismatch;
+      mismatch.index = 0;
+      mismatch.reason = "stream has no saved hashes";
+      mismatches.push_back(std::make_pair(*it, mismatch));
+      continue;
+    }
+
+    std::vector<Digest> digests = hashStream(*it, 0, reader_->totalSamples(*it));
+    for (size_t i = 0; i < digests.size() && mismatches.size() < MAXIMUM_MISMATCHES; i++)
+    {
+      if (i < column->second.size() && column->second[i] == digests[i].hash)
+        continue;
+
+      Mismatch mismatch;
+      mismatch.index = i;
+      mismatch.reason = i < column->second.size() ? "payload differs" : "sample was not hashed";
+      mismatches.push_back(std::make_pair(*it, mismatch));
+    }
+  }
+
+  return true;
+}
+
+std::string SampleHash::sidecarFilename() const
+{
+  return reader_->filenames().front() + ".hashes";
+}
+
+std::vector<uint64_t> SampleHash::fileSizes() const
+{
+  std::vector<uint64_t> sizes;
+  const std::vector<std::string> &filenames = reader_->filenames();
+  for (std::vector<std::string>::const_iterator it = filenames.begin(); it != filenames.end(); it++)
+  {
+    struct stat st;
+    sizes.push_back(stat(it->c_str(), &st) == 0 ? st.st_size : 0);
+  }
+  return sizes;
+}
+
+bool SampleHash::loadSidecar(hash_map_t &hashes) const
+{
+  std::ifstream is(sidecarFilename().c_str(), std::ifstream::binary);
+  if (!is.good())
+    return false;
+
+  char magic[8];
+  uint32_t version, file_count, stream_count;
+  is.read(magic, sizeof(magic));
+  is.read((char *)&version, sizeof(version));
+  is.read((char *)&file_count, sizeof(file_count));
+  is.read((char *)&stream_count, sizeof(stream_count));
+  if (!is.good() || memcmp(magic, SIDECAR_MAGIC, sizeof(magic)) != 0 || version != SIDECAR_VERSION)
+    return false;
+
+  // the hashes are stale once any file of the log changed
+  std::vector<uint64_t> sizes(file_count);
+  is.read((char *)sizes.data(), file_count * sizeof(uint64_t));
+  if (!is.good() || sizes != fileSizes())
+    return false;
+
+  for (uint32_t i = 0; i < stream_count; i++)
+  {
+    uint32_t name_size;
+    uint64_t count;
+    is.read((char *)&name_size, sizeof(name_size));
+    std::string name(name_size, '\0');
+    is.read(&name[0], name_size);
+    is.read((char *)&count, sizeof(count));
+
+    std::vector<uint64_t> &column = hashes[name];
+    column.resize(count);
+    is.read((char *)column.data(), count * sizeof(uint64_t));
+    if (!is.good())
+    {
+      hashes.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+void SampleHash::saveSidecar(const hash_map_t &hashes) const
+{
+  std::string filename = sidecarFilename();
+  std::string temporary = filename + ".tmp";
+
+  std::ofstream os(temporary.c_str(), std::ofstream::binary | std::ofstream::out);
+  if (!os.good())
+    throw std::runtime_error("Could not write " + temporary);
+
+  std::vector<uint64_t> sizes = fileSizes();
+  uint32_t file_count = sizes.size();
+  uint32_t stream_count = hashes.size();
+  os.write(SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+  os.write((const char *)&SIDECAR_VERSION, sizeof(SIDECAR_VERSION));
+  os.write((const char *)&file_count, sizeof(file_count));
+  os.write((const char *)&stream_count, sizeof(stream_count));
+  os.write((const char *)sizes.data(), sizes.size() * sizeof(uint64_t));
+
+  for (hash_map_t::const_iterator it = hashes.begin(); it != hashes.end(); it++)
+  {
+    uint32_t name_size = it->first.size();
+    uint64_t count = it->second.size();
+    os.write((const char *)&name_size, sizeof(name_size));
+    os.write(it->first.data(), name_size);
+    os.write((const char *)&count, sizeof(count));
+    os.write((const char *)it->second.data(), count * sizeof(uint64_t));
+  }
+
+  os.close();
+  if (!os.good() || rename(temporary.c_str(), filename.c_str()) != 0)
+    throw std::runtime_error("Could not write " + filename);
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,86 @@
+#ifndef SampleHash_hpp
+#define SampleHash_hpp
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "LogReader.hpp"
+
+namespace rock_replay_cpp
+{
+
+/** XXH64 of size bytes */
+uint64_t xxh64(const void *data, size_t size, uint64_t seed = 0);
+
+/**
+ * Per-sample hashes of the raw payloads of a stream.
+ *
+ * Hashes are computed in parallel over the marshalled bytes, no sample is
+ * decoded. The hashes of a whole log can be kept in a sidecar file next
+ * to its first file (name.log.hashes) so archived copies are checked, or
+ * found to be duplicates, without reading their source again.
+ */
+class SampleHash
+{
+public:
+  struct Digest
+  {
+    uint64_t hash;
+    int64_t logical;
+  };
+
+  struct Mismatch
+  {
+    size_t index;
+    std::string reason;
+  };
+
+  typedef std::map<std::string, std::vector<uint64_t> > hash_map_t;
+
+  SampleHash(LogReader *reader, size_t batch_size = 1024);
+
+  /** Hashes and logical timestamps of the samples [start_index, final_index) */
+  std::vector<Digest> hashStream(const std::string &stream_name,
+                                 size_t start_index,
+                                 size_t final_index,
+                                 export_stream_fcn_t fcn = NULL,
+                                 void *data = NULL);
+
+  /** XXH64 over the sample hashes, identical for identical streams */
+  static uint64_t streamDigest(const std::vector<uint64_t> &hashes);
+
+  /**
+   * Compares the samples of stream_name in exported with the source
+   * samples starting at start_index. Returns the mismatches, at most
+   * MAXIMUM_MISMATCHES of them.
+   */
+  std::vector<Mismatch> verify(LogReader *exported,
+                               const std::string &stream_name,
+                               size_t start_index);
+
+  /** Hashes of every data stream of the log, saved in the sidecar */
+  hash_map_t hashLog(export_stream_fcn_t fcn = NULL, void *data = NULL);
+
+  /** Compares the log with its sidecar, false when there is none */
+  bool verifyLog(std::vector<std::pair<std::string, Mismatch> > &mismatches);
+
+  std::string sidecarFilename() const;
+
+  bool loadSidecar(hash_map_t &hashes) const;
+
+  void saveSidecar(const hash_map_t &hashes) const;
+
+  static const size_t MAXIMUM_MISMATCHES = 100;
+
+private:
+  std::vector<uint64_t> fileSizes() const;
+
+  LogReader *reader_;
+  size_t batch_size_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* SampleHash_hpp */
@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <QScopedPointer>
+#include <pocolog_cpp/Format.hpp>
+#include "SamplePrefetcher.hpp"
+#include "LogReader.hpp"
+
+namespace rock_replay_cpp
+{
+
+SamplePrefetcher::SamplePrefetcher(
+    LogReader *reader,
+    const std::string &stream_name,
+    size_t block_size,
+    size_t capacity,
+    PayloadCodec *codec)
+    : reader_(reader)
+    , stream_name_(stream_name)
+    , index_(reader->streamIndex(stream_name))
+    , block_size_(block_size)
+    , capacity_(codec ? capacity * codec->ratio() : capacity)
+    , pool_("prefetch " + stream_name, capacity_)
+    , codec_(codec)
+    , cached_bytes_(0)
+    , cursor_(0)
+    , stopped_(false)
+    , last_index_(0)
+    , stride_(1)
+    , frontier_(0)
+{
+  MemoryBudget::instance().add(this, "prefetch " + stream_name, MemoryBudget::PrefetchPriority);
+}
+
+SamplePrefetcher::~SamplePrefetcher()
+{
+  stop();
+  wait();
+
+  MemoryBudget::instance().remove(this);
+}
+
+void SamplePrefetcher::stop()
+{
+  QMutexLocker locker(&mutex_);
+  stopped_ = true;
+  wait_condition_.wakeAll();
+}
+
+bool SamplePrefetcher::fetch(size_t sample_index, std::vector<uint8_t> &buffer)
+{
+  bool decoded;
+  return fetch(sample_index, buffer, NULL, typeid(void), decoded);
+}
+
+bool SamplePrefetcher::fetch(size_t sample_index,
+                             std::vector<uint8_t> &buffer,
+                             void *sample,
+                             const std::type_info &sample_type,
+                             bool &decoded)
+{
+  decoded = false;
+  int64_t delta = (int64_t)sample_index - (int64_t)last_index_;
+
+  if (delta != 0 && delta >= -MAXIMUM_STRIDE && delta <= MAXIMUM_STRIDE)
+  {
+    if (delta != stride_)
+    {
+      stride_ = delta;
+      frontier_ = sample_index;
+    }
+  }
+  else if (delta != 0)
+  {
+    // a jump keeps the direction but invalidates what was scheduled
+    frontier_ = sample_index;
+  }
+
+  last_index_ = sample_index;
+
+  bool found = false;
+  {
+    QMutexLocker locker(&mutex_);
+    cursor_ = sample_index;
+
+    std::map<size_t, std::vector<uint8_t> >::iterator it = cache_.find(sample_index);
+    if (it != cache_.end())
+    {
+      buffer.swap(it->second);
+      cache_.erase(it);
+      cached_bytes_ -= buffer.size();
+      found = true;
+    }
+  }
+
+  if (found)
+    MemoryBudget::instance().charge(this, -(int64_t)buffer.size());
+
+  if (found && !codec_.isNull() && sample && codec_->sampleType() && *codec_->sampleType() == sample_type)
+  {
+    try
+    {
+      codec_->decodeSample(buffer, sample);
+      decoded = true;
+    }
+    catch (std::exception &)
+    {
+      // left to the synchronous path of LogStream
+      found = false;
+    }
+    pool_.recycle(buffer);
+  }
+  else if (found && !codec_.isNull())
+  {
+    std::vector<uint8_t> payload;
+    pool_.acquire(payload, buffer.size() * codec_->ratio());
+    try
+    {
+      codec_->decode(buffer, payload);
+      buffer.swap(payload);
+    }
+    catch (std::exception &)
+    {
+      // left to the synchronous path of LogStream
+      found = false;
+    }
+    pool_.recycle(payload);
+  }
+
+  int64_t ahead = (frontier_ - (int64_t)sample_index) / stride_;
+  if (ahead < 0)
+  {
+    frontier_ = sample_index;
+    ahead = 0;
+  }
+
+  if (ahead < (int64_t)(block_size_ / 2))
+    schedule();
+
+  return found;
+}
+
+void SamplePrefetcher::schedule()
+{
+  int64_t total = index_->size();
+
+  std::vector<Request> block;
+  for (size_t i = 0; i < block_size_; i++)
+  {
+    int64_t index = frontier_ + stride_;
+    if (index < 0 || index >= total)
+      break;
+
+    Request request;
+    request.index = index;
+    int64_t time;
+    request.pos = index_->locate(index, request.segment, time, schedule_cursor_);
+    block.push_back(request);
+
+    frontier_ = index;
+  }
+
+  if (block.empty())
+    return;
+
+  QMutexLocker locker(&mutex_);
+  pending_.push_back(block);
+  while (pending_.size() > MAXIMUM_PENDING)
+    pending_.pop_front();
+  wait_condition_.wakeOne();
+}
+
+void SamplePrefetcher::run()
+{
+  QScopedPointer<IOBackend> backend(IOBackend::create());
+  SparseIndex::Cursor cursor;
+
+  for (;;)
+  {
+    std::vector<Request> block;
+    {
+      QMutexLocker locker(&mutex_);
+      while (!stopped_ && pending_.empty())
+        wait_condition_.wait(&mutex_);
+
+      if (stopped_)
+        return;
+
+      block.swap(pending_.front());
+      pending_.pop_front();
+    }
+
+    try
+    {
+      readBlock(block, *backend, cursor);
+    }
+    catch (std::exception &)
+    {
+      // what could not be read is left to the synchronous path of LogStream
+    }
+  }
+}
+
+void SamplePrefetcher::readBlock(std::vector<Request> &block, IOBackend &backend, SparseIndex::Cursor &cursor)
+{
+  const int64_t header_size = sizeof(pocolog_cpp::SampleHeaderData);
+
+  // reverse playback schedules the block backwards, reading it in file
+  // order turns it into forward sequential reads
+  std::sort(block.begin(), block.end());
+
+  // first and last request covered by each span
+  std::vector<std::pair<size_t, size_t> > ranges;
+  std::vector<ReadRequest> requests;
+
+  size_t first = 0;
+  while (first < block.size())
+  {
+    size_t last = first;
+    while (last + 1 < block.size() &&
+           block[last + 1].segment == block[first].segment &&
+           block[last + 1].pos - block[last].pos <= MAXIMUM_GAP &&
+           block[last + 1].pos - block[first].pos <= MAXIMUM_SPAN)
+      last++;
+
+    ReadRequest request;
+    request.fd = index_->fileDescriptor(block[first].segment);
+    request.offset = block[first].pos - header_size;
+    request.size = 0;
+    request.buffer = NULL;
+    request.result = 0;
+    requests.push_back(request);
+    ranges.push_back(std::make_pair(first, last));
+
+    first = last + 1;
+  }
+
+  // a span ends with the payload of its last sample, whose size is in its
+  // sample header: those headers are read first, in one batch
+  std::vector<pocolog_cpp::SampleHeaderData> last_headers(requests.size());
+  std::vector<ReadRequest> header_requests(requests);
+  for (size_t i = 0; i < requests.size(); i++)
+  {
+    header_requests[i].offset = block[ranges[i].second].pos - header_size;
+    header_requests[i].size = header_size;
+    header_requests[i].buffer = (uint8_t *)&last_headers[i];
+  }
+  backend.read(header_requests);
+
+  for (size_t i = 0; i < requests.size(); i++)
+  {
+    // without its header the last sample is left out, and read on its own
+    const int64_t payload_size = header_requests[i].result == header_size ? last_headers[i].data_size : 0;
+    requests[i].size = block[ranges[i].second].pos + payload_size - requests[i].offset;
+  }
+
+  std::vector<std::vector<uint8_t> > spans(requests.size());
+  for (size_t i = 0; i < requests.size(); i++)
+  {
+    pool_.acquire(spans[i], requests[i].size);
+    requests[i].buffer = spans[i].data();
+  }
+
+  backend.read(requests);
+
+  // samples running past the end of their span, read on their own
+  std::vector<size_t> missing;
+
+  for (size_t i = 0; i < requests.size(); i++)
+  {
+    const int64_t count = std::max((ssize_t)0, requests[i].result);
+    const uint8_t *span = spans[i].data();
+
+    for (size_t j = ranges[i].first; j <= ranges[i].second; j++)
+    {
+      int64_t offset = block[j].pos - header_size - requests[i].offset;
+      if (offset + header_size > count)
+      {
+        missing.push_back(block[j].index);
+        continue;
+      }
+
+      pocolog_cpp::SampleHeaderData header;
+      memcpy(&header, span + offset, header_size);
+
+      if (offset + header_size + header.data_size > count)
+      {
+        missing.push_back(block[j].index);
+        continue;
+      }
+
+      std::vector<uint8_t> payload;
+      pool_.acquire(payload, header.data_size);
+      memcpy(payload.data(), span + offset + header_size, header.data_size);
+      store(block[j].index, payload);
+    }
+
+    pool_.recycle(spans[i]);
+  }
+
+  if (missing.empty())
+    return;
+
+  std::vector<pocolog_cpp::SampleHeaderData> headers;
+  std::vector<std::vector<uint8_t> > payloads;
+  reader_->readSamples(*index_, cursor, missing, headers, payloads, backend, &pool_);
+
+  for (size_t i = 0; i < missing.size(); i++)
+    store(missing[i], payloads[i]);
+}
+
+void SamplePrefetcher::store(size_t sample_index, std::vector<uint8_t> &payload)
+{
+  if (!codec_.isNull())
+  {
+    std::vector<uint8_t> encoded;
+    pool_.acquire(encoded, payload.size() / codec_->ratio());
+    try
+    {
+      codec_->encode(payload, encoded);
+    }
+    catch (std::exception &)
+    {
+      // not cached, the sample is read again when fetched
+      pool_.recycle(encoded);
+      pool_.recycle(payload);
+      return;
+    }
+    payload.swap(encoded);
+    pool_.recycle(encoded);
+  }
+
+  std::vector<std::vector<uint8_t> > evicted;
+
+  // charged outside of the lock, the budget may call release(), and before
+  // the entry is visible to release(), the charge never runs below the cache
+  MemoryBudget::instance().charge(this, payload.size());
+
+  int64_t removed = 0;
+  {
+    QMutexLocker locker(&mutex_);
+
+    // payload gets the previous entry, if any
+    std::vector<uint8_t> &entry = cache_[sample_index];
+    removed += entry.size();
+    cached_bytes_ += payload.size();
+    cached_bytes_ -= entry.size();
+    entry.swap(payload);
+
+    while (cache_.size() > capacity_)
+    {
+      evicted.push_back(std::vector<uint8_t>());
+      size_t freed = evictFarthest(evicted.back());
+      cached_bytes_ -= freed;
+      removed += freed;
+    }
+  }
+
+  MemoryBudget::instance().charge(this, -removed);
+
+  pool_.recycle(payload);
+  for (std::vector<std::vector<uint8_t> >::iterator it = evicted.begin(); it != evicted.end(); it++)
+    pool_.recycle(*it);
+}
+
+size_t SamplePrefetcher::release(size_t bytes)
+{
+  QMutexLocker locker(&mutex_);
+
+  size_t released = 0;
+  std::vector<uint8_t> evicted;
+  while (released < bytes && !cache_.empty())
+    released += evictFarthest(evicted);
+
+  cached_bytes_ -= released;
+  return released;
+}
+
+size_t SamplePrefetcher::evictFarthest(std::vector<uint8_t> &evicted)
+{
+  size_t front = cache_.begin()->first;
+  size_t back = cache_.rbegin()->first;
+
+  std::map<size_t, std::vector<uint8_t> >::iterator it = cache_.begin();
+  if (cursor_ - std::min(cursor_, front) <= std::max(cursor_, back) - cursor_)
+    it = --cache_.end();
+
+  size_t freed = it->second.size();
+  evicted.swap(it->second);
+  cache_.erase(it);
+  return freed;
+}
+
+} // namespace rock_replay_cpp
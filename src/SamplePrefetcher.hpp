@@ -0,0 +1,169 @@
+#ifndef SamplePrefetcher_hpp
+#define SamplePrefetcher_hpp
+
+#include <deque>
+#include <map>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include <stdint.h>
+#include <QThread>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QWaitCondition>
+#include "MemoryBudget.hpp"
+#include "IOBackend.hpp"
+#include "StreamIndex.hpp"
+
+namespace rock_replay_cpp
+{
+
+class LogReader;
+
+/**
+ * Converts the payloads held by a SamplePrefetcher to a smaller form and
+ * back. Called from the prefetching thread and the thread fetching the
+ * samples at the same time.
+ */
+class PayloadCodec
+{
+public:
+  virtual ~PayloadCodec()
+  {
+  }
+
+  virtual void encode(const std::vector<uint8_t> &payload, std::vector<uint8_t> &encoded) const = 0;
+
+  virtual void decode(const std::vector<uint8_t> &encoded, std::vector<uint8_t> &payload) const = 0;
+
+  /** C++ type decodeSample() decodes to, NULL when the codec only has decode() */
+  virtual const std::type_info *sampleType() const
+  {
+    return NULL;
+  }
+
+  /** Decodes straight into a sample of sampleType(), skipping the marshalled payload */
+  virtual void decodeSample(const std::vector<uint8_t> &encoded, void *sample) const
+  {
+  }
+
+  /** Expected ratio between the size of a payload and its encoded form */
+  virtual size_t ratio() const = 0;
+};
+
+/**
+ * Reads raw sample payloads of one stream ahead of the playback cursor
+ * on a background thread.
+ *
+ * The direction and stride of the playback are inferred from the
+ * indices passed to fetch(), so reverse and strided playback are served
+ * from memory just like forward playback. Samples that are close to each
+ * other in the same file are coalesced into a single read, which keeps
+ * backward scrubbing sequential on the disk, and the reads of a block are
+ * submitted together through the IOBackend so sparse strides keep the
+ * device queue full.
+ *
+ * The cache is accounted by the MemoryBudget and is the first memory
+ * given back when the budget is exceeded. Given a PayloadCodec, which
+ * the prefetcher takes over, the payloads are kept encoded and the
+ * capacity in samples grows by its ratio.
+ */
+class SamplePrefetcher : public QThread, public MemoryConsumer
+{
+public:
+  SamplePrefetcher(LogReader *reader,
+                   const std::string &stream_name,
+                   size_t block_size = 64,
+                   size_t capacity = 256,
+                   PayloadCodec *codec = NULL);
+
+  ~SamplePrefetcher();
+
+  /**
+   * Moves the payload of a prefetched sample into buffer and schedules
+   * the next block in the direction of travel. Returns false when the
+   * sample is not in memory yet.
+   */
+  bool fetch(size_t sample_index, std::vector<uint8_t> &buffer);
+
+  /**
+   * As fetch(), but when the codec decodes to sample_type the sample is
+   * decoded straight into sample and decoded is set; buffer is then left
+   * empty.
+   */
+  bool fetch(size_t sample_index,
+             std::vector<uint8_t> &buffer,
+             void *sample,
+             const std::type_info &sample_type,
+             bool &decoded);
+
+  /** Gives a buffer returned by fetch() back for the next reads */
+  void recycle(std::vector<uint8_t> &buffer)
+  {
+    pool_.recycle(buffer);
+  }
+
+  void stop();
+
+  size_t release(size_t bytes);
+
+protected:
+  void run();
+
+private:
+  struct Request
+  {
+    size_t index;
+    size_t segment;
+    int64_t pos;
+
+    bool operator<(const Request &other) const
+    {
+      return segment < other.segment || (segment == other.segment && pos < other.pos);
+    }
+  };
+
+  void schedule();
+
+  void readBlock(std::vector<Request> &block, IOBackend &backend, SparseIndex::Cursor &cursor);
+
+  void store(size_t sample_index, std::vector<uint8_t> &payload);
+
+  size_t evictFarthest(std::vector<uint8_t> &evicted);
+
+  static const int64_t MAXIMUM_STRIDE = 64;
+  static const int64_t MAXIMUM_GAP = 4 * 1024 * 1024;
+  static const int64_t MAXIMUM_SPAN = 32 * 1024 * 1024;
+  static const size_t MAXIMUM_PENDING = 2;
+
+  LogReader *reader_;
+  std::string stream_name_;
+
+  // taken once on construction, read without locking
+  QSharedPointer<const StreamIndex> index_;
+
+  size_t block_size_;
+  size_t capacity_;
+
+  BufferPool pool_;
+  QScopedPointer<PayloadCodec> codec_;
+
+  QMutex mutex_;
+  QWaitCondition wait_condition_;
+  std::deque<std::vector<Request> > pending_;
+  std::map<size_t, std::vector<uint8_t> > cache_;
+  size_t cached_bytes_;
+  size_t cursor_;
+  bool stopped_;
+
+  // playback state, only touched by the thread calling fetch()
+  size_t last_index_;
+  int64_t stride_;
+  int64_t frontier_;
+  SparseIndex::Cursor schedule_cursor_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* SamplePrefetcher_hpp */
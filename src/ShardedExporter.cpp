@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <glob.h>
+#include <unistd.h>
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QScopedPointer>
+#include <QThread>
+#include <QThreadPool>
+#include "ShardedExporter.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+const size_t BATCH_SIZE = 256;
+
+std::string filenamePrefix(const std::string &filename)
+{
+  if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".log") == 0)
+    return filename.substr(0, filename.size() - 4);
+  return filename;
+}
+
+// prefix.N.log files, read by LogReader as one split log
+void removeSplitFiles(const std::string &prefix)
+{
+  const std::string pattern = prefix + ".*.log";
+  glob_t matches;
+  if (glob(pattern.c_str(), 0, NULL, &matches) == 0)
+  {
+    for (size_t i = 0; i < matches.gl_pathc; i++)
+    {
+      const std::string path = matches.gl_pathv[i];
+      const std::string number = path.substr(prefix.size() + 1, path.size() - prefix.size() - 5);
+      if (!number.empty() && number.find_first_not_of("0123456789") == std::string::npos)
+        remove(path.c_str());
+    }
+  }
+  globfree(&matches);
+}
+
+void writeString(std::ostream &os, const std::string &value)
+{
+  os << '"';
+  for (std::string::const_iterator it = value.begin(); it != value.end(); it++)
+  {
+    if (*it == '"' || *it == '\\')
+      os << '\\';
+    os << *it;
+  }
+  os << '"';
+}
+
+} // namespace
+
+class ShardedExporter::ShardWriter : public QRunnable
+{
+public:
+  ShardWriter(LogReader *reader,
+              const std::string &stream_name,
+              const std::string &prefix,
+              size_t first_index,
+              size_t final_index,
+              int64_t maximum_size,
+              bool cache,
+              QAtomicInt *written,
+              QAtomicInt *canceled)
+      : reader_(reader)
+      , stream_name_(stream_name)
+      , prefix_(prefix)
+      , first_index_(first_index)
+      , final_index_(final_index)
+      , maximum_size_(maximum_size)
+      , cache_(cache)
+      , written_(written)
+      , canceled_(canceled)
+  {
+    setAutoDelete(false);
+  }
+
+  void run()
+  {
+    try
+    {
+      write();
+    }
+    catch (std::exception &e)
+    {
+      error_ = e.what();
+      *canceled_ = 1;
+    }
+    close();
+  }
+
+  const std::vector<Part> &parts() const
+  {
+    return parts_;
+  }
+
+  const std::string &error() const
+  {
+    return error_;
+  }
+
+private:
+  void write()
+  {
+    QSharedPointer<const StreamIndex> held_index = reader_->streamIndex(stream_name_);
+    const StreamIndex &index = *held_index;
+    SparseIndex::Cursor cursor;
+    QScopedPointer<IOBackend> backend(IOBackend::create());
+    BufferPool pool("shard export " + prefix_, BATCH_SIZE);
+
+    std::vector<size_t> indices;
+    std::vector<pocolog_cpp::SampleHeaderData> headers;
+    std::vector<std::vector<uint8_t> > payloads;
+
+    // the input pages already cached are left to the playback
+    PageResidency residency;
+    if (!cache_)
+      reader_->snapshotPages(index, cursor, first_index_, final_index_, residency);
+
+    open(first_index_);
+
+    for (size_t batch_start = first_index_; batch_start < final_index_ && !*canceled_; batch_start += BATCH_SIZE)
+    {
+      size_t batch_end = std::min(final_index_, batch_start + BATCH_SIZE);
+
+      indices.clear();
+      for (size_t sampleNr = batch_start; sampleNr < batch_end; sampleNr++)
+        indices.push_back(sampleNr);
+
+      reader_->readSamples(index, cursor, indices, headers, payloads, *backend, &pool);
+
+      for (size_t i = 0; i < indices.size(); i++)
+      {
+        // rolls over once the cap is reached, never leaving a file empty
+        if (maximum_size_ > 0 && parts_.back().samples > 0 && (int64_t)os_.tellp() >= maximum_size_)
+        {
+          close();
+          open(indices[i]);
+        }
+
+        const pocolog_cpp::SampleHeaderData &header = headers[i];
+        base::Time realtime = base::Time::fromSeconds(header.realtime_tv_sec, header.realtime_tv_usec);
+        base::Time logical = base::Time::fromSeconds(header.timestamp_tv_sec, header.timestamp_tv_usec);
+
+        output_->writeSample(0, realtime, logical, (void *)payloads[i].data(), payloads[i].size());
+        pool.recycle(payloads[i]);
+
+        Part &part = parts_.back();
+        if (part.samples == 0)
+          part.first_time = logical.toMicroseconds();
+        part.last_time = logical.toMicroseconds();
+        part.samples++;
+      }
+
+      if (!os_.good())
+        throw std::runtime_error("Could not write " + parts_.back().filename);
+
+      if (!cache_)
+      {
+        reader_->dropPages(index, cursor, indices, residency);
+        os_.flush();
+        write_behind_.flush(os_.tellp());
+      }
+
+      written_->fetchAndAddOrdered(indices.size());
+    }
+  }
+
+  void open(size_t first_index)
+  {
+    Part part;
+    std::ostringstream filename;
+    filename << prefix_ << "." << parts_.size() << ".part";
+    part.filename = filename.str();
+    part.first_index = first_index;
+    part.samples = 0;
+    part.first_time = part.last_time = 0;
+    part.bytes = 0;
+    parts_.push_back(part);
+
+    os_.open(part.filename.c_str(), std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+    if (!os_.good())
+      throw std::runtime_error("Could not open " + part.filename);
+
+    output_.reset(new pocolog_cpp::Output(os_));
+    reader_->declareStream(*output_, stream_name_);
+
+    if (!cache_)
+      write_behind_.open(part.filename);
+  }
+
+  void close()
+  {
+    if (!os_.is_open())
+      return;
+
+    os_.flush();
+    parts_.back().bytes = os_.tellp();
+
+    output_.reset();
+    os_.close();
+    write_behind_.close();
+  }
+
+  LogReader *reader_;
+  std::string stream_name_;
+  std::string prefix_;
+  size_t first_index_;
+  size_t final_index_;
+  int64_t maximum_size_;
+  bool cache_;
+
+  QAtomicInt *written_;
+  QAtomicInt *canceled_;
+
+  std::ofstream os_;
+  QScopedPointer<pocolog_cpp::Output> output_;
+  WriteBehind write_behind_;
+
+  std::vector<Part> parts_;
+  std::string error_;
+};
+
+ShardedExporter::ShardedExporter(
+    LogReader *reader,
+    size_t shard_count,
+    Split split,
+    int64_t maximum_size)
+    : reader_(reader)
+    , shard_count_(shard_count ? shard_count : std::max(1, QThread::idealThreadCount()))
+    , split_(split)
+    , maximum_size_(maximum_size)
+{
+}
+
+std::string ShardedExporter::manifestFilename(const std::string &filename)
+{
+  return filenamePrefix(filename) + ".manifest.json";
+}
+
+std::vector<size_t> ShardedExporter::shardBoundaries(
+    const std::string &stream_name,
+    size_t start_index,
+    size_t final_index) const
+{
+  std::vector<size_t> boundaries(1, start_index);
+
+  if (split_ == SplitByTime && final_index - start_index > 1)
+  {
+    base::Time first = reader_->sampleTime(stream_name, start_index);
+    base::Time last = reader_->sampleTime(stream_name, final_index - 1);
+    int64_t span = (last - first).toMicroseconds();
+
+    for (size_t i = 1; i < shard_count_; i++)
+    {
+      base::Time time = first + base::Time::fromMicroseconds(span * i / shard_count_);
+      size_t index = std::min(final_index, std::max(boundaries.back(), reader_->sampleIndexAt(stream_name, time)));
+      boundaries.push_back(index);
+    }
+  }
+  else
+  {
+    for (size_t i = 1; i < shard_count_; i++)
+      boundaries.push_back(start_index + (final_index - start_index) * i / shard_count_);
+  }
+
+  boundaries.push_back(final_index);
+
+  // empty shards, e.g. more shards than samples, are left out
+  boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+  return boundaries;
+}
+
+std::vector<ShardedExporter::Part> ShardedExporter::exportStream(
+    const std::string &filename,
+    const std::string &stream_name,
+    int start_index,
+    int final_index,
+    export_stream_fcn_t fcn,
+    void *data,
+    bool cache)
+{
+  std::vector<Part> parts;
+  if (start_index >= final_index)
+    return parts;
+
+  const std::string prefix = filenamePrefix(filename);
+  std::vector<size_t> boundaries = shardBoundaries(stream_name, start_index, final_index);
+
+  QAtomicInt written(0);
+  QAtomicInt canceled(0);
+
+  std::vector<ShardWriter *> writers;
+  for (size_t i = 0; i + 1 < boundaries.size(); i++)
+  {
+    std::ostringstream shard_prefix;
+    shard_prefix << prefix << ".shard" << i;
+    writers.push_back(new ShardWriter(reader_, stream_name, shard_prefix.str(),
+                                      boundaries[i], boundaries[i + 1],
+                                      maximum_size_, cache, &written, &canceled));
+  }
+
+  // one thread per shard, the writers are bound by the disks, not the cores
+  QThreadPool pool;
+  pool.setMaxThreadCount(writers.size());
+  for (std::vector<ShardWriter *>::iterator it = writers.begin(); it != writers.end(); it++)
+    pool.start(*it);
+
+  while (!pool.waitForDone(PROGRESS_INTERVAL_MS))
+    if (fcn != NULL && !canceled && !fcn(start_index + (int)written - 1, data))
+      canceled = 1;
+
+  if (fcn != NULL && !canceled)
+    fcn(start_index + (int)written - 1, data);
+
+  std::string error;
+  for (std::vector<ShardWriter *>::iterator it = writers.begin(); it != writers.end(); it++)
+  {
+    if (error.empty())
+      error = (*it)->error();
+    parts.insert(parts.end(), (*it)->parts().begin(), (*it)->parts().end());
+    delete *it;
+  }
+
+  if (canceled)
+  {
+    for (std::vector<Part>::iterator it = parts.begin(); it != parts.end(); it++)
+      remove(it->filename.c_str());
+
+    if (!error.empty())
+      throw std::runtime_error(error);
+    return std::vector<Part>();
+  }
+
+  // the files of an earlier export in more parts would be read as part of
+  // this split, and its manifest would describe them
+  removeSplitFiles(prefix);
+  remove(manifestFilename(filename).c_str());
+
+  // numbered in order like the files of a split log
+  for (size_t i = 0; i < parts.size(); i++)
+  {
+    std::ostringstream final_name;
+    final_name << prefix << "." << i << ".log";
+    if (rename(parts[i].filename.c_str(), final_name.str().c_str()) != 0)
+    {
+      // the parts renamed so far would be read as a whole log, none is kept
+      const std::string part_name = parts[i].filename;
+      for (std::vector<Part>::iterator it = parts.begin(); it != parts.end(); it++)
+        remove(it->filename.c_str());
+      throw std::runtime_error("Could not rename " + part_name);
+    }
+    parts[i].filename = final_name.str();
+  }
+
+  writeManifest(filename, stream_name, parts);
+  return parts;
+}
+
+void ShardedExporter::writeManifest(
+    const std::string &filename,
+    const std::string &stream_name,
+    const std::vector<Part> &parts) const
+{
+  std::string manifest = manifestFilename(filename);
+  std::ofstream os(manifest.c_str());
+
+  os << "{\n  \"stream\": ";
+  writeString(os, stream_name);
+  os << ",\n  \"files\": [";
+  for (size_t i = 0; i < parts.size(); i++)
+  {
+    const Part &part = parts[i];
+    std::string basename = part.filename.substr(part.filename.rfind('/') + 1);
+
+    os << (i ? ",\n" : "\n") << "    {\"file\": ";
+    writeString(os, basename);
+    os << ", \"first_index\": " << part.first_index
+       << ", \"samples\": " << part.samples
+       << ", \"first_time_us\": " << part.first_time
+       << ", \"last_time_us\": " << part.last_time
+       << ", \"bytes\": " << part.bytes << "}";
+  }
+  os << "\n  ]\n}" << std::endl;
+
+  if (!os.good())
+    throw std::runtime_error("Could not write " + manifest);
+}
+
+} // namespace rock_replay_cpp
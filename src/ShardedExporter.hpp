@@ -0,0 +1,84 @@
+#ifndef ShardedExporter_hpp
+#define ShardedExporter_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "LogReader.hpp"
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Exports a stream interval as a split log written by several threads.
+ *
+ * The interval is cut in shards, by sample count or by time, and each
+ * shard is written by its own thread to its own files. With a size cap
+ * a shard rolls over to a new file once the cap is reached. The files
+ * are then numbered in order as the logger does (name.0.log,
+ * name.1.log, ...), so LogReader opens them back as one log, and a
+ * manifest (name.manifest.json) lists them with their sample ranges.
+ */
+class ShardedExporter
+{
+public:
+  enum Split
+  {
+    SplitByIndex,
+    SplitByTime
+  };
+
+  struct Part
+  {
+    std::string filename;
+    size_t first_index;
+    size_t samples;
+    int64_t first_time;
+    int64_t last_time;
+    int64_t bytes;
+  };
+
+  /** shard_count 0 uses one shard per core, maximum_size 0 does not cap the files */
+  ShardedExporter(LogReader *reader,
+                  size_t shard_count = 0,
+                  Split split = SplitByIndex,
+                  int64_t maximum_size = 0);
+
+  /**
+   * Writes [start_index, final_index) of stream_name next to filename
+   * and returns the files written, in order. fcn is called from the
+   * calling thread with the number of samples written so far.
+   */
+  std::vector<Part> exportStream(const std::string &filename,
+                                 const std::string &stream_name,
+                                 int start_index,
+                                 int final_index,
+                                 export_stream_fcn_t fcn = NULL,
+                                 void *data = NULL,
+                                 bool cache = true);
+
+  static std::string manifestFilename(const std::string &filename);
+
+private:
+  class ShardWriter;
+
+  std::vector<size_t> shardBoundaries(const std::string &stream_name,
+                                      size_t start_index,
+                                      size_t final_index) const;
+
+  void writeManifest(const std::string &filename,
+                     const std::string &stream_name,
+                     const std::vector<Part> &parts) const;
+
+  // interval at which the progress is reported while the shards are written
+  static const int PROGRESS_INTERVAL_MS = 100;
+
+  LogReader *reader_;
+  size_t shard_count_;
+  Split split_;
+  int64_t maximum_size_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* ShardedExporter_hpp */
@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <QScopedPointer>
+#include <QThread>
+#include <QtConcurrentMap>
+#include <typelib/value_ops.hh>
+#include "SonarRenderer.hpp"
+
+namespace rock_replay_cpp
+{
+
+struct SonarRenderer::Job
+{
+  const Typelib::Type *type;
+  const Frame *frame;
+  const Lookup *lookup;
+  QVector<QRgb> colors;
+  float gain;
+  Format format;
+  std::string prefix;
+};
+
+struct SonarRenderer::Ping
+{
+  const Job *job;
+  size_t index;
+  std::vector<uint8_t> payload;
+  QImage image;
+  bool rendered;
+};
+
+SonarRenderer::SonarRenderer(
+    LogReader *reader,
+    const std::string &stream_name,
+    int width,
+    float gain)
+    : reader_(reader)
+    , stream_name_(stream_name)
+    , width_(width)
+    , gain_(gain)
+{
+  frame_.width = 0;
+  frame_.height = 0;
+
+  if (!reader_->streamType(stream_name_))
+    throw std::runtime_error("Stream not found: " + stream_name_);
+}
+
+std::vector<QRgb> SonarRenderer::colorTable()
+{
+  // black outside of the fan, then dark blue to yellow
+  std::vector<QRgb> table(256);
+  table[0] = qRgb(0, 0, 0);
+  for (int i = 1; i < 256; i++)
+  {
+    double v = (i - 1) / 254.0;
+    table[i] = qRgb((int)(255 * std::min(1.0, 2 * v)),
+                    (int)(255 * std::max(0.0, 2 * v - 1)),
+                    (int)(64 + 128 * std::max(0.0, 0.5 - v)));
+  }
+  return table;
+}
+
+bool SonarRenderer::Lookup::matches(const base::samples::Sonar &sonar) const
+{
+  if (sonar.bin_count != bin_count || sonar.bearings.size() != bearings.size() ||
+      sonar.beam_width.getRad() != beam_width)
+    return false;
+
+  for (size_t i = 0; i < bearings.size(); i++)
+    if (sonar.bearings[i].getRad() != bearings[i])
+      return false;
+  return true;
+}
+
+void SonarRenderer::fitFrame(const base::samples::Sonar &sonar, int width, Frame &frame)
+{
+  if (sonar.bearings.empty() || sonar.bin_count == 0)
+    throw std::runtime_error("First ping has no beams or no bins");
+
+  double minimum = sonar.bearings.front().getRad();
+  double maximum = minimum;
+  for (size_t i = 0; i < sonar.bearings.size(); i++)
+  {
+    minimum = std::min(minimum, sonar.bearings[i].getRad());
+    maximum = std::max(maximum, sonar.bearings[i].getRad());
+  }
+  minimum -= sonar.beam_width.getRad() / 2;
+  maximum += sonar.beam_width.getRad() / 2;
+
+  // forward is up; positive bearings are to the left, as in Rock frames
+  std::vector<double> angles;
+  angles.push_back(minimum);
+  angles.push_back(maximum);
+  for (int i = -2; i <= 2; i++)
+    if (i * M_PI / 2 > minimum && i * M_PI / 2 < maximum)
+      angles.push_back(i * M_PI / 2);
+
+  double left = 0, right = 0, top = 0, bottom = 0;
+  for (size_t i = 0; i < angles.size(); i++)
+  {
+    left = std::min(left, -sin(angles[i]));
+    right = std::max(right, -sin(angles[i]));
+    top = std::max(top, cos(angles[i]));
+    bottom = std::min(bottom, cos(angles[i]));
+  }
+
+  frame.left = left;
+  frame.top = top;
+  frame.width = width;
+  frame.scale = width / std::max(right - left, 1e-6);
+  frame.height = std::max(1, (int)ceil((top - bottom) * frame.scale));
+}
+
+void SonarRenderer::buildLookup(const base::samples::Sonar &sonar, const Frame &frame, Lookup &lookup)
+{
+  lookup.bin_count = sonar.bin_count;
+  lookup.beam_width = sonar.beam_width.getRad();
+  lookup.bearings.clear();
+
+  std::vector<std::pair<double, int32_t> > beams;
+  for (size_t i = 0; i < sonar.bearings.size(); i++)
+  {
+    lookup.bearings.push_back(sonar.bearings[i].getRad());
+    beams.push_back(std::make_pair(sonar.bearings[i].getRad(), (int32_t)i));
+  }
+  std::sort(beams.begin(), beams.end());
+
+  double half_width = lookup.beam_width / 2;
+  if (half_width <= 0 && beams.size() > 1)
+    half_width = (beams.back().first - beams.front().first) / (beams.size() - 1) / 2;
+
+  lookup.cells.assign(frame.width * frame.height, -1);
+  if (beams.empty())
+    return;
+
+  for (int y = 0; y < frame.height; y++)
+  {
+    double uy = frame.top - (y + 0.5) / frame.scale;
+    for (int x = 0; x < frame.width; x++)
+    {
+      double ux = frame.left + (x + 0.5) / frame.scale;
+
+      int32_t bin = (int32_t)(sqrt(ux * ux + uy * uy) * sonar.bin_count);
+      if (bin >= (int32_t)sonar.bin_count)
+        continue;
+
+      double bearing = atan2(-ux, uy);
+      if (bearing < beams.front().first - half_width || bearing > beams.back().first + half_width)
+        continue;
+
+      std::vector<std::pair<double, int32_t> >::const_iterator it =
+          std::lower_bound(beams.begin(), beams.end(), std::make_pair(bearing, (int32_t)-1));
+      if (it == beams.end() || (it != beams.begin() && bearing - (it - 1)->first < it->first - bearing))
+        it--;
+
+      lookup.cells[y * frame.width + x] = it->second * sonar.bin_count + bin;
+    }
+  }
+}
+
+void SonarRenderer::renderPing(Ping &ping)
+{
+  const Job &job = *ping.job;
+  const Frame &frame = *job.frame;
+
+  ping.image = QImage(frame.width, frame.height, QImage::Format_Indexed8);
+  ping.image.setColorTable(job.colors);
+  ping.image.fill(0);
+
+  try
+  {
+    base::samples::Sonar sonar;
+    Typelib::Value value(&sonar, *job.type);
+    Typelib::load(value, ping.payload);
+
+    // pings with another geometry than the first one get their own table
+    Lookup own_lookup;
+    const Lookup *lookup = job.lookup;
+    if (!lookup->matches(sonar))
+    {
+      buildLookup(sonar, frame, own_lookup);
+      lookup = &own_lookup;
+    }
+
+    const size_t bin_total = sonar.bins.size();
+    const float scale = job.gain * 254;
+    for (int y = 0; y < frame.height; y++)
+    {
+      uchar *line = ping.image.scanLine(y);
+      const int32_t *cells = &lookup->cells[y * frame.width];
+      for (int x = 0; x < frame.width; x++)
+      {
+        int32_t cell = cells[x];
+        if (cell < 0 || (size_t)cell >= bin_total)
+          continue;
+
+        float level = sonar.bins[cell] * scale;
+        line[x] = 1 + (uchar)std::min(254.0f, std::max(0.0f, level));
+      }
+    }
+    ping.rendered = true;
+  }
+  catch (std::exception &)
+  {
+    // left blank, counted by render()
+  }
+
+  if (job.format == Png)
+  {
+    QString filename = QString("%1%2.png")
+                           .arg(QString::fromStdString(job.prefix))
+                           .arg((qulonglong)ping.index, 6, 10, QChar('0'));
+    ping.rendered = ping.image.save(filename, "PNG") && ping.rendered;
+
+    // only the raw output needs the frames afterwards
+    ping.image = QImage();
+  }
+}
+
+void SonarRenderer::render(
+    const std::string &output,
+    Format format,
+    int start_index,
+    int final_index,
+    export_stream_fcn_t fcn,
+    void *data)
+{
+  if (start_index >= final_index)
+    return;
+
+  Job job;
+  job.type = reader_->streamType(stream_name_);
+  job.frame = &frame_;
+  job.colors = QVector<QRgb>::fromStdVector(colorTable());
+  job.gain = gain_;
+  job.format = format;
+  job.prefix = output;
+  if (format == Png && output.size() > 4 && output.compare(output.size() - 4, 4, ".png") == 0)
+    job.prefix = output.substr(0, output.size() - 4);
+
+  QSharedPointer<const StreamIndex> held_index = reader_->streamIndex(stream_name_);
+  const StreamIndex &index = *held_index;
+  SparseIndex::Cursor cursor;
+  QScopedPointer<IOBackend> backend(IOBackend::create());
+  BufferPool pool("render " + stream_name_);
+
+  std::vector<size_t> indices;
+  std::vector<pocolog_cpp::SampleHeaderData> headers;
+  std::vector<std::vector<uint8_t> > payloads;
+
+  // the first ping sets the frame and the shared lookup table
+  Lookup lookup;
+  {
+    indices.push_back(start_index);
+    reader_->readSamples(index, cursor, indices, headers, payloads, *backend);
+
+    base::samples::Sonar sonar;
+    Typelib::Value value(&sonar, *job.type);
+    Typelib::load(value, payloads[0]);
+
+    fitFrame(sonar, width_, frame_);
+    buildLookup(sonar, frame_, lookup);
+  }
+  job.lookup = &lookup;
+
+  std::ofstream raw;
+  if (format == Raw)
+  {
+    raw.open(output.c_str(), std::ofstream::binary | std::ofstream::out);
+    if (!raw.good())
+      throw std::runtime_error("Could not open " + output);
+  }
+
+  const size_t wave_size = 4 * std::max(1, QThread::idealThreadCount());
+  size_t failed = 0;
+
+  for (int wave_start = start_index; wave_start < final_index; wave_start += wave_size)
+  {
+    int wave_end = std::min(final_index, wave_start + (int)wave_size);
+
+    indices.clear();
+    for (int sampleNr = wave_start; sampleNr < wave_end; sampleNr++)
+      indices.push_back(sampleNr);
+
+    reader_->readSamples(index, cursor, indices, headers, payloads, *backend, &pool);
+
+    std::vector<Ping> pings(indices.size());
+    for (size_t i = 0; i < pings.size(); i++)
+    {
+      pings[i].job = &job;
+      pings[i].index = indices[i];
+      pings[i].rendered = false;
+      pings[i].payload.swap(payloads[i]);
+    }
+
+    QtConcurrent::blockingMap(pings, renderPing);
+
+    for (size_t i = 0; i < pings.size(); i++)
+    {
+      if (!pings[i].rendered)
+        failed++;
+
+      if (format == Raw)
+        for (int y = 0; y < frame_.height; y++)
+          raw.write((const char *)pings[i].image.constScanLine(y), frame_.width);
+
+      pool.recycle(pings[i].payload);
+    }
+
+    if (format == Raw && !raw.good())
+      throw std::runtime_error("Could not write " + output);
+
+    if (fcn != NULL && !fcn(wave_end - 1, data))
+      break;
+  }
+
+  if (failed)
+    std::cout << failed << " pings could not be rendered" << std::endl;
+}
+
+} // namespace rock_replay_cpp
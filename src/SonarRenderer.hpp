@@ -0,0 +1,105 @@
+#ifndef SonarRenderer_hpp
+#define SonarRenderer_hpp
+
+#include <string>
+#include <vector>
+#include <QImage>
+#include <base/samples/Sonar.hpp>
+#include "LogReader.hpp"
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Renders the pings of a Sonar stream to images without a display.
+ *
+ * Pings are read in waves and each wave is decoded, rasterized and
+ * encoded on the thread pool. PNG output writes one file per ping named
+ * after its sample index; raw output appends 8-bit indexed frames of
+ * frameWidth() x frameHeight() to a single file, in sample order.
+ *
+ * The field of view of the first ping sets the frame geometry. Each
+ * pixel is mapped to its (beam, bin) cell once, so rasterizing a ping is
+ * a table lookup per pixel.
+ */
+class SonarRenderer
+{
+public:
+  enum Format
+  {
+    Png,
+    Raw
+  };
+
+  SonarRenderer(LogReader *reader,
+                const std::string &stream_name,
+                int width = 800,
+                float gain = 1.0);
+
+  /**
+   * Renders the samples [start_index, final_index). For Png, output is
+   * the prefix of the file names (a trailing .png is dropped).
+   */
+  void render(const std::string &output,
+              Format format,
+              int start_index,
+              int final_index,
+              export_stream_fcn_t fcn = NULL,
+              void *data = NULL);
+
+  int frameWidth() const
+  {
+    return frame_.width;
+  }
+
+  int frameHeight() const
+  {
+    return frame_.height;
+  }
+
+  /** Palette of the 8-bit frames, index 0 is outside of the fan */
+  static std::vector<QRgb> colorTable();
+
+private:
+  struct Frame
+  {
+    // area covered by the image, in ranges: 1 is the last bin
+    double left;
+    double top;
+    double scale;
+    int width;
+    int height;
+  };
+
+  struct Lookup
+  {
+    uint32_t bin_count;
+    std::vector<double> bearings;
+    double beam_width;
+
+    // index in Sonar::bins of every pixel, -1 outside of the fan
+    std::vector<int32_t> cells;
+
+    bool matches(const base::samples::Sonar &sonar) const;
+  };
+
+  struct Job;
+  struct Ping;
+
+  static void fitFrame(const base::samples::Sonar &sonar, int width, Frame &frame);
+
+  static void buildLookup(const base::samples::Sonar &sonar, const Frame &frame, Lookup &lookup);
+
+  static void renderPing(Ping &ping);
+
+  LogReader *reader_;
+  std::string stream_name_;
+  int width_;
+  float gain_;
+
+  Frame frame_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* SonarRenderer_hpp */
@@ -0,0 +1,260 @@
+#include <stdexcept>
+#include "BlockReader.hpp"
+#include "IndexCache.hpp"
+#include "SparseIndex.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+void writeVarint(std::vector<uint8_t> &bytes, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    bytes.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  bytes.push_back((uint8_t)value);
+}
+
+uint64_t readVarint(const uint8_t *&data)
+{
+  uint64_t value = 0;
+  for (int shift = 0;; shift += 7)
+  {
+    uint8_t byte = *data++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+}
+
+// logical times may go backwards, small deltas of either sign stay short
+uint64_t zigzag(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+int64_t sampleTime(const pocolog_cpp::SampleHeaderData &header)
+{
+  return (int64_t)header.timestamp_tv_sec * 1000000 + header.timestamp_tv_usec;
+}
+
+} // namespace
+
+SparseIndex::SparseIndex(size_t density)
+    : density_(density ? density : 1)
+    , stream_idx_(0)
+    , file_size_(0)
+    , samples_(0)
+    , checkpoints_(0)
+    , last_position_(0)
+    , last_time_(0)
+{
+}
+
+bool SparseIndex::build(int fd, int64_t file_size, const std::string &stream_name)
+{
+  file_size_ = file_size;
+
+  bool declared = false;
+  BlockReader blocks(fd, file_size);
+  while (blocks.next())
+  {
+    const pocolog_cpp::BlockHeader &header = blocks.header();
+
+    std::string name, type_name;
+    pocolog_cpp::SampleHeaderData sample;
+    if (!declared && blocks.streamDeclaration(name, type_name) && name == stream_name)
+    {
+      stream_idx_ = header.stream_idx;
+      declared = true;
+    }
+    else if (declared && header.type == pocolog_cpp::DataBlockType && header.stream_idx == stream_idx_ &&
+             blocks.sampleHeader(sample))
+    {
+      append(blocks.position(), sampleTime(sample));
+    }
+  }
+
+  // the capacity left by the growth is not kept
+  std::vector<Anchor>(anchors_).swap(anchors_);
+  std::vector<uint8_t>(deltas_).swap(deltas_);
+  return declared;
+}
+
+void SparseIndex::save(std::vector<uint8_t> &bytes) const
+{
+  IndexCache::writeValue(bytes, (uint64_t)density_);
+  IndexCache::writeValue(bytes, stream_idx_);
+  IndexCache::writeValue(bytes, file_size_);
+  IndexCache::writeValue(bytes, (uint64_t)samples_);
+  IndexCache::writeValue(bytes, (uint64_t)checkpoints_);
+  IndexCache::writeValue(bytes, last_position_);
+  IndexCache::writeValue(bytes, last_time_);
+
+  IndexCache::writeValue(bytes, (uint64_t)anchors_.size());
+  for (std::vector<Anchor>::const_iterator it = anchors_.begin(); it != anchors_.end(); it++)
+  {
+    IndexCache::writeValue(bytes, it->position);
+    IndexCache::writeValue(bytes, it->time);
+    IndexCache::writeValue(bytes, (uint64_t)it->offset);
+  }
+  IndexCache::writeVector(bytes, deltas_);
+}
+
+bool SparseIndex::load(const std::vector<uint8_t> &bytes, size_t &pos)
+{
+  uint64_t density, samples, checkpoints, anchor_count;
+  SparseIndex index;
+  if (!IndexCache::readValue(bytes, pos, density) || !IndexCache::readValue(bytes, pos, index.stream_idx_) ||
+      !IndexCache::readValue(bytes, pos, index.file_size_) || !IndexCache::readValue(bytes, pos, samples) ||
+      !IndexCache::readValue(bytes, pos, checkpoints) || !IndexCache::readValue(bytes, pos, index.last_position_) ||
+      !IndexCache::readValue(bytes, pos, index.last_time_) || !IndexCache::readValue(bytes, pos, anchor_count))
+    return false;
+
+  for (uint64_t i = 0; i < anchor_count; i++)
+  {
+    Anchor anchor;
+    uint64_t offset;
+    if (!IndexCache::readValue(bytes, pos, anchor.position) || !IndexCache::readValue(bytes, pos, anchor.time) ||
+        !IndexCache::readValue(bytes, pos, offset))
+      return false;
+    anchor.offset = offset;
+    index.anchors_.push_back(anchor);
+  }
+  if (!IndexCache::readVector(bytes, pos, index.deltas_))
+    return false;
+
+  // the checkpoints are decoded without checks, they must match the counts
+  index.density_ = density;
+  index.samples_ = samples;
+  index.checkpoints_ = checkpoints;
+  if (density == 0 || (samples + density - 1) / density != checkpoints ||
+      (checkpoints + ANCHOR_INTERVAL - 1) / ANCHOR_INTERVAL != anchor_count)
+    return false;
+  for (std::vector<Anchor>::const_iterator it = index.anchors_.begin(); it != index.anchors_.end(); it++)
+  {
+    if (it->offset > index.deltas_.size())
+      return false;
+  }
+
+  *this = index;
+  return true;
+}
+
+void SparseIndex::append(int64_t position, int64_t time)
+{
+  if (samples_++ % density_ != 0)
+    return;
+
+  if (checkpoints_ % ANCHOR_INTERVAL == 0)
+  {
+    Anchor anchor;
+    anchor.position = position;
+    anchor.time = time;
+    anchor.offset = deltas_.size();
+    anchors_.push_back(anchor);
+  }
+  else
+  {
+    writeVarint(deltas_, position - last_position_);
+    writeVarint(deltas_, zigzag(time - last_time_));
+  }
+
+  last_position_ = position;
+  last_time_ = time;
+  checkpoints_++;
+}
+
+size_t SparseIndex::memoryUsage() const
+{
+  return anchors_.capacity() * sizeof(Anchor) + deltas_.capacity();
+}
+
+void SparseIndex::checkpoint(size_t checkpoint, int64_t &position, int64_t &time) const
+{
+  const Anchor &anchor = anchors_[checkpoint / ANCHOR_INTERVAL];
+  position = anchor.position;
+  time = anchor.time;
+
+  const uint8_t *data = deltas_.data() + anchor.offset;
+  for (size_t i = checkpoint % ANCHOR_INTERVAL; i > 0; i--)
+  {
+    position += readVarint(data);
+    time += unzigzag(readVarint(data));
+  }
+}
+
+int64_t SparseIndex::locate(int fd, size_t sample_index, pocolog_cpp::SampleHeaderData &header, Cursor &cursor) const
+{
+  if (sample_index >= samples_)
+    throw std::runtime_error("Sample index out of range");
+
+  size_t index = sample_index - sample_index % density_;
+  int64_t position, time;
+  checkpoint(index / density_, position, time);
+
+  // going on from the last sample located avoids walking the same blocks again
+  if (cursor.index == this && cursor.sample_index >= index && cursor.sample_index <= sample_index)
+  {
+    index = cursor.sample_index;
+    position = cursor.position;
+  }
+
+  BlockReader blocks(fd, file_size_, position);
+  while (blocks.next())
+  {
+    const pocolog_cpp::BlockHeader &block = blocks.header();
+    if (block.type != pocolog_cpp::DataBlockType || block.stream_idx != stream_idx_)
+      continue;
+
+    if (index++ < sample_index)
+      continue;
+
+    if (!blocks.sampleHeader(header))
+      break;
+
+    cursor.index = this;
+    cursor.sample_index = sample_index;
+    cursor.position = blocks.position();
+    return blocks.payloadPosition();
+  }
+
+  throw std::runtime_error("Could not locate sample in the log file");
+}
+
+bool SparseIndex::bracket(int64_t time, size_t &first, size_t &last) const
+{
+  // first checkpoint at or after time
+  size_t low = 0, high = checkpoints_;
+  while (low < high)
+  {
+    size_t middle = low + (high - low) / 2;
+    int64_t position, checkpoint_time;
+    checkpoint(middle, position, checkpoint_time);
+    if (checkpoint_time < time)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  first = low > 0 ? (low - 1) * density_ + 1 : 0;
+  if (low < checkpoints_)
+  {
+    last = low * density_;
+    return true;
+  }
+
+  last = samples_;
+  return false;
+}
+
+} // namespace rock_replay_cpp
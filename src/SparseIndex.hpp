@@ -0,0 +1,107 @@
+#ifndef SparseIndex_hpp
+#define SparseIndex_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pocolog_cpp/Format.hpp>
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Index of one stream in one log file keeping only every density-th
+ * sample, as checkpoints of block position and logical time.
+ *
+ * Checkpoints are stored as varint deltas from the previous one, with an
+ * absolute anchor every ANCHOR_INTERVAL checkpoints so that decoding one
+ * never goes through more than ANCHOR_INTERVAL deltas. The position of
+ * any other sample is found by walking the block headers forward from
+ * the nearest checkpoint, which reads at most density samples of the
+ * stream and the blocks of other streams logged between them.
+ *
+ * Once built the index is not modified, the state of a walk is kept by
+ * the caller in a Cursor.
+ */
+class SparseIndex
+{
+public:
+  explicit SparseIndex(size_t density = DEFAULT_DENSITY);
+
+  /** Walks the blocks of the file, false if the file does not declare stream_name */
+  bool build(int fd, int64_t file_size, const std::string &stream_name);
+
+  /** Appends the checkpoints to bytes, read back by load */
+  void save(std::vector<uint8_t> &bytes) const;
+
+  /** Checkpoints saved at pos in bytes, false if they are not valid */
+  bool load(const std::vector<uint8_t> &bytes, size_t &pos);
+
+  size_t size() const
+  {
+    return samples_;
+  }
+
+  size_t density() const
+  {
+    return density_;
+  }
+
+  /** Bytes held by the checkpoints */
+  size_t memoryUsage() const;
+
+  /** Last sample located by a reader, consecutive lookups go on from it */
+  struct Cursor
+  {
+    const SparseIndex *index;
+    size_t sample_index;
+    int64_t position;
+
+    Cursor()
+        : index(NULL), sample_index(0), position(-1)
+    {
+    }
+  };
+
+  /** Payload position of sample_index in the file and its sample header */
+  int64_t locate(int fd, size_t sample_index, pocolog_cpp::SampleHeaderData &header, Cursor &cursor) const;
+
+  /**
+   * Narrows the search of the first sample logged at or after time (in
+   * microseconds) to [first, last]. Returns false when every checkpoint
+   * is before time, the sample is then in [first, size()] or after.
+   */
+  bool bracket(int64_t time, size_t &first, size_t &last) const;
+
+  static const size_t DEFAULT_DENSITY = 64;
+
+private:
+  struct Anchor
+  {
+    int64_t position;
+    int64_t time;
+    size_t offset;
+  };
+
+  void append(int64_t position, int64_t time);
+
+  /** Block position and logical time of a checkpoint */
+  void checkpoint(size_t checkpoint, int64_t &position, int64_t &time) const;
+
+  static const size_t ANCHOR_INTERVAL = 64;
+
+  size_t density_;
+  uint16_t stream_idx_;
+  int64_t file_size_;
+
+  size_t samples_;
+  size_t checkpoints_;
+  std::vector<Anchor> anchors_;
+  std::vector<uint8_t> deltas_;
+  int64_t last_position_;
+  int64_t last_time_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* SparseIndex_hpp */
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <stdexcept>
+#include "BlockReader.hpp"
+#include "IndexCache.hpp"
+#include "StreamIndex.hpp"
+
+namespace rock_replay_cpp
+{
+
+StreamIndex::StreamIndex()
+    : offsets_(1, 0)
+{
+}
+
+bool StreamIndex::addFile(int fd, int64_t file_size, const std::string &stream_name, size_t density)
+{
+  files_.push_back(File());
+  File &file = files_.back();
+  file.fd = fd;
+  file.sparse = density > 0;
+
+  bool declared;
+  if (file.sparse)
+  {
+    file.index = SparseIndex(density);
+    declared = file.index.build(fd, file_size, stream_name);
+    offsets_.push_back(offsets_.back() + file.index.size());
+    return declared;
+  }
+
+  declared = false;
+  uint16_t stream_idx = 0;
+  BlockReader blocks(fd, file_size);
+  while (blocks.next())
+  {
+    const pocolog_cpp::BlockHeader &header = blocks.header();
+
+    std::string name, type_name;
+    pocolog_cpp::SampleHeaderData sample;
+    if (!declared && blocks.streamDeclaration(name, type_name) && name == stream_name)
+    {
+      stream_idx = header.stream_idx;
+      declared = true;
+    }
+    else if (declared && header.type == pocolog_cpp::DataBlockType && header.stream_idx == stream_idx &&
+             blocks.sampleHeader(sample))
+    {
+      file.positions.push_back(blocks.payloadPosition());
+      file.times.push_back((int64_t)sample.timestamp_tv_sec * 1000000 + sample.timestamp_tv_usec);
+    }
+  }
+
+  // the capacity left by the growth is not kept
+  std::vector<int64_t>(file.positions).swap(file.positions);
+  std::vector<int64_t>(file.times).swap(file.times);
+
+  offsets_.push_back(offsets_.back() + file.positions.size());
+  return declared;
+}
+
+bool StreamIndex::loadFile(int fd, const std::vector<uint8_t> &bytes)
+{
+  File file;
+  file.fd = fd;
+
+  size_t pos = 0;
+  uint8_t sparse;
+  if (!IndexCache::readValue(bytes, pos, sparse))
+    return false;
+  file.sparse = sparse;
+  if (file.sparse)
+  {
+    if (!file.index.load(bytes, pos))
+      return false;
+  }
+  else if (!IndexCache::readVector(bytes, pos, file.positions) || !IndexCache::readVector(bytes, pos, file.times) ||
+           file.positions.size() != file.times.size())
+    return false;
+
+  files_.push_back(file);
+  offsets_.push_back(offsets_.back() + (file.sparse ? file.index.size() : file.positions.size()));
+  return true;
+}
+
+void StreamIndex::saveFile(size_t segment, std::vector<uint8_t> &bytes) const
+{
+  const File &file = files_[segment];
+  IndexCache::writeValue(bytes, (uint8_t)file.sparse);
+  if (file.sparse)
+    file.index.save(bytes);
+  else
+  {
+    IndexCache::writeVector(bytes, file.positions);
+    IndexCache::writeVector(bytes, file.times);
+  }
+}
+
+int64_t StreamIndex::locate(
+    size_t sample_index,
+    size_t &segment,
+    int64_t &time,
+    SparseIndex::Cursor &cursor) const
+{
+  if (sample_index >= size())
+    throw std::runtime_error("Sample index out of range");
+
+  segment = std::upper_bound(offsets_.begin(), offsets_.end(), sample_index) - offsets_.begin() - 1;
+  const size_t local_index = sample_index - offsets_[segment];
+  const File &file = files_[segment];
+
+  if (!file.sparse)
+  {
+    time = file.times[local_index];
+    return file.positions[local_index];
+  }
+
+  pocolog_cpp::SampleHeaderData header;
+  int64_t position = file.index.locate(file.fd, local_index, header, cursor);
+  time = (int64_t)header.timestamp_tv_sec * 1000000 + header.timestamp_tv_usec;
+  return position;
+}
+
+size_t StreamIndex::indexAt(int64_t time) const
+{
+  size_t first = 0;
+  size_t last = size();
+
+  // the checkpoints of sparse files narrow the search to one interval
+  for (size_t i = 0; i < files_.size(); i++)
+  {
+    if (!files_[i].sparse || files_[i].index.size() == 0)
+      continue;
+
+    size_t local_first, local_last;
+    bool found = files_[i].index.bracket(time, local_first, local_last);
+    if (local_last > 0)
+      first = offsets_[i] + local_first;
+    if (found)
+    {
+      last = offsets_[i] + local_last;
+      break;
+    }
+  }
+
+  SparseIndex::Cursor cursor;
+  while (first < last)
+  {
+    size_t middle = first + (last - first) / 2;
+    size_t segment;
+    int64_t middle_time;
+    locate(middle, segment, middle_time, cursor);
+
+    if (middle_time < time)
+      first = middle + 1;
+    else
+      last = middle;
+  }
+  return first;
+}
+
+size_t StreamIndex::memoryUsage() const
+{
+  size_t bytes = 0;
+  for (std::vector<File>::const_iterator it = files_.begin(); it != files_.end(); it++)
+    bytes += (it->positions.capacity() + it->times.capacity()) * sizeof(int64_t) + it->index.memoryUsage();
+  return bytes;
+}
+
+} // namespace rock_replay_cpp
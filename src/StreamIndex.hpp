@@ -0,0 +1,81 @@
+#ifndef StreamIndex_hpp
+#define StreamIndex_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "SparseIndex.hpp"
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Sample positions and logical times of one stream over all the files
+ * of a log, in full or as a SparseIndex per file. Files are indexed from
+ * their block headers, independently of the index of pocolog_cpp.
+ *
+ * The index is filled once by LogReader and never modified afterwards,
+ * so it is read by any number of threads without locking. Lookups only
+ * use pread on the descriptors of the files; the state of sparse walks
+ * is kept by the caller in a cursor.
+ */
+class StreamIndex
+{
+public:
+  StreamIndex();
+
+  /**
+   * Appends a file, indexed with one walk over its block headers: in full,
+   * or with one checkpoint every density samples when density is not 0.
+   * A file that does not declare the stream is appended without samples,
+   * false is then returned.
+   */
+  bool addFile(int fd, int64_t file_size, const std::string &stream_name, size_t density = 0);
+
+  /** Appends a file from the bytes saved by saveFile, false if they are not valid */
+  bool loadFile(int fd, const std::vector<uint8_t> &bytes);
+
+  /** Index of a file as bytes, kept in the IndexCache of the log */
+  void saveFile(size_t segment, std::vector<uint8_t> &bytes) const;
+
+  size_t size() const
+  {
+    return offsets_.back();
+  }
+
+  /** First global sample index of each file, and the total at the end */
+  const std::vector<size_t> &offsets() const
+  {
+    return offsets_;
+  }
+
+  /** Payload position of sample_index, the file holding it and its logical time in microseconds */
+  int64_t locate(size_t sample_index, size_t &segment, int64_t &time, SparseIndex::Cursor &cursor) const;
+
+  int fileDescriptor(size_t segment) const
+  {
+    return files_[segment].fd;
+  }
+
+  /** First sample logged at or after time, size() if none */
+  size_t indexAt(int64_t time) const;
+
+  size_t memoryUsage() const;
+
+private:
+  struct File
+  {
+    int fd;
+    bool sparse;
+    std::vector<int64_t> positions;
+    std::vector<int64_t> times;
+    SparseIndex index;
+  };
+
+  std::vector<size_t> offsets_;
+  std::vector<File> files_;
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* StreamIndex_hpp */
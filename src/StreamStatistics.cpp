@@ -0,0 +1,478 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QtConcurrentMap>
+#include "StreamStatistics.hpp"
+
+namespace rock_replay_cpp
+{
+
+namespace
+{
+
+// headers read per batch
+const size_t CHUNK_SIZE = 4096;
+
+/**
+ * Counts of values on a log-linear scale: values below SUB_BUCKETS are
+ * counted exactly, the others in SUB_BUCKETS buckets per power of two.
+ * A quantile is then off by less than 1/SUB_BUCKETS of its value, for a
+ * fixed 30 kB whatever the number of samples.
+ */
+class QuantileHistogram
+{
+public:
+  QuantileHistogram()
+      : counts_(BUCKETS, 0)
+      , total_(0)
+  {
+  }
+
+  void add(uint64_t value)
+  {
+    counts_[bucket(value)]++;
+    total_++;
+  }
+
+  uint64_t total() const
+  {
+    return total_;
+  }
+
+  /** Value of the given rank in ascending order, the middle of its bucket */
+  uint64_t atRank(uint64_t rank) const
+  {
+    size_t i = 0;
+    for (; i + 1 < counts_.size() && rank >= counts_[i]; i++)
+      rank -= counts_[i];
+
+    if (i < SUB_BUCKETS)
+      return i;
+    const int shift = (i - SUB_BUCKETS) / SUB_BUCKETS;
+    const uint64_t lower = (uint64_t)(SUB_BUCKETS + (i - SUB_BUCKETS) % SUB_BUCKETS) << shift;
+    return lower + ((1ULL << shift) >> 1);
+  }
+
+private:
+  static const int SUB_BITS = 6;
+  static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+  static const size_t BUCKETS = SUB_BUCKETS + (64 - SUB_BITS) * SUB_BUCKETS;
+
+  static size_t bucket(uint64_t value)
+  {
+    if (value < SUB_BUCKETS)
+      return value;
+    const int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return SUB_BUCKETS + shift * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t total_;
+};
+
+/** Signed values, the negative ones counted by magnitude */
+struct SignedHistogram
+{
+  QuantileHistogram negative;
+  QuantileHistogram positive;
+
+  void add(int64_t value)
+  {
+    if (value < 0)
+      negative.add(-(uint64_t)value);
+    else
+      positive.add(value);
+  }
+
+  int64_t percentile(double fraction) const
+  {
+    const uint64_t total = negative.total() + positive.total();
+    if (total == 0)
+      return 0;
+
+    // the most negative value comes first
+    const uint64_t rank = (uint64_t)(fraction * (total - 1));
+    if (rank < negative.total())
+      return -(int64_t)negative.atRank(negative.total() - 1 - rank);
+    return positive.atRank(rank - negative.total());
+  }
+};
+
+/** Progress of all the streams, reported one call at a time */
+struct Progress
+{
+  export_stream_fcn_t fcn;
+  void *data;
+  QMutex mutex;
+  std::vector<double> fractions;
+  QAtomicInt canceled;
+};
+
+struct Job
+{
+  LogReader *reader;
+  StreamStatistics *result;
+  Progress *progress;
+  size_t slot;
+  std::string error;
+};
+
+int histogramBin(int64_t interval)
+{
+  if (interval <= 0)
+    return 0;
+  return std::min(64 - __builtin_clzll(interval), StreamStatistics::HISTOGRAM_BINS - 1);
+}
+
+void reportProgress(Progress &progress, size_t slot, double fraction)
+{
+  if (!progress.fcn)
+    return;
+
+  QMutexLocker locker(&progress.mutex);
+  progress.fractions[slot] = fraction;
+
+  double sum = 0;
+  for (std::vector<double>::const_iterator it = progress.fractions.begin(); it != progress.fractions.end(); it++)
+    sum += *it;
+  if (!progress.fcn((int)(sum * StreamStatistics::PROGRESS_STEPS / progress.fractions.size()), progress.data))
+    progress.canceled = 1;
+}
+
+void computeStream(Job &job)
+{
+  StreamStatistics &s = *job.result;
+  LogReader *reader = job.reader;
+
+  QSharedPointer<const StreamIndex> held_index = reader->streamIndex(s.name);
+  const StreamIndex &index = *held_index;
+  SparseIndex::Cursor cursor;
+  const size_t total = index.size();
+  s.samples = total;
+  if (total == 0)
+    return;
+
+  // the mean interval is known from the index, so gaps are found in the same pass
+  size_t segment;
+  index.locate(0, segment, s.first_time, cursor);
+  index.locate(total - 1, segment, s.last_time, cursor);
+  const double expected_interval = total > 1 ? (double)(s.last_time - s.first_time) / (total - 1) : 0;
+  const int64_t gap_threshold = (int64_t)(StreamStatistics::GAP_FACTOR * expected_interval);
+
+  QScopedPointer<IOBackend> backend(IOBackend::create());
+
+  std::vector<size_t> indices;
+  std::vector<pocolog_cpp::SampleHeaderData> headers;
+
+  // times[0] is the last sample of the previous chunk
+  std::vector<int64_t> times(CHUNK_SIZE + 1);
+  std::vector<int64_t> intervals(CHUNK_SIZE);
+  std::vector<int64_t> latencies(CHUNK_SIZE);
+  std::vector<uint32_t> sizes(CHUNK_SIZE);
+  SignedHistogram latency_histogram;
+  QuantileHistogram size_histogram;
+
+  int64_t interval_sum = 0;
+  int64_t interval_min = std::numeric_limits<int64_t>::max();
+  int64_t interval_max = std::numeric_limits<int64_t>::min();
+  size_t out_of_order = 0;
+  double interval_square_sum = 0;
+
+  uint64_t size_sum = 0;
+  uint32_t size_min = std::numeric_limits<uint32_t>::max();
+  uint32_t size_max = 0;
+  double index_size_sum = 0;
+
+  int64_t latency_min = std::numeric_limits<int64_t>::max();
+  int64_t latency_max = std::numeric_limits<int64_t>::min();
+
+  for (size_t chunk_start = 0; chunk_start < total; chunk_start += CHUNK_SIZE)
+  {
+    if (job.progress->canceled)
+      throw std::runtime_error("canceled");
+
+    const size_t n = std::min(CHUNK_SIZE, total - chunk_start);
+
+    indices.resize(n);
+    for (size_t i = 0; i < n; i++)
+      indices[i] = chunk_start + i;
+    reader->readHeaders(index, cursor, indices, headers, *backend);
+
+    // the packed headers are split in plain arrays, the loops below are
+    // branch-free reductions over them
+    int64_t *latency = &latencies[0];
+    uint32_t *size = &sizes[0];
+    for (size_t i = 0; i < n; i++)
+    {
+      const pocolog_cpp::SampleHeaderData &header = headers[i];
+      int64_t logical = (int64_t)header.timestamp_tv_sec * 1000000 + header.timestamp_tv_usec;
+      int64_t realtime = (int64_t)header.realtime_tv_sec * 1000000 + header.realtime_tv_usec;
+      times[i + 1] = logical;
+      latency[i] = realtime - logical;
+      size[i] = header.data_size;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+      uint32_t value = size[i];
+      size_sum += value;
+      size_min = value < size_min ? value : size_min;
+      size_max = value > size_max ? value : size_max;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+      int64_t value = latency[i];
+      latency_min = value < latency_min ? value : latency_min;
+      latency_max = value > latency_max ? value : latency_max;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+      latency_histogram.add(latency[i]);
+      size_histogram.add(size[i]);
+    }
+
+    for (size_t i = 0; i < n; i++)
+      index_size_sum += (double)(chunk_start + i) * size[i];
+
+    // the first sample of the stream has no interval
+    const size_t first = chunk_start == 0 ? 1 : 0;
+    for (size_t i = first; i < n; i++)
+      intervals[i] = times[i + 1] - times[i];
+
+    for (size_t i = first; i < n; i++)
+    {
+      int64_t value = intervals[i];
+      interval_sum += value;
+      interval_min = value < interval_min ? value : interval_min;
+      interval_max = value > interval_max ? value : interval_max;
+      out_of_order += value < 0;
+    }
+
+    for (size_t i = first; i < n; i++)
+    {
+      double deviation = intervals[i] - expected_interval;
+      interval_square_sum += deviation * deviation;
+    }
+
+    for (size_t i = first; i < n; i++)
+    {
+      s.interval_histogram[histogramBin(intervals[i])]++;
+
+      if (gap_threshold > 0 && intervals[i] > gap_threshold)
+      {
+        if (s.gaps.size() < StreamStatistics::MAXIMUM_GAPS)
+        {
+          StreamStatistics::Gap gap;
+          gap.index = chunk_start + i;
+          gap.start = times[i];
+          gap.duration = intervals[i];
+          s.gaps.push_back(gap);
+        }
+        s.gap_count++;
+      }
+    }
+
+    times[0] = times[n];
+    reportProgress(*job.progress, job.slot, (double)(chunk_start + n) / total);
+  }
+
+  if (total > 1)
+  {
+    double duration = (s.last_time - s.first_time) / 1e6;
+    s.rate = duration > 0 ? (total - 1) / duration : 0;
+    s.interval_mean = (double)interval_sum / (total - 1);
+    s.interval_stddev = sqrt(std::max(0.0, interval_square_sum / (total - 1) -
+                                               pow(s.interval_mean - expected_interval, 2)));
+    s.interval_min = interval_min;
+    s.interval_max = interval_max;
+    s.out_of_order = out_of_order;
+  }
+
+  s.size_min = size_min;
+  s.size_max = size_max;
+  s.total_bytes = size_sum;
+  s.size_mean = (double)size_sum / total;
+
+  // slope of the least-squares line through (index, size)
+  double n = total;
+  double index_sum = n * (n - 1) / 2;
+  double index_square_sum = (n - 1) * n * (2 * n - 1) / 6;
+  double denominator = n * index_square_sum - index_sum * index_sum;
+  s.size_slope = denominator > 0 ? (n * index_size_sum - index_sum * size_sum) / denominator : 0;
+
+  // the exact extremes bound the bucket middles
+  s.latency_min = latency_min;
+  s.latency_max = latency_max;
+  s.latency_p50 = std::min(latency_max, std::max(latency_min, latency_histogram.percentile(0.5)));
+  s.latency_p90 = std::min(latency_max, std::max(latency_min, latency_histogram.percentile(0.9)));
+  s.latency_p99 = std::min(latency_max, std::max(latency_min, latency_histogram.percentile(0.99)));
+
+  const uint64_t size_total = size_histogram.total();
+  s.size_p50 = std::min((uint64_t)size_max, size_histogram.atRank((uint64_t)(0.5 * (size_total - 1))));
+  s.size_p99 = std::min((uint64_t)size_max, size_histogram.atRank((uint64_t)(0.99 * (size_total - 1))));
+}
+
+void runJob(Job &job)
+{
+  try
+  {
+    computeStream(job);
+  }
+  catch (std::exception &e)
+  {
+    job.error = e.what();
+  }
+}
+
+void writeString(std::ostream &os, const std::string &value)
+{
+  os << '"';
+  for (std::string::const_iterator it = value.begin(); it != value.end(); it++)
+  {
+    if (*it == '"' || *it == '\\')
+      os << '\\' << *it;
+    else if ((unsigned char)*it < 0x20)
+    {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*it);
+      os << escaped;
+    }
+    else
+      os << *it;
+  }
+  os << '"';
+}
+
+} // namespace
+
+std::vector<StreamStatistics> StreamStatistics::compute(
+    LogReader *reader,
+    const std::vector<std::string> &stream_names,
+    export_stream_fcn_t fcn,
+    void *data)
+{
+  std::vector<pocolog_cpp::StreamDescription> descriptions = reader->getDescriptions();
+
+  std::vector<StreamStatistics> statistics;
+  for (std::vector<pocolog_cpp::StreamDescription>::iterator it = descriptions.begin(); it != descriptions.end(); it++)
+  {
+    if (it->getType() != pocolog_cpp::DataStreamType)
+      continue;
+    if (!stream_names.empty() &&
+        std::find(stream_names.begin(), stream_names.end(), it->getName()) == stream_names.end())
+      continue;
+
+    StreamStatistics s;
+    s.name = it->getName();
+    s.type_name = it->getTypeName();
+    s.samples = 0;
+    s.first_time = s.last_time = 0;
+    s.rate = 0;
+    s.interval_mean = s.interval_stddev = 0;
+    s.interval_min = s.interval_max = 0;
+    s.out_of_order = 0;
+    s.interval_histogram.assign(HISTOGRAM_BINS, 0);
+    s.gap_count = 0;
+    s.latency_min = s.latency_p50 = s.latency_p90 = s.latency_p99 = s.latency_max = 0;
+    s.size_min = s.size_p50 = s.size_p99 = s.size_max = 0;
+    s.size_mean = 0;
+    s.total_bytes = 0;
+    s.size_slope = 0;
+    statistics.push_back(s);
+  }
+
+  for (std::vector<std::string>::const_iterator it = stream_names.begin(); it != stream_names.end(); it++)
+  {
+    bool found = false;
+    for (size_t i = 0; i < statistics.size() && !found; i++)
+      found = statistics[i].name == *it;
+    if (!found)
+      throw std::runtime_error("Stream not found: " + *it);
+  }
+
+  Progress progress;
+  progress.fcn = fcn;
+  progress.data = data;
+  progress.fractions.assign(statistics.size(), 0);
+  progress.canceled = 0;
+
+  std::vector<Job> jobs(statistics.size());
+  for (size_t i = 0; i < jobs.size(); i++)
+  {
+    jobs[i].reader = reader;
+    jobs[i].result = &statistics[i];
+    jobs[i].progress = &progress;
+    jobs[i].slot = i;
+  }
+
+  QtConcurrent::blockingMap(jobs, runJob);
+
+  if (progress.canceled)
+    throw std::runtime_error("Statistics canceled");
+
+  for (size_t i = 0; i < jobs.size(); i++)
+    if (!jobs[i].error.empty())
+      throw std::runtime_error(statistics[i].name + ": " + jobs[i].error);
+
+  return statistics;
+}
+
+void StreamStatistics::writeJson(std::ostream &os, const std::vector<StreamStatistics> &statistics)
+{
+  os << "{\n  \"streams\": [";
+  for (size_t i = 0; i < statistics.size(); i++)
+  {
+    const StreamStatistics &s = statistics[i];
+
+    os << (i ? ",\n" : "\n") << "    {\n";
+    os << "      \"name\": ";
+    writeString(os, s.name);
+    os << ",\n      \"type\": ";
+    writeString(os, s.type_name);
+    os << ",\n      \"samples\": " << s.samples
+       << ",\n      \"first_time_us\": " << s.first_time
+       << ",\n      \"last_time_us\": " << s.last_time
+       << ",\n      \"rate_hz\": " << s.rate
+       << ",\n      \"interval_us\": {\"mean\": " << s.interval_mean
+       << ", \"stddev\": " << s.interval_stddev
+       << ", \"min\": " << s.interval_min
+       << ", \"max\": " << s.interval_max
+       << ", \"out_of_order\": " << s.out_of_order << "}";
+
+    os << ",\n      \"interval_histogram_log2_us\": [";
+    for (size_t j = 0; j < s.interval_histogram.size(); j++)
+      os << (j ? ", " : "") << s.interval_histogram[j];
+    os << "]";
+
+    os << ",\n      \"gap_count\": " << s.gap_count << ",\n      \"gaps\": [";
+    for (size_t j = 0; j < s.gaps.size(); j++)
+      os << (j ? ", " : "") << "{\"index\": " << s.gaps[j].index
+         << ", \"start_us\": " << s.gaps[j].start
+         << ", \"duration_us\": " << s.gaps[j].duration << "}";
+    os << "]";
+
+    os << ",\n      \"latency_us\": {\"min\": " << s.latency_min
+       << ", \"p50\": " << s.latency_p50
+       << ", \"p90\": " << s.latency_p90
+       << ", \"p99\": " << s.latency_p99
+       << ", \"max\": " << s.latency_max << "}"
+       << ",\n      \"size_bytes\": {\"min\": " << s.size_min
+       << ", \"p50\": " << s.size_p50
+       << ", \"p99\": " << s.size_p99
+       << ", \"max\": " << s.size_max
+       << ", \"mean\": " << s.size_mean
+       << ", \"total\": " << s.total_bytes
+       << ", \"slope_per_sample\": " << s.size_slope << "}"
+       << "\n    }";
+  }
+  os << "\n  ]\n}" << std::endl;
+}
+
+} // namespace rock_replay_cpp
@@ -0,0 +1,90 @@
+#ifndef StreamStatistics_hpp
+#define StreamStatistics_hpp
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "LogReader.hpp"
+
+namespace rock_replay_cpp
+{
+
+/**
+ * Timing and size statistics of one stream, computed from the sample
+ * headers only. Times are in microseconds.
+ */
+struct StreamStatistics
+{
+  struct Gap
+  {
+    size_t index;
+    int64_t start;
+    int64_t duration;
+  };
+
+  std::string name;
+  std::string type_name;
+  size_t samples;
+
+  int64_t first_time;
+  int64_t last_time;
+  double rate;
+
+  // intervals between consecutive logical timestamps
+  double interval_mean;
+  double interval_stddev;
+  int64_t interval_min;
+  int64_t interval_max;
+  size_t out_of_order;
+
+  // intervals counted per power of two: bin i holds [2^(i-1), 2^i) us, bin 0 holds <= 0
+  std::vector<uint64_t> interval_histogram;
+
+  // intervals longer than GAP_FACTOR times the mean interval
+  size_t gap_count;
+  std::vector<Gap> gaps;
+
+  // realtime - logical timestamp; the percentiles of latency and size are
+  // read from log-linear histograms, within 1/64 of their value
+  int64_t latency_min;
+  int64_t latency_p50;
+  int64_t latency_p90;
+  int64_t latency_p99;
+  int64_t latency_max;
+
+  uint32_t size_min;
+  uint32_t size_p50;
+  uint32_t size_p99;
+  uint32_t size_max;
+  double size_mean;
+  uint64_t total_bytes;
+
+  // least-squares growth of the payload size, in bytes per sample
+  double size_slope;
+
+  static const int HISTOGRAM_BINS = 40;
+  static const int GAP_FACTOR = 3;
+  static const size_t MAXIMUM_GAPS = 1000;
+  static const int PROGRESS_STEPS = 1000;
+
+  /**
+   * Computes the statistics of the given streams, all data streams when
+   * empty. Streams are processed in parallel, each in one pass over its
+   * headers.
+   *
+   * fcn, when given, gets the progress out of PROGRESS_STEPS from the
+   * computing threads, one call at a time; returning false cancels the
+   * computation, which then throws.
+   */
+  static std::vector<StreamStatistics> compute(LogReader *reader,
+                                               const std::vector<std::string> &stream_names,
+                                               export_stream_fcn_t fcn = NULL,
+                                               void *data = NULL);
+
+  static void writeJson(std::ostream &os, const std::vector<StreamStatistics> &statistics);
+};
+
+} // namespace rock_replay_cpp
+
+#endif /* StreamStatistics_hpp */
@@ -0,0 +1,143 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <QApplication>
+#include <QDir>
+#include <unistd.h>
+#include "PlaybackBenchmark.hpp"
+
+using namespace rock_replay_cpp;
+
+namespace
+{
+
+void usage(const char *program)
+{
+  std::cerr << "Usage: " << program << " [--log <log> <stream>] [--pings <n>] [--beams <n>] [--bins <n>]\n"
+            << "         [--frames <n>] [--rates <fps>,...] [--views <view>,...] [<output.json>]\n"
+            << "Plays a sonar stream in the viewers, as fast as possible for rate 0 and at the\n"
+            << "other rates, and writes the frame rates and latencies as JSON. Without --log a\n"
+            << "synthetic log is generated. Qt 4 has no offscreen platform: on a machine\n"
+            << "without display, run it under xvfb-run." << std::endl;
+}
+
+std::vector<std::string> split(const std::string &list)
+{
+  std::vector<std::string> items;
+  size_t start = 0;
+  for (;;)
+  {
+    size_t end = list.find(',', start);
+    items.push_back(list.substr(start, end - start));
+    if (end == std::string::npos)
+      return items;
+    start = end + 1;
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  std::string log_filename, stream_name = "sonar", output;
+  size_t pings = 500, beam_count = 128, bin_count = 400;
+  size_t frames = (size_t)-1;
+  std::vector<std::string> rates = split("0,10,30,60");
+  std::vector<std::string> views = split("default,waterfall");
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--log" && i + 2 < argc)
+    {
+      log_filename = argv[++i];
+      stream_name = argv[++i];
+    }
+    else if (arg == "--pings" && i + 1 < argc)
+      pings = atol(argv[++i]);
+    else if (arg == "--beams" && i + 1 < argc)
+      beam_count = atol(argv[++i]);
+    else if (arg == "--bins" && i + 1 < argc)
+      bin_count = atol(argv[++i]);
+    else if (arg == "--frames" && i + 1 < argc)
+      frames = atol(argv[++i]);
+    else if (arg == "--rates" && i + 1 < argc)
+      rates = split(argv[++i]);
+    else if (arg == "--views" && i + 1 < argc)
+      views = split(argv[++i]);
+    else if (arg[0] != '-' && output.empty())
+      output = arg;
+    else
+    {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  QApplication app(argc, argv);
+
+  // the generated log and the index files of pocolog live in a directory of their own
+  QDir directory(QDir::temp().filePath(QString("rock-replay-cpp-benchmark-%1").arg(getpid())));
+  const bool generated = log_filename.empty();
+  std::string log_name = log_filename;
+
+  std::vector<PlaybackBenchmark> results;
+  int status = 0;
+  try
+  {
+    if (generated)
+    {
+      directory.mkpath(".");
+      log_filename = directory.filePath("sonar.log").toStdString();
+      log_name = QString("synthetic %1 pings x %2 beams x %3 bins").arg(pings).arg(beam_count).arg(bin_count).toStdString();
+      PlaybackBenchmark::generateSonarLog(log_filename, stream_name, pings, beam_count, bin_count);
+    }
+
+    for (std::vector<std::string>::iterator view = views.begin(); view != views.end(); view++)
+    {
+      QString variant = *view == "default" ? QString() : QString::fromStdString(*view);
+      for (std::vector<std::string>::iterator rate = rates.begin(); rate != rates.end(); rate++)
+      {
+        results.push_back(PlaybackBenchmark::run(QString::fromStdString(log_filename),
+                                                 QString::fromStdString(stream_name),
+                                                 variant, atof(rate->c_str()), frames));
+        std::cerr << results.back().viewer << " at " << *rate << " fps: " << results.back().rate
+                  << " fps achieved" << std::endl;
+      }
+    }
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not benchmark " << stream_name << " from " << log_name << ": " << e.what() << std::endl;
+    status = -1;
+  }
+
+  if (generated)
+  {
+    QStringList files = directory.entryList(QDir::Files);
+    for (QStringList::iterator it = files.begin(); it != files.end(); it++)
+      directory.remove(*it);
+    directory.rmdir(directory.absolutePath());
+  }
+
+  if (status)
+    return status;
+
+  if (output.empty())
+  {
+    PlaybackBenchmark::writeJson(std::cout, log_name, stream_name, results);
+    return 0;
+  }
+
+  std::ofstream os(output.c_str());
+  PlaybackBenchmark::writeJson(os, log_name, stream_name, results);
+  if (!os.good())
+  {
+    std::cerr << "Could not write " << output << std::endl;
+    return -1;
+  }
+  std::cerr << "Saved " << output << std::endl;
+  return 0;
+}
@@ -1,13 +1,626 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <limits>
 #include <QApplication>
 #include <base/samples/Sonar.hpp>
 #include "QLogViewer.hpp"
+#include "ArrowExporter.hpp"
+#include "CompactSonar.hpp"
+#include "LogCatalog.hpp"
+#include "RecoveryIndexer.hpp"
+#include "MemoryBudget.hpp"
+#include "ReplayPublisher.hpp"
+#include "Resampler.hpp"
+#include "SampleHash.hpp"
+#include "ShardedExporter.hpp"
+#include "SonarRenderer.hpp"
+#include "StreamStatistics.hpp"
 
 using namespace pocolog_cpp;
 using namespace rock_replay_cpp;
 
+static int recoverLog(const std::string &filename, std::string output_filename)
+{
+  if (output_filename.empty())
+  {
+    size_t found = filename.rfind(".log");
+    output_filename = filename.substr(0, found) + "-repaired.log";
+  }
+
+  try
+  {
+    RecoveryIndexer indexer(filename);
+    indexer.scan();
+    indexer.report(std::cout);
+
+    indexer.writeRepaired(output_filename);
+    std::cout << "Saved repaired log: " << output_filename << std::endl;
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not recover " << filename << ": " << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+static ReplayPublisher *publisher = NULL;
+
+static void stopPublisher(int)
+{
+  if (publisher)
+    publisher->stop();
+}
+
+static int publishLog(int argc, char **argv)
+{
+  std::string filename = argv[0];
+  std::string shm_name = argv[1];
+  double speed = 1.0;
+  size_t capacity = ReplayPublisher::DEFAULT_CAPACITY;
+  std::vector<std::string> streams;
+
+  for (int i = 2; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--speed" && i + 1 < argc)
+      speed = atof(argv[++i]);
+    else if (arg == "--capacity" && i + 1 < argc)
+      capacity = (size_t)atol(argv[++i]) * 1024 * 1024;
+    else
+      streams.push_back(arg);
+  }
+
+  try
+  {
+    LogReader reader(filename);
+    ReplayPublisher replay(&reader, streams, shm_name, capacity, speed);
+
+    publisher = &replay;
+    signal(SIGINT, stopPublisher);
+    signal(SIGTERM, stopPublisher);
+
+    std::cout << "Publishing " << filename << " on " << shm_name << std::endl;
+    try
+    {
+      replay.run();
+    }
+    catch (std::exception &)
+    {
+      // the handlers must not reach the publisher once it is destroyed
+      publisher = NULL;
+      throw;
+    }
+    replay.report(std::cout);
+
+    publisher = NULL;
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not publish " << filename << ": " << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+static bool renderProgress(int index, void *data)
+{
+  int *final_index = (int *)data;
+  std::cout << "\rRendered " << index + 1 << " of " << *final_index << std::flush;
+  return true;
+}
+
+static int renderLog(int argc, char **argv)
+{
+  std::string filename = argv[0];
+  std::string stream_name = argv[1];
+  std::string output = argv[2];
+
+  int start_index = 0, final_index = -1;
+  double from = -1, to = -1;
+  int width = 800;
+  float gain = 1.0;
+
+  for (int i = 3; i + 1 < argc; i += 2)
+  {
+    std::string arg = argv[i];
+    if (arg == "--start")
+      start_index = atoi(argv[i + 1]);
+    else if (arg == "--end")
+      final_index = atoi(argv[i + 1]);
+    else if (arg == "--from")
+      from = atof(argv[i + 1]);
+    else if (arg == "--to")
+      to = atof(argv[i + 1]);
+    else if (arg == "--width")
+      width = atoi(argv[i + 1]);
+    else if (arg == "--gain")
+      gain = atof(argv[i + 1]);
+  }
+
+  try
+  {
+    LogReader reader(filename);
+    SonarRenderer renderer(&reader, stream_name, width, gain);
+
+    int total = reader.totalSamples(stream_name);
+    if (final_index < 0 || final_index > total)
+      final_index = total;
+
+    // --from and --to are seconds from the first sample of the stream
+    if (total > 0 && (from >= 0 || to >= 0))
+    {
+      base::Time first = reader.sampleTime(stream_name, 0);
+      if (from >= 0)
+        start_index = reader.sampleIndexAt(stream_name, first + base::Time::fromSeconds(from));
+      if (to >= 0)
+        final_index = reader.sampleIndexAt(stream_name, first + base::Time::fromSeconds(to));
+    }
+
+    bool raw = output.size() > 4 && output.compare(output.size() - 4, 4, ".raw") == 0;
+    renderer.render(output, raw ? SonarRenderer::Raw : SonarRenderer::Png,
+                    start_index, final_index, renderProgress, &final_index);
+    std::cout << std::endl;
+
+    if (raw)
+      std::cout << "Frames: " << renderer.frameWidth() << "x" << renderer.frameHeight()
+                << " 8-bit indexed" << std::endl;
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not render " << filename << ": " << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+static bool exportProgress(int index, void *data)
+{
+  int *final_index = (int *)data;
+  std::cout << "\rExported " << index + 1 << " of " << *final_index << std::flush;
+  return true;
+}
+
+static int exportLog(int argc, char **argv)
+{
+  std::string filename = argv[0];
+  std::string stream_name = argv[1];
+  std::string output = argv[2];
+
+  int start_index = 0, final_index = -1;
+  size_t shards = 1;
+  int64_t maximum_size = 0;
+  ShardedExporter::Split split = ShardedExporter::SplitByIndex;
+  bool cache = true;
+
+  for (int i = 3; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--start" && i + 1 < argc)
+      start_index = atoi(argv[++i]);
+    else if (arg == "--end" && i + 1 < argc)
+      final_index = atoi(argv[++i]);
+    else if (arg == "--shards" && i + 1 < argc)
+      shards = atol(argv[++i]);
+    else if (arg == "--max-size" && i + 1 < argc)
+      maximum_size = (int64_t)atol(argv[++i]) * 1024 * 1024;
+    else if (arg == "--by-time")
+      split = ShardedExporter::SplitByTime;
+    else if (arg == "--no-cache")
+      cache = false;
+  }
+
+  try
+  {
+    LogReader reader(filename);
+    int total = reader.totalSamples(stream_name);
+    if (final_index < 0 || final_index > total)
+      final_index = total;
+
+    bool arrow = (output.size() > 6 && output.compare(output.size() - 6, 6, ".arrow") == 0) ||
+                 (output.size() > 8 && output.compare(output.size() - 8, 8, ".feather") == 0);
+    if (arrow)
+    {
+      ArrowExporter exporter(&reader);
+      exporter.exportStream(output, stream_name, start_index, final_index, exportProgress, &final_index, cache);
+      std::cout << std::endl << "Saved " << output << std::endl;
+    }
+    else if (shards != 1 || maximum_size > 0)
+    {
+      // --shards 0 writes one shard per core
+      ShardedExporter exporter(&reader, shards, split, maximum_size);
+      std::vector<ShardedExporter::Part> parts = exporter.exportStream(
+          output, stream_name, start_index, final_index, exportProgress, &final_index, cache);
+      std::cout << std::endl;
+      for (size_t i = 0; i < parts.size(); i++)
+        std::cout << "Saved " << parts[i].samples << " samples: " << parts[i].filename << std::endl;
+      std::cout << "Manifest: " << ShardedExporter::manifestFilename(output) << std::endl;
+    }
+    else
+    {
+      reader.exportStream(output, stream_name, start_index, final_index, exportProgress, &final_index, cache);
+      std::cout << std::endl << "Saved " << output << std::endl;
+    }
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not export " << filename << ": " << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+static int printStatistics(int argc, char **argv)
+{
+  std::vector<std::string> streams(argv + 1, argv + argc);
+
+  try
+  {
+    LogReader reader(argv[0]);
+    StreamStatistics::writeJson(std::cout, StreamStatistics::compute(&reader, streams));
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not compute statistics of " << argv[0] << ": " << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+static int hashLogs(int argc, char **argv)
+{
+  for (int i = 0; i < argc; i++)
+  {
+    try
+    {
+      LogReader reader(argv[i]);
+      SampleHash hasher(&reader);
+      SampleHash::hash_map_t hashes = hasher.hashLog();
+
+      // equal digests of two logs mean the streams hold the same samples
+      for (SampleHash::hash_map_t::iterator it = hashes.begin(); it != hashes.end(); it++)
+        std::cout << std::hex << SampleHash::streamDigest(it->second) << std::dec
+                  << " " << it->second.size() << " " << argv[i] << ":" << it->first << std::endl;
+    }
+    catch (std::exception &e)
+    {
+      std::cerr << "Could not hash " << argv[i] << ": " << e.what() << std::endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void printMismatch(const std::string &stream_name, const SampleHash::Mismatch &mismatch)
+{
+  std::cout << stream_name << " sample " << mismatch.index << ": " << mismatch.reason << std::endl;
+}
+
+static int verifyLog(int argc, char **argv)
+{
+  std::string filename = argv[0];
+  size_t mismatch_count = 0;
+
+  try
+  {
+    LogReader exported(filename);
+
+    if (argc == 1)
+    {
+      std::vector<std::pair<std::string, SampleHash::Mismatch> > mismatches;
+      SampleHash hasher(&exported);
+      if (!hasher.verifyLog(mismatches))
+      {
+        std::cerr << "No hashes found, run --hash on " << filename << " first." << std::endl;
+        return -1;
+      }
+
+      for (size_t i = 0; i < mismatches.size(); i++)
+        printMismatch(mismatches[i].first, mismatches[i].second);
+      mismatch_count = mismatches.size();
+    }
+    else
+    {
+      LogReader source(argv[1]);
+      SampleHash hasher(&source);
+
+      std::vector<StreamDescription> descriptions = exported.getDescriptions();
+      for (std::vector<StreamDescription>::iterator it = descriptions.begin(); it != descriptions.end(); it++)
+      {
+        if (it->getType() != DataStreamType)
+          continue;
+
+        const std::string &name = it->getName();
+        if (!source.streamType(name))
+        {
+          std::cout << name << ": not in " << argv[1] << std::endl;
+          mismatch_count++;
+          continue;
+        }
+        if (exported.totalSamples(name) == 0)
+          continue;
+
+        // exports of a time range start at the first sample at or after their first time
+        size_t start_index = argc > 2 ? (size_t)atol(argv[2])
+                                      : source.sampleIndexAt(name, exported.sampleTime(name, 0));
+
+        std::vector<SampleHash::Mismatch> mismatches = hasher.verify(&exported, name, start_index);
+        for (size_t i = 0; i < mismatches.size(); i++)
+          printMismatch(name, mismatches[i]);
+        mismatch_count += mismatches.size();
+      }
+    }
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not verify " << filename << ": " << e.what() << std::endl;
+    return -1;
+  }
+
+  if (mismatch_count)
+  {
+    std::cout << mismatch_count << " mismatches" << std::endl;
+    return 1;
+  }
+  std::cout << filename << ": OK" << std::endl;
+  return 0;
+}
+
+// UTC date and time (2024-05-01T12:00:00, 2024-05-01) or seconds since the epoch
+static bool parseTime(const char *text, int64_t &time)
+{
+  const char *formats[] = {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d"};
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+  {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(text, formats[i], &tm);
+    if (end && *end == '\0')
+    {
+      time = (int64_t)timegm(&tm) * 1000000;
+      return true;
+    }
+  }
+
+  char *end;
+  double seconds = strtod(text, &end);
+  if (end == text || *end != '\0')
+    return false;
+  time = (int64_t)(seconds * 1e6);
+  return true;
+}
+
+static int catalogLogs(int argc, char **argv, char *program)
+{
+  std::string root = argv[0];
+  std::string pattern;
+  std::string export_directory;
+  int64_t from = std::numeric_limits<int64_t>::min();
+  int64_t to = std::numeric_limits<int64_t>::max();
+  int open_index = -1;
+  bool update = true;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--no-update")
+      update = false;
+    else if ((arg == "--from" || arg == "--to") && i + 1 < argc)
+    {
+      if (!parseTime(argv[++i], arg == "--from" ? from : to))
+      {
+        std::cerr << "Invalid time: " << argv[i] << std::endl;
+        return -1;
+      }
+    }
+    else if (arg == "--open" && i + 1 < argc)
+      open_index = atoi(argv[++i]);
+    else if (arg == "--export" && i + 1 < argc)
+      export_directory = argv[++i];
+    else
+      pattern = arg;
+  }
+
+  LogCatalog catalog(LogCatalog::defaultFilename(root));
+  std::vector<LogCatalog::Match> matches;
+  try
+  {
+    bool loaded = catalog.load();
+    if (update || !loaded)
+    {
+      size_t indexed = catalog.update(root);
+      if (indexed || !loaded)
+        catalog.save();
+      std::cerr << indexed << " files indexed" << std::endl;
+    }
+
+    if (pattern.empty())
+    {
+      catalog.report(std::cout);
+      return 0;
+    }
+    matches = catalog.query(pattern, from, to);
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not catalog " << root << ": " << e.what() << std::endl;
+    return -1;
+  }
+
+  for (size_t i = 0; i < matches.size(); i++)
+  {
+    const LogCatalog::Stream &stream = *matches[i].stream;
+    std::cout << i << " " << matches[i].file->path << " " << stream.name
+              << " " << stream.samples
+              << " " << base::Time::fromMicroseconds(stream.first_time).toString()
+              << " " << base::Time::fromMicroseconds(stream.last_time).toString() << std::endl;
+  }
+
+  if (!export_directory.empty())
+  {
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+      const std::string &path = matches[i].file->path;
+      const std::string &stream_name = matches[i].stream->name;
+      try
+      {
+        // only this file: the other files of a split log are matches of their own
+        LogReader reader(std::vector<std::string>(1, path));
+
+        int total = reader.totalSamples(stream_name);
+        int start_index = 0, final_index = total;
+        if (from != std::numeric_limits<int64_t>::min())
+          start_index = reader.sampleIndexAt(stream_name, base::Time::fromMicroseconds(from));
+        if (to != std::numeric_limits<int64_t>::max())
+          final_index = reader.sampleIndexAt(stream_name, base::Time::fromMicroseconds(to));
+
+        std::string name = stream_name;
+        std::replace(name.begin(), name.end(), '/', '_');
+        std::string basename = path.substr(path.rfind('/') + 1);
+        std::string output = export_directory + "/" + basename.substr(0, basename.size() - 4) + "-" + name + ".log";
+
+        reader.exportStream(output, stream_name, start_index, final_index);
+        std::cout << "Saved " << final_index - start_index << " samples: " << output << std::endl;
+      }
+      catch (std::exception &e)
+      {
+        std::cerr << "Could not export " << stream_name << " from " << path << ": " << e.what() << std::endl;
+        return -1;
+      }
+    }
+  }
+
+  if (open_index >= 0)
+  {
+    if (open_index >= (int)matches.size())
+    {
+      std::cerr << "No match " << open_index << std::endl;
+      return -1;
+    }
+
+    int app_argc = 1;
+    QApplication app(app_argc, &program);
+
+    QLogViewer *viewer = NULL;
+    try
+    {
+      viewer = QLogViewer::create(QString::fromStdString(matches[open_index].file->path),
+                                  QString::fromStdString(matches[open_index].stream->name), 10);
+    }
+    catch (std::exception &e)
+    {
+      std::cerr << "Could not open " << matches[open_index].file->path << ": " << e.what() << std::endl;
+      return -1;
+    }
+
+    viewer->show();
+    return app.exec();
+  }
+
+  return 0;
+}
+
+static int resampleLog(int argc, char **argv)
+{
+  std::string filename = argv[0];
+  std::string output = argv[1];
+
+  double period = 0, maximum_gap = 0;
+  int64_t from = 0, to = 0;
+  std::string method = "linear";
+  std::vector<std::string> fields;
+
+  for (int i = 2; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--period" && i + 1 < argc)
+      period = atof(argv[++i]);
+    else if (arg == "--method" && i + 1 < argc)
+      method = argv[++i];
+    else if (arg == "--max-gap" && i + 1 < argc)
+      maximum_gap = atof(argv[++i]);
+    else if ((arg == "--from" || arg == "--to") && i + 1 < argc)
+    {
+      if (!parseTime(argv[++i], arg == "--from" ? from : to))
+      {
+        std::cerr << "Invalid time: " << argv[i] << std::endl;
+        return -1;
+      }
+    }
+    else
+      fields.push_back(arg);
+  }
+
+  try
+  {
+    LogReader reader(filename);
+
+    // --period and --max-gap are in milliseconds
+    Resampler resampler(&reader, Resampler::parseInterpolation(method));
+    resampler.setGrid((int64_t)(period * 1000), from, to);
+    resampler.setMaximumGap((int64_t)(maximum_gap * 1000));
+
+    for (std::vector<std::string>::iterator it = fields.begin(); it != fields.end(); it++)
+    {
+      size_t separator = it->rfind(':');
+      if (separator == std::string::npos)
+        throw std::runtime_error("Fields are given as <stream>:<field>, not " + *it);
+      resampler.addField(it->substr(0, separator), it->substr(separator + 1));
+    }
+
+    resampler.run();
+    resampler.write(output);
+    std::cout << "Saved " << resampler.times().size() << " points of " << resampler.names().size()
+              << " fields: " << output << std::endl;
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not resample " << filename << ": " << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
+  // options of the whole process, taken out wherever they are on the command line
+  QString variant;
+  int kept = 1;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--memory-budget" && i + 1 < argc)
+      MemoryBudget::instance().setLimit((size_t)atol(argv[++i]) * 1024 * 1024);
+    else if (arg == "--compact-sonar" && i + 1 < argc)
+    {
+      // keeps the bins of cached sonar pings on 8 or 16 bits
+      int bits = atoi(argv[++i]);
+      if (bits != 8 && bits != 16)
+      {
+        std::cerr << "--compact-sonar takes 8 or 16 bits." << std::endl;
+        return -1;
+      }
+      SonarPayloadCodec::setCacheBits(bits);
+    }
+    else if (arg == "--sparse-index" && i + 1 < argc)
+    {
+      // indexes every stream opened with one checkpoint every density samples
+      LogReader::setIndexDensity(atol(argv[++i]));
+    }
+    else if (arg == "--view" && i + 1 < argc)
+    {
+      // selects another viewer than the default one of the stream type
+      variant = argv[++i];
+    }
+    else
+      argv[kept++] = argv[i];
+  }
+  argc = kept;
+  argv[argc] = NULL;
 
   if (argc <= 1)
   {
@@ -15,9 +628,120 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  if (std::string(argv[1]) == "--recover")
+  {
+    if (argc <= 2)
+    {
+      std::cerr << "Inform log filename." << std::endl;
+      return -1;
+    }
+    return recoverLog(argv[2], (argc > 3) ? argv[3] : "");
+  }
+
+  if (std::string(argv[1]) == "--publish")
+  {
+    if (argc <= 3)
+    {
+      std::cerr << "Usage: " << argv[0] << " --publish <log> <shm-name> "
+                << "[--speed <factor>] [--capacity <MB>] [<stream>...]" << std::endl;
+      return -1;
+    }
+    return publishLog(argc - 2, argv + 2);
+  }
+
+  if (std::string(argv[1]) == "--stats")
+  {
+    if (argc <= 2)
+    {
+      std::cerr << "Usage: " << argv[0] << " --stats <log> [<stream>...]" << std::endl;
+      return -1;
+    }
+    return printStatistics(argc - 2, argv + 2);
+  }
+
+  if (std::string(argv[1]) == "--hash")
+  {
+    if (argc <= 2)
+    {
+      std::cerr << "Usage: " << argv[0] << " --hash <log>..." << std::endl;
+      return -1;
+    }
+    return hashLogs(argc - 2, argv + 2);
+  }
+
+  if (std::string(argv[1]) == "--verify")
+  {
+    if (argc <= 2)
+    {
+      std::cerr << "Usage: " << argv[0] << " --verify <exported-log> [<source-log> [<start-index>]]" << std::endl;
+      return -1;
+    }
+    return verifyLog(argc - 2, argv + 2);
+  }
+
+  if (std::string(argv[1]) == "--catalog")
+  {
+    if (argc <= 2)
+    {
+      std::cerr << "Usage: " << argv[0] << " --catalog <directory> [--no-update] [<stream-pattern> "
+                << "[--from <time>] [--to <time>] [--open <n>] [--export <directory>]]" << std::endl;
+      return -1;
+    }
+    return catalogLogs(argc - 2, argv + 2, argv[0]);
+  }
+
+  if (std::string(argv[1]) == "--export")
+  {
+    if (argc <= 4)
+    {
+      std::cerr << "Usage: " << argv[0] << " --export <log> <stream> <output.log|output.arrow> "
+                << "[--start <index>] [--end <index>] [--shards <count>] [--by-time] "
+                << "[--max-size <MB>] [--no-cache] [--sparse-index <density>]" << std::endl;
+      return -1;
+    }
+    return exportLog(argc - 2, argv + 2);
+  }
+
+  if (std::string(argv[1]) == "--resample")
+  {
+    if (argc <= 4)
+    {
+      std::cerr << "Usage: " << argv[0] << " --resample <log> <output.csv|output.arrow|output.log> "
+                << "--period <ms> [--method nearest|previous|linear] [--from <time>] [--to <time>] "
+                << "[--max-gap <ms>] <stream>:<field>..." << std::endl;
+      return -1;
+    }
+    return resampleLog(argc - 2, argv + 2);
+  }
+
+  if (std::string(argv[1]) == "--render")
+  {
+    if (argc <= 4)
+    {
+      std::cerr << "Usage: " << argv[0] << " --render <log> <stream> <output-prefix|file.raw> "
+                << "[--start <index>] [--end <index>] [--from <s>] [--to <s>] "
+                << "[--width <pixels>] [--gain <factor>]" << std::endl;
+      return -1;
+    }
+
+    // no display is needed, but image plugins are found through the application
+    QCoreApplication app(argc, argv);
+    return renderLog(argc - 2, argv + 2);
+  }
+
   QApplication app(argc, argv);
 
-  QLogViewer* viewer = QLogViewer::create(QString(argv[1]), 10);
+  QLogViewer* viewer = NULL;
+  try
+  {
+    viewer = QLogViewer::create(QString(argv[1]), 10, variant);
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Could not open " << argv[1] << ": " << e.what() << std::endl;
+    std::cerr << "Run with --recover to index a damaged log." << std::endl;
+    return -1;
+  }
 
   if (!viewer) return -1;
 